@@ -29,13 +29,16 @@ void NIWupdate(
 	       int nu0,            /* prior df */
 	       double **S0,        /* prior scale */
 	       int n_samp,         /* sample size */
-	       int n_dim)          /* dimension */
+	       int n_dim,          /* dimension */
+	       rngStream *rng,     /* random numbers, NULL for R's */
+	       Workspace *ws)      /* scratch memory */
 {
   int i,j,k;
-  double *Ybar = doubleArray(n_dim);
-  double *mun = doubleArray(n_dim);
-  double **Sn = doubleMatrix(n_dim, n_dim);
-  double **mtemp = doubleMatrix(n_dim, n_dim);
+  wsMark mark = wsGetMark(ws);
+  double *Ybar = wsDoubleArray(ws, n_dim);
+  double *mun = wsDoubleArray(ws, n_dim);
+  double **Sn = wsDoubleMatrix(ws, n_dim, n_dim);
+  double **mtemp = wsDoubleMatrix(ws, n_dim, n_dim);
 
   /*read data */
   for (j=0; j<n_dim; j++) {
@@ -61,17 +64,65 @@ void NIWupdate(
     }
 
   dinv(Sn, n_dim, mtemp);
-  rWish(InvSigma, mtemp, nu0+n_samp, n_dim);
+  rWish(InvSigma, mtemp, nu0+n_samp, n_dim, rng, ws);
   dinv(InvSigma, n_dim, Sigma);
  
   for (j=0; j<n_dim; j++)
     for (k=0; k<n_dim; k++)
       mtemp[j][k] = Sigma[j][k]/(tau0+n_samp);
 
-  rMVN(mu, mun, mtemp, n_dim);
+  rMVN(mu, mun, mtemp, n_dim, rng, ws);
 
-  free(Ybar);
-  free(mun);
-  FreeMatrix(Sn, n_dim);
-  FreeMatrix(mtemp, n_dim);
+  wsRelease(ws, mark);
+}
+
+/** Normal-InvWishart updating as in NIWupdate, from the sufficient
+    statistics of the n_samp rows of Y: their sum, and the sum of their
+    outer products (n_dim x n_dim, by rows) **/
+void NIWupdateStats(
+	       double *sum,        /* sum of the rows */
+	       double *ss,         /* sum of their outer products */
+	       double *mu,         /* mean */
+	       double **Sigma,     /* variance */
+	       double **InvSigma,  /* precision */
+	       double *mu0,        /* prior mean */
+	       double tau0,        /* prior scale */
+	       int nu0,            /* prior df */
+	       double **S0,        /* prior scale */
+	       int n_samp,         /* sample size */
+	       int n_dim,          /* dimension */
+	       rngStream *rng,     /* random numbers, NULL for R's */
+	       Workspace *ws)      /* scratch memory */
+{
+  int j,k;
+  wsMark mark = wsGetMark(ws);
+  double *Ybar = wsDoubleArray(ws, n_dim);
+  double *mun = wsDoubleArray(ws, n_dim);
+  double **Sn = wsDoubleMatrix(ws, n_dim, n_dim);
+  double **mtemp = wsDoubleMatrix(ws, n_dim, n_dim);
+
+  /* with no rows, a draw from the prior */
+  for (j=0; j<n_dim; j++)
+    Ybar[j] = n_samp ? sum[j]/n_samp : 0;
+
+  /* posterior updating: the scatter about Ybar is ss - n Ybar Ybar' */
+  for (j=0; j<n_dim; j++) 
+    {
+      mun[j] = (tau0*mu0[j]+n_samp*Ybar[j])/(tau0+n_samp);
+      for (k=0; k<n_dim; k++) 
+	Sn[j][k] = S0[j][k] + ss[j*n_dim+k] - n_samp*Ybar[j]*Ybar[k] +
+	  (tau0*n_samp)*(Ybar[j]-mu0[j])*(Ybar[k]-mu0[k])/(tau0+n_samp);
+    }
+
+  dinv(Sn, n_dim, mtemp);
+  rWish(InvSigma, mtemp, nu0+n_samp, n_dim, rng, ws);
+  dinv(InvSigma, n_dim, Sigma);
+ 
+  for (j=0; j<n_dim; j++)
+    for (k=0; k<n_dim; k++)
+      mtemp[j][k] = Sigma[j][k]/(tau0+n_samp);
+
+  rMVN(mu, mun, mtemp, n_dim, rng, ws);
+
+  wsRelease(ws, mark);
 }
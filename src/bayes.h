@@ -7,4 +7,8 @@
 
 void NIWupdate(double **Y, double *mu, double **Sigma, double **InvSigma,
 	       double *mu0, double tau0, int nu0, double **S0, 
-	       int n_samp, int n_dim); 
+	       int n_samp, int n_dim, rngStream *rng, Workspace *ws); 
+void NIWupdateStats(double *sum, double *ss, double *mu, double **Sigma,
+		    double **InvSigma, double *mu0, double tau0, int nu0,
+		    double **S0, int n_samp, int n_dim, rngStream *rng,
+		    Workspace *ws);
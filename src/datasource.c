@@ -0,0 +1,96 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <R.h>
+#include "datasource.h"
+
+/*
+ * Record sources for the online EM (cEMecoOnline).  A source is either
+ * a whitespace-separated text file, one record per line, read from disk
+ * a batch at a time so that the data never has to be held in memory, or
+ * the usual in-memory pdX vector.  Lines whose X or Y is not a number
+ * (e.g. NA) are skipped.
+ */
+
+/* path: text file, or "" to read n_samp records from pdX */
+ecoSource* openSource(const char *path, int header, int xcol, int ycol, double *pdX, int n_samp) {
+  ecoSource *src = (ecoSource *) Calloc(1, ecoSource);
+  src->header = header;
+  src->xcol = xcol;
+  src->ycol = ycol;
+  src->pdX = pdX;
+  src->n_samp = n_samp;
+  src->pos = 0;
+  src->file = NULL;
+  if (path && path[0]) {
+    src->file = fopen(path, "r");
+    if (!src->file) {
+      Free(src);
+      error("Unable to open data file %s\n", path);
+    }
+  }
+  rewindSource(src);
+  return src;
+}
+
+/* the number in column col of line, 0 if there is none */
+static int readColumn(char *line, int col, double *value) {
+  char *p = line, *end;
+  int j;
+  for (j = 0; ; j++) {
+    while (*p && isspace((unsigned char) *p)) p++;
+    if (!*p) return 0;
+    if (j == col) {
+      *value = strtod(p, &end);
+      return end != p && (!*end || isspace((unsigned char) *end));
+    }
+    while (*p && !isspace((unsigned char) *p)) p++;
+  }
+}
+
+/*
+ * reads up to max records into X and Y
+ * returns: the number read, 0 at the end of the pass, -1 if a line of
+ * the file is longer than SOURCE_LINE (its number is then in src->pos)
+ */
+int readSource(ecoSource *src, double *X, double *Y, int max) {
+  int m = 0;
+  if (!src->file) {
+    for (; m < max && src->pos < src->n_samp; m++, src->pos++) {
+      X[m] = src->pdX[src->pos];
+      Y[m] = src->pdX[src->n_samp + src->pos];
+    }
+    return m;
+  }
+  while (m < max && fgets(src->line, SOURCE_LINE, src->file)) {
+    src->pos++;
+    if (!strchr(src->line, '\n') && !feof(src->file))
+      return -1;
+    if (readColumn(src->line, src->xcol, &X[m]) && readColumn(src->line, src->ycol, &Y[m]))
+      m++;
+  }
+  return m;
+}
+
+/* back to the first record, for the next pass */
+void rewindSource(ecoSource *src) {
+  src->pos = 0;
+  if (src->file) {
+    rewind(src->file);
+    if (src->header && fgets(src->line, SOURCE_LINE, src->file))
+      src->pos++;
+  }
+}
+
+void closeSource(ecoSource *src) {
+  if (src->file) fclose(src->file);
+  Free(src);
+}
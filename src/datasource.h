@@ -0,0 +1,26 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <stdio.h>
+
+#define SOURCE_LINE 4096    /* longest line of a text source */
+
+/* a stream of (X, Y) records, read a batch at a time (see datasource.c) */
+typedef struct ecoSource {
+  FILE *file;               /* text file, NULL if reading from memory */
+  int header;               /* 1: the first line of the file holds column names */
+  int xcol, ycol;           /* 0-based columns of X and Y in the file */
+  double *pdX;              /* in memory: X then Y, as passed to cEMeco */
+  int n_samp;               /* in memory: number of records */
+  int pos;                  /* records (lines for a file) read in this pass */
+  char line[SOURCE_LINE];
+} ecoSource;
+
+ecoSource *openSource(const char *path, int header, int xcol, int ycol, double *pdX, int n_samp);
+int readSource(ecoSource *src, double *X, double *Y, int max);
+void rewindSource(ecoSource *src);
+void closeSource(ecoSource *src);
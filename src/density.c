@@ -0,0 +1,297 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <math.h>
+#include <stdint.h>
+#include "density.h"
+
+/*
+ * Batched bivariate normal densities, and the batched Metropolis step on
+ * the tomography lines.
+ * The loops below are written so that the compiler can vectorize them
+ * (exp and log are polynomials evaluated inline rather than libm calls).
+ * With GCC on x86-64 Linux, AVX-512 and AVX2 versions are built as well
+ * and the best one for the CPU is picked when the package is loaded;
+ * everywhere else the plain version is used.  Floating point traps are
+ * switched off for this file so that the range checks in the exp do not
+ * stop the vectorizer.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && \
+  defined(__x86_64__) && defined(__linux__)
+#pragma GCC optimize ("no-trapping-math")
+#define SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#define INLINE static inline __attribute__((always_inline))
+#else
+#define SIMD_CLONES
+#define INLINE static inline
+#endif
+
+#define EXP_MIN -708.0  /* below this exp() is (almost) subnormal, returned as 0 */
+#define EXP_MAX 709.0
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define ROUND_MAGIC 6755399441055744.0 /* 1.5*2^52 */
+#define LOG_SHIFT 0x00095f619980c433ULL /* the bits of 1 less those of sqrt(1/2) */
+#define ROUND_BITS 0x4330000000000000ULL /* the bits of 2^52 */
+
+/*
+ * exp(x) to within about 1 ulp: x = k*log(2) + r with |r| <= log(2)/2,
+ * exp(r) by its Taylor series up to r^12 and 2^k built in the exponent bits
+ */
+static inline double expInline(double x) {
+  union { double d; int64_t i; } kb, sc;
+  double xc, kd, r, p;
+
+  xc=(x < EXP_MIN) ? EXP_MIN : ((x > EXP_MAX) ? EXP_MAX : x);
+  kb.d=xc*M_LOG2E + ROUND_MAGIC;
+  kd=kb.d - ROUND_MAGIC;
+  r=(xc - kd*LN2_HI) - kd*LN2_LO;
+  p=1.0/479001600;
+  p=p*r + 1.0/39916800;
+  p=p*r + 1.0/3628800;
+  p=p*r + 1.0/362880;
+  p=p*r + 1.0/40320;
+  p=p*r + 1.0/5040;
+  p=p*r + 1.0/720;
+  p=p*r + 1.0/120;
+  p=p*r + 1.0/24;
+  p=p*r + 1.0/6;
+  p=p*r + 0.5;
+  p=p*r + 1.0;
+  p=p*r + 1.0;
+  sc.i=(kb.i + 1023) << 52;
+  return (x < EXP_MIN) ? 0.0 : p*sc.d;
+}
+
+/*
+ * log(x) for normal positive x, to within a few ulp: x = 2^k m with m in
+ * [sqrt(1/2), sqrt(2)), log(m) = 2 atanh(f) with f = (m-1)/(m+1) by its
+ * series up to f^21.  Only unsigned shifts and an exponent trick for k,
+ * so that AVX2 can vectorize it too
+ */
+static inline double logInline(double x) {
+  union { double d; uint64_t u; } xb, kb;
+  uint64_t e;
+  double kd, f, s, p;
+
+  xb.d=x;
+  e=(xb.u + LOG_SHIFT) >> 52;            /* k+1023 */
+  kb.u=e | ROUND_BITS;
+  kd=kb.d - (4503599627370496.0 + 1023); /* 2^52 + 1023 */
+  xb.u-=(e - 1023) << 52;
+  f=(xb.d - 1.0)/(xb.d + 1.0);
+  s=f*f;
+  p=1.0/21;
+  p=p*s + 1.0/19;
+  p=p*s + 1.0/17;
+  p=p*s + 1.0/15;
+  p=p*s + 1.0/13;
+  p=p*s + 1.0/11;
+  p=p*s + 1.0/9;
+  p=p*s + 1.0/7;
+  p=p*s + 1.0/5;
+  p=p*s + 1.0/3;
+  return kd*LN2_HI + (2*f*s*p + kd*LN2_LO) + 2*f;
+}
+
+/*
+ * Sets the constants of a bivariate normal with mean (mu0, mu1) and
+ * covariance matrix [s11 s12; s12 s22]
+ */
+void setBVNConst(bvnConst *c, double mu0, double mu1, double s11, double s12, double s22) {
+  double det=s11*s22-s12*s12;
+  c->mu[0]=mu0;
+  c->mu[1]=mu1;
+  c->prec[0]=s22/det;
+  c->prec[1]=-s12/det;
+  c->prec[2]=s11/det;
+  c->logc=-log(2*M_PI)-0.5*log(det);
+}
+
+/*
+ * Bivariate normal density at the points (W1s[j], W2s[j]), j=0..n-1
+ * give_log: 1 for log density, 0 for density
+ * mutates: out
+ */
+SIMD_CLONES
+void dBVNbatch(const double *W1s, const double *W2s, int n, const bvnConst *c, double *out, int give_log) {
+  int j;
+  double m0=c->mu[0], m1=c->mu[1];
+  double p00=c->prec[0], p01=c->prec[1], p11=c->prec[2], lc=c->logc;
+  double d0, d1, q;
+
+  if (give_log) {
+#pragma omp simd private(d0,d1)
+    for (j=0; j<n; j++) {
+      d0=W1s[j]-m0;
+      d1=W2s[j]-m1;
+      out[j]=lc-0.5*(p00*d0*d0 + 2*p01*d0*d1 + p11*d1*d1);
+    }
+  }
+  else {
+#pragma omp simd private(d0,d1,q)
+    for (j=0; j<n; j++) {
+      d0=W1s[j]-m0;
+      d1=W2s[j]-m1;
+      q=lc-0.5*(p00*d0*d0 + 2*p01*d0*d1 + p11*d1*d1);
+      out[j]=expInline(q);
+    }
+  }
+}
+
+/*
+ * In-place exp of x[0..n-1]
+ */
+SIMD_CLONES
+void vexp(double *x, int n) {
+  int j;
+#pragma omp simd
+  for (j=0; j<n; j++)
+    x[j]=expInline(x[j]);
+}
+
+/*
+ * sqrt(x) for normal positive x, to within a few ulp; a libm sqrt keeps
+ * its errno check even without errno, and that stops the vectorizer
+ */
+static inline double sqrtInline(double x) {
+  return expInline(0.5*logInline(x));
+}
+
+/*
+ * The point of the tomography line of precinct j at z, the coordinate
+ * of the proposal: W1 = lo + (hi-lo) expit(z).  Sets w1, w2, their
+ * logits l1, l2, and lj, the log-Jacobian of z -> (l1, l2) up to a
+ * constant; uu and vv get expit(z) and 1-expit(z)
+ */
+INLINE void linePoint(double z, double X, double Y, double lo, double hi,
+		      double *uu, double *vv, double *w1, double *w2,
+		      double *l1, double *l2, double *lj) {
+  double e=expInline(-fabs(z)), le=logInline(1+e);
+  double u=(z >= 0) ? 1/(1+e) : e/(1+e), v=(z >= 0) ? e/(1+e) : 1/(1+e);
+  double lw1, lv1, lw2, lv2;
+
+  *uu=u;
+  *vv=v;
+  *w1=lo+(hi-lo)*u;
+  *w2=(Y-X*(*w1))/(1-X);
+  lw1=logInline(*w1);
+  lv1=logInline(1-*w1);
+  lw2=logInline(*w2);
+  lv2=logInline(1-*w2);
+  *l1=lw1-lv1;
+  *l2=lw2-lv2;
+  *lj=-lw1-lv1-lw2-lv2 + ((z < 0) ? z : 0) + ((z >= 0) ? -z : 0) - 2*le;
+}
+
+/*
+ * One Newton step towards the mode in z of the log target on the line,
+ * a d0^2 + b d0 d1 + c d1^2 + lj with d = (l1, l2) - (m1, m2); its
+ * second derivative at z goes to *f2
+ */
+INLINE double lineNewton(double z, double X, double Y, double lo, double hi,
+			 double m1, double m2, double a, double b, double c,
+			 double *f2) {
+  double u, v, w1, w2, l1, l2, lj, A1, A2, b2, g0, g1, p1, p2, gp, gpp, D, f1, step;
+
+  linePoint(z, X, Y, lo, hi, &u, &v, &w1, &w2, &l1, &l2, &lj);
+  A1=1/(w1*(1-w1));
+  A2=1/(w2*(1-w2));
+  b2=-X/(1-X);
+  /* derivatives in W1 of the quadratic form and the Jacobian */
+  g0=2*a*(l1-m1)+b*(l2-m2);
+  g1=b*(l1-m1)+2*c*(l2-m2);
+  p1=A1;
+  p2=b2*A2;
+  gp=g0*p1+g1*p2+(2*w1-1)*A1+b2*(2*w2-1)*A2;
+  gpp=2*a*p1*p1+2*b*p1*p2+2*c*p2*p2+g0*(2*w1-1)*A1*A1+g1*b2*b2*(2*w2-1)*A2*A2 +
+    (w1*w1+(1-w1)*(1-w1))*A1*A1+b2*b2*(w2*w2+(1-w2)*(1-w2))*A2*A2;
+  /* and in z, with dW1/dz = (hi-lo) u v */
+  D=(hi-lo)*u*v;
+  f1=gp*D+(v-u);
+  *f2=gpp*D*D+gp*D*(v-u)-2*u*v;
+  step=(*f2 < 0) ? -f1/(*f2) : ((f1 > 0) ? 1.0 : -1.0);
+  step=(step > 2) ? 2 : ((step < -2) ? -2 : step);
+  return z+step;
+}
+
+/*
+ * One Metropolis step for the precincts from, ..., to-1 of mh on their
+ * tomography lines (Y_j = X_j W1_j + (1-X_j) W2_j).  The target is the
+ * bivariate normal density of (logit(W1), logit(W2)) with mean
+ * (m1[j*ms], m2[j*ms]) and the inverse covariance prec ([0][0], [0][1],
+ * [1][1]), times the Jacobian; its normalizing constant cancels in the
+ * ratio.  The proposal is independent of the current state: a t with 2
+ * df in z = logit((W1-lo)/(hi-lo)), so that it stays within the
+ * bounds, centred at the mode of the target in z and scaled to its
+ * curvature there.  They are fitted afresh in each call, by at most
+ * n_fit Newton steps from the midpoint of the line, so that the
+ * proposal depends on the means and prec alone and not on earlier
+ * draws, which would break the invariance of the step.  Z, L1, L2 and
+ * LJ hold the current state, so that only the proposal needs logs.
+ * u: 2 uniforms per precinct, u[2j] for the proposal and u[2j+1] for
+ *    the acceptance
+ * mutates: the state of mh on acceptance, Zm, Zs and n_acc
+ */
+SIMD_CLONES
+void mhLineBatch(mhLine *mh, int from, int to, const double *m1,
+		 const double *m2, int ms, const double *prec, int n_fit) {
+  int j, k, acc;
+  double a=-0.5*prec[0], b=-prec[1], c=-0.5*prec[2];
+  const double *X=mh->X, *Y=mh->Y, *lo=mh->lo, *hi=mh->hi, *u=mh->u;
+  double *W1=mh->W1, *W2=mh->W2, *Z=mh->Z, *L1=mh->L1, *L2=mh->L2, *LJ=mh->LJ;
+  double *Zm=mh->Zm, *Zs=mh->Zs;
+  int *n_acc=mh->n_acc;
+  double z, zm, zs, f2, x, p, uu, vv, w1, w2, l1, l2, lj, d0, d1, dnew, dold, dz;
+
+  /* Newton steps from the midpoint, until none of the batch moves by
+     more than MH_TOL; only the curvature of the last one is kept */
+#pragma omp simd
+  for (j=from; j<to; j++) {
+    Zm[j]=0;
+    Zs[j]=1;
+  }
+  for (k=0; k<n_fit; k++) {
+    dz=0;
+#pragma omp simd private(f2,z) reduction(max:dz)
+    for (j=from; j<to; j++) {
+      z=lineNewton(Zm[j], X[j], Y[j], lo[j], hi[j], m1[j*ms], m2[j*ms], a, b, c, &f2);
+      dz=(fabs(z-Zm[j]) > dz) ? fabs(z-Zm[j]) : dz;
+      Zm[j]=z;
+      Zs[j]=(f2 < 0) ? 1/sqrtInline(-f2) : Zs[j];
+    }
+    if (dz < MH_TOL)
+      break;
+  }
+
+#pragma omp simd private(acc,z,zm,zs,x,p,uu,vv,w1,w2,l1,l2,lj,d0,d1,dnew,dold)
+  for (j=from; j<to; j++) {
+    zm=Zm[j];
+    zs=Zs[j];
+    /* t with 2 df, by inversion */
+    p=u[2*j];
+    x=(2*p-1)/sqrtInline(2*p*(1-p));
+    z=zm+zs*x;
+    linePoint(z, X[j], Y[j], lo[j], hi[j], &uu, &vv, &w1, &w2, &l1, &l2, &lj);
+    d0=l1-m1[j*ms];
+    d1=l2-m2[j*ms];
+    dnew=a*d0*d0+b*d0*d1+c*d1*d1+lj+1.5*logInline(1+0.5*x*x);
+    d0=L1[j]-m1[j*ms];
+    d1=L2[j]-m2[j*ms];
+    x=(Z[j]-zm)/zs;
+    dold=a*d0*d0+b*d0*d1+c*d1*d1+LJ[j]+1.5*logInline(1+0.5*x*x);
+    /* a proposal off (0, 1), from rounding at the ends, is rejected */
+    acc=(w1>0) & (w1<1) & (w2>0) & (w2<1) & (logInline(u[2*j+1]) < dnew-dold);
+    W1[j]=acc ? w1 : W1[j];
+    W2[j]=acc ? w2 : W2[j];
+    Z[j]=acc ? z : Z[j];
+    L1[j]=acc ? l1 : L1[j];
+    L2[j]=acc ? l2 : L2[j];
+    LJ[j]=acc ? lj : LJ[j];
+    n_acc[j]+=acc;
+  }
+}
@@ -0,0 +1,43 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+/* callers that evaluate on stack buffers do so in batches of this size */
+#define BVN_BATCH 64
+
+/* constants of a bivariate normal, computed once and shared by a batch */
+typedef struct bvnConst {
+  double mu[2];
+  double prec[3];   /* inverse covariance: [0][0], [0][1], [1][1] */
+  double logc;      /* log of the normalizing constant, -log(2 pi) - log(det Sigma)/2 */
+} bvnConst;
+
+/* mhLineBatch stops its Newton steps once none moves z by more */
+#define MH_TOL 1e-3
+
+/* the precincts of the batched Metropolis sampler, see rMHSweep, as
+   structure of arrays: W1[k], W2[k] is the current state of precinct
+   idx[k] */
+typedef struct mhLine {
+  int n;           /* number of precincts */
+  int *idx;        /* their rows in X and W */
+  double *X, *Y;   /* data */
+  double *lo, *hi; /* bounds of W1 */
+  double *W1, *W2; /* current state */
+  double *Z;       /* its logit((W1-lo)/(hi-lo)), where the proposal is */
+  double *L1, *L2, *LJ; /* its logit(W1), logit(W2), and the log-Jacobian
+			   of Z -> (logit(W1), logit(W2)) */
+  double *Zm, *Zs; /* location and scale of the proposal of this sweep */
+  double *m1, *m2; /* means, for callers whose means differ by precinct */
+  double *u;       /* uniforms, 2 per precinct */
+  int *n_acc;      /* acceptances */
+} mhLine;
+
+void setBVNConst(bvnConst *c, double mu0, double mu1, double s11, double s12, double s22);
+void dBVNbatch(const double *W1s, const double *W2s, int n, const bvnConst *c, double *out, int give_log);
+void vexp(double *x, int n);
+void mhLineBatch(mhLine *mh, int from, int to, const double *m1,
+		 const double *m2, int ms, const double *prec, int n_fit);
@@ -0,0 +1,341 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <stdlib.h>
+#include <math.h>
+#include <Rmath.h>
+#include <R_ext/Utils.h>
+#include <R.h>
+#include "vector.h"
+#include "diagnostic.h"
+
+/*
+ * Convergence diagnostics of the Gibbs samplers run with several chains.
+ * Each chain is split in two halves, so that a chain that is still
+ * drifting also shows up.  R-hat is the split R-hat of Gelman et al.
+ * (2013, Bayesian Data Analysis, 3rd ed., Sec. 11.4); the effective sample
+ * size is the bulk ESS of Vehtari et al. (2021, Bayesian Analysis 16,
+ * 667-718), computed on the rank-normalized draws.
+ */
+
+/* split R-hat of m sequences of length n, stored one after the other */
+static double splitRhat(double *x, int m, int n) {
+  int s, k;
+  double mean, var, W = 0, B = 0, grand = 0, d;
+  double *means = doubleArray(m);
+
+  for (s = 0; s < m; s++) {
+    mean = 0;
+    for (k = 0; k < n; k++) mean += x[s*n+k];
+    mean /= n;
+    var = 0;
+    for (k = 0; k < n; k++) {
+      d = x[s*n+k] - mean;
+      var += d*d;
+    }
+    W += var / (n-1);
+    means[s] = mean;
+    grand += mean;
+  }
+  W /= m;
+  grand /= m;
+  for (s = 0; s < m; s++) {
+    d = means[s] - grand;
+    B += d*d;
+  }
+  B /= (m-1);          /* B/n in the notation of Gelman et al. */
+  free(means);
+
+  if (W <= 0) return NA_REAL;
+  return sqrt(((double)(n-1)/n * W + B) / W);
+}
+
+/* replaces the N values of x by the normal scores of their ranks,
+   averaging the ranks of ties */
+static void rankNormalize(double *x, int N) {
+  int i, j, k;
+  int *idx = intArray(N);
+  double *v = doubleArray(N);
+  double r;
+
+  for (i = 0; i < N; i++) {
+    v[i] = x[i];
+    idx[i] = i;
+  }
+  rsort_with_index(v, idx, N);
+  for (i = 0; i < N; i = j) {
+    for (j = i+1; j < N && v[j] == v[i]; j++)
+      ;
+    r = (i + j + 1) / 2.0;   /* average of the ranks i+1, ..., j */
+    for (k = i; k < j; k++)
+      x[idx[k]] = qnorm((r - 0.375) / (N + 0.25), 0.0, 1.0, 1, 0);
+  }
+  free(idx);
+  free(v);
+}
+
+/* effective sample size of m sequences of length n, with Geyer's initial
+   monotone sequence estimator of the autocorrelations (as in Stan) */
+static double essSeq(double *x, int m, int n) {
+  int s, k, t, max_t, N = m*n;
+  double *means = doubleArray(m);
+  double *rho = doubleArray(n+1);
+  double mean_var = 0, var_plus, var_means = 0, grand = 0, acov, d, tau;
+  double rho_even, rho_odd;
+
+  for (s = 0; s < m; s++) {
+    for (k = 0; k < n; k++) means[s] += x[s*n+k];
+    means[s] /= n;
+    grand += means[s];
+  }
+  grand /= m;
+  for (s = 0; s < m; s++) {
+    d = means[s] - grand;
+    var_means += d*d;
+  }
+  if (m > 1) var_means /= (m-1);
+
+  /* mean over the sequences of the autocovariance at lag t */
+#define MEAN_ACOV(t, out) {						\
+    out = 0;								\
+    for (s = 0; s < m; s++)						\
+      for (k = 0; k+(t) < n; k++)					\
+	out += (x[s*n+k]-means[s]) * (x[s*n+k+(t)]-means[s]);		\
+    out /= (double) m*n;						\
+  }
+
+  MEAN_ACOV(0, acov);
+  mean_var = acov * n / (n-1);
+  var_plus = mean_var * (n-1) / n + var_means;
+  if (var_plus <= 0) {
+    free(means);
+    free(rho);
+    return NA_REAL;
+  }
+
+  rho[0] = 1;
+  MEAN_ACOV(1, acov);
+  rho_even = 1;
+  rho_odd = rho[1] = 1 - (mean_var - acov) / var_plus;
+  t = 1;
+  while (t < n-5 && rho_even + rho_odd > 0) {
+    MEAN_ACOV(t+1, acov);
+    rho_even = 1 - (mean_var - acov) / var_plus;
+    MEAN_ACOV(t+2, acov);
+    rho_odd = 1 - (mean_var - acov) / var_plus;
+    if (rho_even + rho_odd >= 0) {
+      rho[t+1] = rho_even;
+      rho[t+2] = rho_odd;
+    }
+    t += 2;
+  }
+#undef MEAN_ACOV
+  max_t = t;   /* a last pair that was not kept is left at 0 */
+
+  /* make the sums of pairs monotone */
+  for (t = 1; t <= max_t-2; t += 2)
+    if (rho[t+1] + rho[t+2] > rho[t-1] + rho[t]) {
+      rho[t+1] = (rho[t-1] + rho[t]) / 2;
+      rho[t+2] = rho[t+1];
+    }
+
+  tau = -1;
+  for (t = 0; t <= max_t; t++) tau += 2 * rho[t];
+  free(means);
+  free(rho);
+  tau = fmax2(tau, 1 / log10((double) N));
+  return N / tau;
+}
+
+/*
+ * draws: n_chains blocks of n_draws draws of one quantity
+ * mutates: rhat, ess (NA if there are too few draws)
+ */
+void mcmcDiag(double *draws, int n_chains, int n_draws, double *rhat, double *ess) {
+  int c, h, k, m = 2*n_chains, n = n_draws/2;
+  double *x;
+
+  if (n < 4) {
+    *rhat = *ess = NA_REAL;
+    return;
+  }
+  /* the two halves of each chain; the middle draw of an odd
+     length chain is left out */
+  x = doubleArray(m*n);
+  for (c = 0; c < n_chains; c++)
+    for (h = 0; h < 2; h++)
+      for (k = 0; k < n; k++)
+	x[(2*c+h)*n+k] = draws[c*n_draws + h*(n_draws-n) + k];
+
+  *rhat = splitRhat(x, m, n);
+  rankNormalize(x, m*n);
+  *ess = essSeq(x, m, n);
+  free(x);
+}
+
+
+/*
+ * Streaming summaries of the draws, for when there are too many to be
+ * stored: the mean and the variance (Welford), and two quantiles with
+ * the P^2 algorithm of Jain and Chlamtac (1985, Communications of the
+ * ACM 28, 1076-1085), which follows each quantile with five markers.
+ * The memory does not grow with the number of draws.
+ */
+
+drawSummary *newSummary(int n, double *p) {
+  drawSummary *s = (drawSummary *) Calloc(1, drawSummary);
+  s->n = n;
+  s->count = 0;
+  s->p[0] = p[0];
+  s->p[1] = p[1];
+  s->mean = doubleArray(n);
+  s->ss = doubleArray(n);
+  s->q = doubleArray(n*10);
+  s->pos = doubleArray(n*10);
+  return s;
+}
+
+void FreeSummary(drawSummary *s) {
+  free(s->mean);
+  free(s->ss);
+  free(s->q);
+  free(s->pos);
+  Free(s);
+}
+
+/* the P^2 markers q (heights) and pos (positions) of the p quantile,
+   given x after count draws; the first five draws are kept as they are */
+static void p2Add(double *q, double *pos, double p, int count, double x) {
+  int j, k;
+  double d, qp, want;
+  double dn[5] = {0, p/2, p, (1+p)/2, 1};
+
+  if (count < 5) {
+    q[count] = x;
+    if (count == 4) {
+      R_rsort(q, 5);
+      for (j = 0; j < 5; j++) pos[j] = j+1;
+    }
+    return;
+  }
+  if (x < q[0]) {
+    q[0] = x;
+    k = 0;
+  }
+  else if (x >= q[4]) {
+    q[4] = x;
+    k = 3;
+  }
+  else
+    for (k = 0; x >= q[k+1]; k++)
+      ;
+  for (j = k+1; j < 5; j++) pos[j]++;
+
+  /* move the middle markers towards their desired positions, along a
+     parabola through their neighbours when it stays between them */
+  for (j = 1; j < 4; j++) {
+    want = 1 + count*dn[j];
+    d = want - pos[j];
+    if ((d >= 1 && pos[j+1]-pos[j] > 1) || (d <= -1 && pos[j-1]-pos[j] < -1)) {
+      d = (d > 0) ? 1 : -1;
+      qp = q[j] + d/(pos[j+1]-pos[j-1]) *
+	((pos[j]-pos[j-1]+d)*(q[j+1]-q[j])/(pos[j+1]-pos[j]) +
+	 (pos[j+1]-pos[j]-d)*(q[j]-q[j-1])/(pos[j]-pos[j-1]));
+      if (!(q[j-1] < qp && qp < q[j+1]))
+	qp = q[j] + d*(q[j+(int)d]-q[j])/(pos[j+(int)d]-pos[j]);
+      q[j] = qp;
+      pos[j] += d;
+    }
+  }
+}
+
+/* the p quantile from the markers after count draws */
+static double p2Quantile(double *q, double p, int count) {
+  double v[5], h;
+  int j;
+
+  if (count == 0) return NA_REAL;
+  if (count >= 5) return q[2];
+  /* as quantile() in R, from the draws themselves */
+  for (j = 0; j < count; j++) v[j] = q[j];
+  R_rsort(v, count);
+  h = (count-1)*p;
+  j = (int) h;
+  if (j+1 >= count) return v[count-1];
+  return v[j] + (h-j)*(v[j+1]-v[j]);
+}
+
+/* the next draw of quantity i; every quantity takes one draw before
+   s->count is incremented */
+void summaryAdd(drawSummary *s, int i, double x) {
+  int c = s->count;
+  double d = x - s->mean[i];
+
+  s->mean[i] += d / (c+1);
+  s->ss[i] += d * (x - s->mean[i]);
+  p2Add(s->q+i*10, s->pos+i*10, s->p[0], c, x);
+  p2Add(s->q+i*10+5, s->pos+i*10+5, s->p[1], c, x);
+}
+
+/*
+ * a kept draw of W: W1 and W2 of unit i are the quantities 2i and 2i+1
+ * aggW: n_unit x 2*n_agg weights; columns 2a and 2a+1 aggregate W1 and W2
+ * mutates: s, agg (the 2*n_agg aggregates of this draw)
+ */
+void summaryDrawW(drawSummary *s, double **W, int n_unit, double *aggW,
+		  int n_agg, double *agg, int n_threads) {
+  int i, a;
+  double a1, a2;
+
+#pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1)
+  for (i = 0; i < n_unit; i++) {
+    summaryAdd(s, 2*i, W[i][0]);
+    summaryAdd(s, 2*i+1, W[i][1]);
+  }
+  s->count++;
+
+  for (a = 0; a < n_agg; a++) {
+    a1 = a2 = 0;
+    for (i = 0; i < n_unit; i++) {
+      a1 += aggW[2*a*n_unit+i] * W[i][0];
+      a2 += aggW[(2*a+1)*n_unit+i] * W[i][1];
+    }
+    agg[2*a] = a1;
+    agg[2*a+1] = a2;
+  }
+}
+
+/*
+ * pools the summaries of the chains: the mean and the standard
+ * deviation are those of all the draws, the quantiles are the averages
+ * of those of the chains
+ * mutates: out, with mean, sd and the two quantiles of each quantity
+ */
+void summaryWrite(drawSummary **s, int n_chains, double *out) {
+  int i, c, count, n = s[0]->n;
+  double mean, ss, d, lo, hi;
+
+  for (i = 0; i < n; i++) {
+    mean = ss = lo = hi = 0;
+    count = 0;
+    for (c = 0; c < n_chains; c++) {
+      mean += s[c]->count * s[c]->mean[i];
+      count += s[c]->count;
+    }
+    mean /= count;
+    for (c = 0; c < n_chains; c++) {
+      d = s[c]->mean[i] - mean;
+      ss += s[c]->ss[i] + s[c]->count * d*d;
+      lo += p2Quantile(s[c]->q+i*10, s[c]->p[0], s[c]->count);
+      hi += p2Quantile(s[c]->q+i*10+5, s[c]->p[1], s[c]->count);
+    }
+    out[4*i] = mean;
+    out[4*i+1] = (count > 1) ? sqrt(ss/(count-1)) : NA_REAL;
+    out[4*i+2] = lo/n_chains;
+    out[4*i+3] = hi/n_chains;
+  }
+}
@@ -0,0 +1,24 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+void mcmcDiag(double *draws, int n_chains, int n_draws, double *rhat, double *ess);
+
+/* streaming summary of the draws of n quantities */
+typedef struct drawSummary {
+  int n;                  /* number of quantities */
+  int count;              /* draws of each so far */
+  double p[2];            /* probabilities of the two quantiles */
+  double *mean, *ss;      /* means and sums of squared deviations */
+  double *q, *pos;        /* P^2 markers, 5 per quantile: heights, positions */
+} drawSummary;
+
+drawSummary *newSummary(int n, double *p);
+void FreeSummary(drawSummary *s);
+void summaryAdd(drawSummary *s, int i, double x);
+void summaryDrawW(drawSummary *s, double **W, int n_unit, double *aggW,
+		  int n_agg, double *agg, int n_threads);
+void summaryWrite(drawSummary **s, int n_chains, double *out);
@@ -0,0 +1,819 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <Rmath.h>
+#include <R.h>
+#include <Rinternals.h>
+#include "vector.h"
+#include "subroutines.h"
+#include "rand.h"
+#include "bayes.h"
+#include "density.h"
+#include "dpcluster.h"
+
+/*
+ * The cluster table of the Dirichlet process samplers (cDPeco,
+ * cDPecoX).  Observations in the same cluster share their parameters,
+ * so the Polya urn that reassigns observation i weighs each cluster
+ * once, by its count times the density of i under its parameters,
+ * rather than each of the other observations: a sweep costs O(n K)
+ * densities instead of O(n^2).
+ *
+ * The table also keeps the sufficient statistics of each cluster (its
+ * count, the sum of its members and the sum of their outer products),
+ * updated as observations join, leave or move, so that the parameters
+ * are redrawn from them (dpUpdate) without gathering the members.
+ *
+ * The blocked Gibbs sampler (Ishwaran and James, 2001, JASA 96:161-173)
+ * uses the same table for the stick-breaking representation of the
+ * process truncated at n_max sticks: there the clusters are the sticks,
+ * all in use whether they have members or not.  Given the weights of
+ * the sticks and their parameters the labels are independent, and
+ * dpRelabel draws them on several threads.
+ */
+
+/* doubles of dens per cluster */
+static int dpStride(int n_dim) {
+  return n_dim + n_dim*(n_dim+1)/2 + 1;
+}
+
+/* room for n_max clusters of dimension n_dim (at most 3), none in use;
+   the base measure is NIW with mu0, tau0, nu0, S0 (not copied) */
+dpTable *newDPTable(int n_max, int n_dim, double *mu0, double tau0,
+		    int nu0, double **S0) {
+  dpTable *t = (dpTable *) Calloc(1, dpTable);
+  int k;
+
+  t->n_max = n_max;
+  t->n_dim = n_dim;
+  t->nstar = 0;
+  t->id = intArray(n_max);
+  t->pos = intArray(n_max);
+  t->count = intArray(n_max);
+  for (k=0; k<n_max; k++) {
+    t->id[k] = t->pos[k] = k;
+    t->count[k] = 0;
+  }
+  t->mu = doubleMatrix(n_max, n_dim);
+  t->Sigma = doubleMatrix3D(n_max, n_dim, n_dim);
+  t->InvSigma = doubleMatrix3D(n_max, n_dim, n_dim);
+  t->dens = doubleArray(n_max*dpStride(n_dim));
+  t->q = doubleArray(n_max+1);
+  t->sum = doubleArray(n_max*n_dim);
+  t->ss = doubleArray(n_max*n_dim*n_dim);
+  t->slot = intArray(n_max);
+  t->memb = intArray(n_max);
+  t->side = intArray(2*n_max);
+  for (k=0; k<n_max*n_dim; k++)
+    t->sum[k] = 0;
+  for (k=0; k<n_max*n_dim*n_dim; k++)
+    t->ss[k] = 0;
+  t->mu0 = mu0;
+  t->tau0 = tau0;
+  t->nu0 = nu0;
+  t->S0 = S0;
+  t->lw = t->qt = t->u = t->lpc = NULL;
+  t->n_threads = 1;
+  return t;
+}
+
+void FreeDPTable(dpTable *t) {
+  free(t->id);
+  free(t->pos);
+  free(t->count);
+  FreeMatrix(t->mu, t->n_max);
+  Free3DMatrix(t->Sigma, t->n_max, t->n_dim);
+  Free3DMatrix(t->InvSigma, t->n_max, t->n_dim);
+  free(t->dens);
+  free(t->q);
+  free(t->sum);
+  free(t->ss);
+  free(t->slot);
+  free(t->memb);
+  free(t->side);
+  free(t->lpc);
+  free(t->lw);
+  free(t->qt);
+  free(t->u);
+  Free(t);
+}
+
+/* a free cluster, now in use with no members; its parameters are set
+   by the caller */
+int dpNew(dpTable *t) {
+  int k = t->id[t->nstar++];
+  t->count[k] = 0;
+  return k;
+}
+
+/* adds c times Y to the statistics sum, ss of dimension d */
+static void addStats(double *sum, double *ss, int d, double *Y, double c) {
+  int j, l;
+
+  for (j=0; j<d; j++) {
+    sum[j] += c*Y[j];
+    for (l=0; l<d; l++)
+      ss[j*d+l] += c*Y[j]*Y[l];
+  }
+}
+
+/* adds c times Y to the statistics of cluster k */
+static void dpAdd(dpTable *t, int k, double *Y, double c) {
+  int d = t->n_dim;
+
+  addStats(t->sum + k*d, t->ss + k*d*d, d, Y, c);
+}
+
+/* Y joins cluster k */
+void dpJoin(dpTable *t, int k, double *Y) {
+  t->count[k]++;
+  dpAdd(t, k, Y, 1);
+}
+
+/* Y leaves cluster k; a cluster left with no members is freed */
+void dpLeave(dpTable *t, int k, double *Y) {
+  int j, last, m, d = t->n_dim;
+
+  if (--t->count[k] > 0) {
+    dpAdd(t, k, Y, -1);
+    return;
+  }
+  /* exactly 0, rather than what the rounding leaves */
+  for (j=0; j<d; j++)
+    t->sum[k*d+j] = 0;
+  for (j=0; j<d*d; j++)
+    t->ss[k*d*d+j] = 0;
+  t->nstar--;
+  last = t->id[t->nstar];
+  m = t->pos[k];
+  t->id[m] = last; t->pos[last] = m;
+  t->id[t->nstar] = k; t->pos[k] = t->nstar;
+}
+
+/* a member of cluster k moves from Yold to Y */
+void dpMove(dpTable *t, int k, double *Yold, double *Y) {
+  dpAdd(t, k, Yold, -1);
+  dpAdd(t, k, Y, 1);
+}
+
+/*
+ * Recomputes the statistics of the clusters from their members, Y[i]
+ * in cluster C[i], i < n: the updates of the statistics are not exact,
+ * and their rounding errors would otherwise add up over a long run
+ */
+void dpRefresh(dpTable *t, double **Y, int *C, int n) {
+  int i, m, j, d = t->n_dim;
+
+  for (m=0; m<t->nstar; m++) {
+    for (j=0; j<d; j++)
+      t->sum[t->id[m]*d+j] = 0;
+    for (j=0; j<d*d; j++)
+      t->ss[t->id[m]*d*d+j] = 0;
+  }
+  for (i=0; i<n; i++)
+    dpAdd(t, C[i], Y[i], 1);
+}
+
+/* to be called when the parameters of cluster k change */
+void dpSetDens(dpTable *t, int k) {
+  int j, l, d = t->n_dim;
+  double *p = t->dens + (size_t) k*dpStride(d);
+
+  for (j=0; j<d; j++)
+    *p++ = t->mu[k][j];
+  for (j=0; j<d; j++)
+    for (l=j; l<d; l++)
+      *p++ = t->InvSigma[k][j][l];
+  *p = -0.5*d*log(2*M_PI) + 0.5*ddet(t->InvSigma[k], d, 1);
+}
+
+/* draws the parameters of cluster k from their posterior given its
+   members, or from the base measure if it has none */
+void dpUpdate(dpTable *t, int k, rngStream *rng, Workspace *ws) {
+  int d = t->n_dim;
+
+  NIWupdateStats(t->sum + k*d, t->ss + k*d*d, t->mu[k], t->Sigma[k],
+		 t->InvSigma[k], t->mu0, t->tau0, t->nu0, t->S0,
+		 t->count[k], d, rng, ws);
+  dpSetDens(t, k);
+}
+
+/* redraws the parameters of all the clusters */
+void dpRemix(dpTable *t, rngStream *rng, Workspace *ws) {
+  int m;
+
+  for (m=0; m<t->nstar; m++)
+    dpUpdate(t, t->id[m], rng, ws);
+}
+
+/*
+ * q[m]: the log density of Y under the parameters of cluster id[m], plus
+ * lw[id[m]] unless lw is NULL, for the clusters in use
+ * returns: the largest of them and qmax
+ */
+static double dpLogDens(dpTable *t, double *Y, double *lw, double *q, double qmax) {
+  int d = t->n_dim, s = dpStride(d), n = t->nstar, j, l, m;
+  double *p, r[3], v;
+
+  for (m=0; m<n; m++) {
+    p = t->dens + (size_t) t->id[m]*s;
+    for (j=0; j<d; j++)
+      r[j] = Y[j]-p[j];
+    p += d;
+    v = 0;
+    for (j=0; j<d; j++) {
+      v += *p++ * r[j]*r[j];
+      for (l=j+1; l<d; l++)
+	v += 2 * *p++ * r[j]*r[l];
+    }
+    q[m] = *p - 0.5*v;
+    if (lw) q[m] += lw[t->id[m]];
+    if (q[m] > qmax) qmax = q[m];
+  }
+  return qmax;
+}
+
+/*
+ * Draws the cluster of an observation Y that is in none, from the Polya
+ * urn: cluster k with weight count[k] N(Y; mu[k], Sigma[k]), a new one
+ * with weight exp(lq0).
+ * u: a uniform
+ * returns: the cluster, or -1 for a new one
+ */
+int dpDraw(dpTable *t, double *Y, double lq0, double u) {
+  int n = t->nstar, m;
+  double *q = t->q, qmax, sum;
+
+  qmax = dpLogDens(t, Y, NULL, q, lq0);
+  q[n] = lq0;
+
+  /* scaled by the largest, so that they do not all underflow */
+  for (m=0; m<=n; m++)
+    q[m] -= qmax;
+  vexp(q, n+1);
+  sum = q[n];
+  for (m=0; m<n; m++) {
+    q[m] *= t->count[t->id[m]];
+    sum += q[m];
+  }
+
+  u *= sum;
+  for (m=0; m<n; m++) {
+    u -= q[m];
+    if (u < 0)
+      return t->id[m];
+  }
+  return -1;
+}
+
+/*
+ * Split-merge moves (Jain and Neal, 2004, JCGS 13:158-182) for the
+ * Polya urn, which moves one observation at a time and so splits or
+ * merges clusters only slowly.  The parameters are integrated out, with
+ * the marginal likelihood of the Normal-InvWishart base measure; those
+ * of the clusters a move changes are then drawn given their members.
+ */
+
+/* the log determinant of the posterior scale S0 + scatter + prior term
+   of n rows with sum and ss, from (S0 + tau0 mu0 mu0') + ss - b b'/(tau0
+   + n) with b = sum + tau0 mu0, in closed form as n_dim <= 3 */
+static double dpLogDetSn(dpTable *t, int n, double *sum, double *ss) {
+  int j, k, d = t->n_dim;
+  double S[9], b[3];
+
+  for (j=0; j<d; j++)
+    b[j] = sum[j] + t->tau0*t->mu0[j];
+  for (j=0; j<d; j++)
+    for (k=0; k<d; k++)
+      S[j*d+k] = t->S0[j][k] + t->tau0*t->mu0[j]*t->mu0[k] + ss[j*d+k] -
+	b[j]*b[k]/(t->tau0+n);
+  if (d == 1)
+    return log(S[0]);
+  if (d == 2)
+    return log(S[0]*S[3]-S[1]*S[2]);
+  return log(S[0]*(S[4]*S[8]-S[5]*S[7]) - S[1]*(S[3]*S[8]-S[5]*S[6]) +
+	     S[2]*(S[3]*S[7]-S[4]*S[6]));
+}
+
+/* the log marginal likelihood of n rows, with sum and sum of outer
+   products ss, in one cluster */
+static double dpLogML(dpTable *t, int n, double *sum, double *ss) {
+  int j, d = t->n_dim;
+  double l;
+
+  l = -0.5*n*d*log(M_PI) + 0.5*d*log(t->tau0/(t->tau0+n)) +
+    0.5*t->nu0*ddet(t->S0, d, 1) - 0.5*(t->nu0+n)*dpLogDetSn(t, n, sum, ss);
+  for (j=0; j<d; j++)
+    l += lgammafn(0.5*(t->nu0+n-j)) - lgammafn(0.5*(t->nu0-j));
+  return l;
+}
+
+/* the log predictive density of Y given n rows with sum and ss; lpc[n]
+   holds its terms that only depend on n */
+static double dpLogPred(dpTable *t, int n, double *sum, double *ss, double *Y) {
+  int j, d = t->n_dim;
+  double sum1[3], ss1[9];
+
+  for (j=0; j<d; j++)
+    sum1[j] = sum[j];
+  for (j=0; j<d*d; j++)
+    ss1[j] = ss[j];
+  addStats(sum1, ss1, d, Y, 1);
+  return t->lpc[n] + 0.5*(t->nu0+n)*dpLogDetSn(t, n, sum, ss) -
+    0.5*(t->nu0+n+1)*dpLogDetSn(t, n+1, sum1, ss1);
+}
+
+/*
+ * A restricted Gibbs scan: Y[memb[s]], s < m, each in turn goes to one
+ * of two clusters, side[s] (0 or 1); cnt, sum and ss hold the statistics
+ * of the two, by side.  With fix, the members are not drawn but put on
+ * the side fix[s].
+ * returns: the log probability of the scan's choices
+ */
+static double dpScan(dpTable *t, double **Y, int *memb, int *side, int m,
+		     int *cnt, double *sum, double *ss, int *fix,
+		     rngStream *rng) {
+  int s, a, d = t->n_dim;
+  double *y, lp[2], p1, lq = 0;
+
+  for (s=0; s<m; s++) {
+    y = Y[memb[s]];
+    a = side[s];
+    cnt[a]--;
+    addStats(sum + a*d, ss + a*d*d, d, y, -1);
+    for (a=0; a<2; a++)
+      lp[a] = log((double) cnt[a]) +
+	dpLogPred(t, cnt[a], sum + a*d, ss + a*d*d, y);
+    p1 = 1/(1+exp(lp[0]-lp[1]));
+    a = fix ? fix[s] : (rngUnif(rng) < p1);
+    lq += log(a ? p1 : 1-p1);
+    side[s] = a;
+    cnt[a]++;
+    addStats(sum + a*d, ss + a*d*d, d, y, 1);
+  }
+  return lq;
+}
+
+/* moves Y[k] from its cluster to cluster b */
+static void dpShift(dpTable *t, double **Y, int *C, int k, int b) {
+  dpLeave(t, C[k], Y[k]);
+  dpJoin(t, b, Y[k]);
+  C[k] = b;
+}
+
+/*
+ * One split-merge move on the observations Y[i] in clusters C[i], i < n
+ * (at most n_max), with n_scan intermediate restricted Gibbs scans.
+ * stat: 1 is added to stat[0] for a proposed split, stat[1] for an
+ * accepted one, stat[2] for a proposed merge and stat[3] for an
+ * accepted one
+ */
+void dpSplitMerge(dpTable *t, double **Y, int *C, int n, double alpha,
+		  int n_scan, double *stat, rngStream *rng, Workspace *ws) {
+  int d = t->n_dim, i, j, ci, cj, k, s, m = 0, cnt[2];
+  int *memb = t->memb, *side = t->side, *orig = t->side + t->n_max;
+  double sum[6], ss[18], lr;
+
+  if (n < 2)
+    return;
+  if (!t->lpc) {
+    t->lpc = doubleArray(t->n_max+1);
+    for (k=0; k<=t->n_max; k++) {
+      t->lpc[k] = -0.5*d*log(M_PI) + 0.5*d*log((t->tau0+k)/(t->tau0+k+1));
+      for (s=0; s<d; s++)
+	t->lpc[k] += lgammafn(0.5*(t->nu0+k+1-s)) - lgammafn(0.5*(t->nu0+k-s));
+    }
+  }
+  i = (int) (n*rngUnif(rng));
+  j = (int) ((n-1)*rngUnif(rng));
+  if (j >= i) j++;
+  ci = C[i]; cj = C[j];
+
+  /* the launch state: i and j apart, the others of their clusters on a
+     side drawn at random, then scanned n_scan times */
+  cnt[0] = cnt[1] = 1;
+  for (k=0; k<2*d; k++)
+    sum[k] = 0;
+  for (k=0; k<2*d*d; k++)
+    ss[k] = 0;
+  addStats(sum, ss, d, Y[i], 1);
+  addStats(sum + d, ss + d*d, d, Y[j], 1);
+  for (k=0; k<n; k++)
+    if (k != i && k != j && (C[k] == ci || C[k] == cj)) {
+      memb[m] = k;
+      orig[m] = (C[k] == cj && ci != cj);
+      side[m] = (rngUnif(rng) < 0.5);
+      cnt[side[m]]++;
+      addStats(sum + side[m]*d, ss + side[m]*d*d, d, Y[k], 1);
+      m++;
+    }
+  for (s=0; s<n_scan; s++)
+    dpScan(t, Y, memb, side, m, cnt, sum, ss, NULL, rng);
+
+  if (ci == cj) {
+    /* split: the last scan draws the proposal */
+    stat[0]++;
+    lr = -dpScan(t, Y, memb, side, m, cnt, sum, ss, NULL, rng);
+    lr += log(alpha) + lgammafn(cnt[0]) + lgammafn(cnt[1]) -
+      lgammafn(cnt[0]+cnt[1]) + dpLogML(t, cnt[0], sum, ss) +
+      dpLogML(t, cnt[1], sum + d, ss + d*d) -
+      dpLogML(t, t->count[ci], t->sum + ci*d, t->ss + ci*d*d);
+    if (log(rngUnif(rng)) < lr) {
+      stat[1]++;
+      k = dpNew(t);
+      dpShift(t, Y, C, i, k);
+      for (s=0; s<m; s++)
+	if (!side[s])
+	  dpShift(t, Y, C, memb[s], k);
+      dpUpdate(t, ci, rng, ws);
+      dpUpdate(t, k, rng, ws);
+    }
+  }
+  else {
+    /* merge: the reverse split is the scan that restores the clusters */
+    stat[2]++;
+    lr = dpScan(t, Y, memb, side, m, cnt, sum, ss, orig, rng);
+    for (k=0; k<d; k++)
+      sum[k] = t->sum[ci*d+k] + t->sum[cj*d+k];
+    for (k=0; k<d*d; k++)
+      ss[k] = t->ss[ci*d*d+k] + t->ss[cj*d*d+k];
+    lr += lgammafn(t->count[ci]+t->count[cj]) - log(alpha) -
+      lgammafn(t->count[ci]) - lgammafn(t->count[cj]) +
+      dpLogML(t, t->count[ci]+t->count[cj], sum, ss) -
+      dpLogML(t, t->count[ci], t->sum + ci*d, t->ss + ci*d*d) -
+      dpLogML(t, t->count[cj], t->sum + cj*d, t->ss + cj*d*d);
+    if (log(rngUnif(rng)) < lr) {
+      stat[3]++;
+      dpShift(t, Y, C, j, ci);
+      for (s=0; s<m; s++)
+	if (orig[s])
+	  dpShift(t, Y, C, memb[s], ci);
+      dpUpdate(t, ci, rng, ws);
+    }
+  }
+}
+
+/* the blocked sampler: all n_max clusters in use, drawn from the base
+   measure, with equal weights; the labels of n_obs observations are
+   drawn on up to n_threads threads */
+void dpBlocked(dpTable *t, int n_obs, int n_threads, rngStream *rng, Workspace *ws) {
+  int k;
+
+  t->lw = doubleArray(t->n_max);
+  t->qt = doubleArray(n_threads*t->n_max);
+  t->u = doubleArray(n_obs);
+  t->n_threads = n_threads;
+  while (t->nstar < t->n_max) {
+    k = dpNew(t);
+    dpUpdate(t, k, rng, ws);
+    t->lw[k] = -log((double) t->n_max);
+  }
+}
+
+/* the stick of Y, with weight exp(lw[k]) N(Y; mu[k], Sigma[k]); q: room
+   for n_max doubles */
+static int dpDrawStick(dpTable *t, double *Y, double u, double *q) {
+  int n = t->nstar, m;
+  double qmax, sum = 0;
+
+  qmax = dpLogDens(t, Y, t->lw, q, -HUGE_VAL);
+  for (m=0; m<n; m++)
+    q[m] -= qmax;
+  vexp(q, n);
+  for (m=0; m<n; m++)
+    sum += q[m];
+
+  u *= sum;
+  for (m=0; m<n-1; m++) {
+    u -= q[m];
+    if (u < 0)
+      break;
+  }
+  return t->id[m];
+}
+
+/*
+ * Draws the labels C[i] of Y[i], i < n, given the weights and the
+ * parameters of the sticks, then the counts and statistics of the sticks.
+ * The uniforms are drawn first, so that the labels do not depend on the
+ * number of threads.
+ * returns: the number of sticks with members
+ */
+int dpRelabel(dpTable *t, double **Y, int *C, int n, rngStream *rng) {
+  int i, m, n_threads = t->n_threads, used = 0;
+
+  rngUnifVec(rng, t->u, n);
+#pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1)
+  for (i=0; i<n; i++)
+    C[i] = dpDrawStick(t, Y[i], t->u[i], t->qt + (size_t) threadNum()*t->n_max);
+
+  for (m=0; m<t->nstar; m++)
+    t->count[t->id[m]] = 0;
+  for (i=0; i<n; i++)
+    used += !t->count[C[i]]++;
+  dpRefresh(t, Y, C, n);
+  return used;
+}
+
+/* the factor of the law of the labels, the weights of the sticks
+   integrated out, of a stick with c members and rest after it */
+static double dpStickLik(int c, int rest, double alpha) {
+  return lgammafn(1+c) + lgammafn(alpha+rest) - lgammafn(1+alpha+c+rest);
+}
+
+/*
+ * The blocked sampler moves a large cluster ahead of the sticks before
+ * it only slowly, and the empty sticks in front of it keep weights of
+ * about 1/count each.  Here neighbouring sticks trade places, with their
+ * members and parameters, from the last pair to the first, each swap
+ * accepted by Metropolis-Hastings on the law of the labels with the
+ * weights integrated out (Papaspiliopoulos and Roberts, 2008, Biometrika
+ * 95:169-186).  The weights are drawn again afterwards (dpSticks).
+ */
+void dpSwapSticks(dpTable *t, double alpha, rngStream *rng) {
+  int m, a, b, rest = 0, last = t->nstar-1;
+  double l;
+
+  for (m=last-1; m>=0; m--) {
+    /* rest: the members of the sticks after m+1 */
+    a = t->id[m]; b = t->id[m+1];
+    if (t->count[a] || t->count[b]) {
+      l = dpStickLik(t->count[b], t->count[a]+rest, alpha) -
+	dpStickLik(t->count[a], t->count[b]+rest, alpha);
+      if (m+1 < last)
+	l += dpStickLik(t->count[a], rest, alpha) -
+	  dpStickLik(t->count[b], rest, alpha);
+      if (log(rngUnif(rng)) < l) {
+	t->id[m] = b; t->pos[b] = m;
+	t->id[m+1] = a; t->pos[a] = m+1;
+      }
+    }
+    rest += t->count[t->id[m+1]];
+  }
+}
+
+/* the log of a Gamma(shape, 1) draw, which does not underflow when the
+   shape is small: G(shape+1) U^(1/shape) */
+static double dpLogGamma(rngStream *rng, double shape) {
+  return log(rngGamma(rng, shape+1)) + log(rngUnif(rng))/shape;
+}
+
+/*
+ * Draws the weights of the sticks given their counts: stick m breaks
+ * V[m] ~ Beta(1 + its count, alpha + the counts of the later ones) off
+ * what the earlier ones left, and the last one takes the rest
+ */
+void dpSticks(dpTable *t, double alpha, rngStream *rng) {
+  int m, k, rest = 0;
+  double la, lb, lab, left = 0;   /* log of what is left of the stick */
+
+  for (m=0; m<t->nstar; m++)
+    rest += t->count[t->id[m]];
+  for (m=0; m<t->nstar; m++) {
+    k = t->id[m];
+    rest -= t->count[k];
+    if (m == t->nstar-1) {
+      t->lw[k] = left;
+      break;
+    }
+    /* V[m] = A/(A+B) for Gamma draws A and B, in logs: V[m] is often
+       within rounding of 1 when alpha is small */
+    la = dpLogGamma(rng, 1+t->count[k]);
+    lb = dpLogGamma(rng, alpha+rest);
+    lab = (la > lb) ? la + log1p(exp(lb-la)) : lb + log1p(exp(la-lb));
+    t->lw[k] = left + la - lab;
+    left += lb - lab;
+  }
+}
+
+/*
+ * Draws alpha given the weights of the sticks, for a Gamma(a0, rate b0)
+ * prior: the L-1 breaks are Beta(1, alpha), so alpha is Gamma(a0+L-1,
+ * rate b0 - sum log(1-V[m])), and that sum is the log weight of the
+ * last stick
+ */
+double dpStickAlpha(dpTable *t, double a0, double b0, rngStream *rng) {
+  return rngGamma(rng, a0+t->nstar-1) / (b0 - t->lw[t->id[t->nstar-1]]);
+}
+
+/*
+ * The clusters kept by a chain.  The number of clusters of a draw is
+ * only known once it is drawn, so par grows as they come, doubling its
+ * room; the labels take n_unit per kept draw, on as few bytes as the
+ * largest label so far needs (1, 2 or 4), and are widened in place
+ * when one does not fit.
+ */
+dpKept *newDPKept(int n_dim, int n_unit, int n_store) {
+  dpKept *k = (dpKept *) malloc(sizeof(dpKept));
+  if (!k)
+    return NULL;
+  k->n_unit = n_unit; k->n_store = n_store;
+  k->n_par = n_dim + n_dim*(n_dim+1)/2;
+  k->n_keep = 0; k->room = 0;
+  k->par = NULL;
+  k->n_label = 0;
+  k->width = 1;
+  k->label = malloc((size_t)n_store*n_unit);
+  if (!k->label && n_store && n_unit) {
+    free(k);
+    return NULL;
+  }
+  return k;
+}
+
+void FreeDPKept(dpKept *k) {
+  if (!k)
+    return;
+  free(k->par);
+  free(k->label);
+  free(k);
+}
+
+static int dpLabelGet(dpKept *k, size_t i) {
+  switch (k->width) {
+  case 1: return ((unsigned char *) k->label)[i];
+  case 2: return ((unsigned short *) k->label)[i];
+  default: return ((int *) k->label)[i];
+  }
+}
+
+static void dpLabelSet(dpKept *k, size_t i, int v) {
+  switch (k->width) {
+  case 1: ((unsigned char *) k->label)[i] = (unsigned char) v; break;
+  case 2: ((unsigned short *) k->label)[i] = (unsigned short) v; break;
+  default: ((int *) k->label)[i] = v;
+  }
+}
+
+/* widens the labels so that they hold n; 0 if out of memory */
+static int dpLabelWiden(dpKept *k, int n) {
+  int width = n <= UCHAR_MAX ? 1 : (n <= USHRT_MAX ? 2 : 4), old = k->width;
+  size_t i;
+  void *p;
+
+  if (width <= old)
+    return 1;
+  p = realloc(k->label, (size_t)k->n_store*k->n_unit*width);
+  if (!p)
+    return 0;
+  k->label = p;
+  /* from the end, so that no label is overwritten before it is moved */
+  for (i = k->n_label; i-- > 0; ) {
+    k->width = old;
+    n = dpLabelGet(k, i);
+    k->width = width;
+    dpLabelSet(k, i, n);
+  }
+  k->width = width;
+  return 1;
+}
+
+/*
+ * Keeps the clusters of the first n_unit observations, in the order in
+ * which they first come: their mu, then the upper triangle of Sigma by
+ * rows, appended to k->par.  The label of observation i is the
+ * position of its cluster among those of the draw, from 1.  Returns 0
+ * if out of memory.  Only memory of its own is allocated, so that it
+ * may run on a worker thread.
+ */
+int dpKeep(dpKept *k, dpTable *t, int *C) {
+  int i, j, l, m, c, n = 0, d = t->n_dim;
+  double *par, *p;
+
+  for (m=0; m<t->nstar; m++)
+    t->slot[t->id[m]] = 0;
+  for (i=0; i<k->n_unit; i++) {
+    c = C[i];
+    if (!t->slot[c]) {
+      t->slot[c] = ++n;
+      if (k->n_keep == k->room) {
+	k->room = k->room ? 2*k->room : (size_t) t->nstar + 1;
+	p = (double *) realloc(k->par, k->room*k->n_par*sizeof(double));
+	if (!p)
+	  return 0;
+	k->par = p;
+      }
+      par = k->par + k->n_keep++*k->n_par;
+      for (j=0; j<d; j++)
+	*par++ = t->mu[c][j];
+      for (j=0; j<d; j++)
+	for (l=j; l<d; l++)
+	  *par++ = t->Sigma[c][j][l];
+    }
+  }
+  if (!dpLabelWiden(k, n))
+    return 0;
+  for (i=0; i<k->n_unit; i++)
+    dpLabelSet(k, k->n_label++, t->slot[C[i]]);
+  return 1;
+}
+
+/*
+ * The clusters kept by the n chains, chain after chain, as the list
+ * (pdSPar, pdSC) of their parameters and the labels of the units; the
+ * labels are a raw vector when they all fit in a byte.  The stores are
+ * freed as they are copied.
+ */
+SEXP dpKeptValue(dpKept **k, int n) {
+  int c, width = 1;
+  size_t i, n_keep = 0, n_label = 0, n_par = k[0]->n_par;
+  double *par;
+  SEXP res, names, label;
+
+  for (c=0; c<n; c++) {
+    n_keep += k[c]->n_keep;
+    n_label += k[c]->n_label;
+    if (k[c]->width > width)
+      width = k[c]->width;
+  }
+  PROTECT(res = allocVector(VECSXP, 2));
+  PROTECT(names = allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, mkChar("pdSPar"));
+  SET_STRING_ELT(names, 1, mkChar("pdSC"));
+  setAttrib(res, R_NamesSymbol, names);
+  SET_VECTOR_ELT(res, 0, allocVector(REALSXP, n_keep*n_par));
+  par = REAL(VECTOR_ELT(res, 0));
+  for (c=0; c<n; c++) {
+    memcpy(par, k[c]->par, k[c]->n_keep*n_par*sizeof(double));
+    par += k[c]->n_keep*n_par;
+    free(k[c]->par);
+    k[c]->par = NULL;
+  }
+  SET_VECTOR_ELT(res, 1, label = allocVector(width == 1 ? RAWSXP : INTSXP, n_label));
+  for (i=0, c=0; c<n; c++) {
+    if (width == 1)
+      memcpy(RAW(label)+i, k[c]->label, k[c]->n_label);
+    else {
+      size_t j;
+      for (j=0; j<k[c]->n_label; j++)
+	INTEGER(label)[i+j] = dpLabelGet(k[c], j);
+    }
+    i += k[c]->n_label;
+  }
+  UNPROTECT(2);
+  return res;
+}
+
+/*
+ * The pointers that .C would pass for the elements of the list args:
+ * double *, int * or, for character vectors, char **.  For the .Call
+ * entries of the samplers (cDPecoCall, cDPecoXCall), which take their
+ * arguments as .C does, but return the clusters kept as well; n is the
+ * number of arguments expected.
+ */
+void **dotCArgs(SEXP args, int n) {
+  int i, j;
+  void **a;
+  char **s;
+  SEXP x;
+
+  if (TYPEOF(args) != VECSXP || LENGTH(args) != n)
+    error("%d arguments expected\n", n);
+  a = (void **) R_alloc(n, sizeof(void *));
+  for (i=0; i<n; i++) {
+    x = VECTOR_ELT(args, i);
+    switch (TYPEOF(x)) {
+    case REALSXP: a[i] = REAL(x); break;
+    case INTSXP: a[i] = INTEGER(x); break;
+    case LGLSXP: a[i] = LOGICAL(x); break;
+    case STRSXP:
+      s = (char **) R_alloc(LENGTH(x), sizeof(char *));
+      for (j=0; j<LENGTH(x); j++)
+	s[j] = (char *) CHAR(STRING_ELT(x, j));
+      a[i] = s;
+      break;
+    default:
+      error("argument %d has an unsupported type\n", i+1);
+    }
+  }
+  return a;
+}
+
+/* args, as updated by the sampler, with the elements of kept appended */
+SEXP dotCValue(SEXP args, SEXP kept) {
+  int i, n = LENGTH(args), m = isNull(kept) ? 0 : LENGTH(kept);
+  SEXP res, names, an = getAttrib(args, R_NamesSymbol);
+  SEXP kn = m ? getAttrib(kept, R_NamesSymbol) : R_NilValue;
+
+  PROTECT(res = allocVector(VECSXP, n+m));
+  PROTECT(names = allocVector(STRSXP, n+m));
+  for (i=0; i<n; i++) {
+    SET_VECTOR_ELT(res, i, VECTOR_ELT(args, i));
+    SET_STRING_ELT(names, i, isNull(an) ? mkChar("") : STRING_ELT(an, i));
+  }
+  for (i=0; i<m; i++) {
+    SET_VECTOR_ELT(res, n+i, VECTOR_ELT(kept, i));
+    SET_STRING_ELT(names, n+i, STRING_ELT(kn, i));
+  }
+  setAttrib(res, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return res;
+}
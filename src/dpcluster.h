@@ -0,0 +1,86 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+/*
+ * The distinct values of a Dirichlet process mixture of normals (see
+ * dpcluster.c).  Cluster k has the parameters mu[k], Sigma[k],
+ * InvSigma[k] and count[k] members, whose sum and sum of outer products
+ * are kept in sum and ss.  The nstar clusters in use are
+ * id[0..nstar-1]; id[nstar..n_max-1] are free.  For the blocked sampler
+ * (dpBlocked) all n_max are in use, some of them empty.
+ */
+#define DP_REFRESH 100     /* iterations between recomputations of the
+			      statistics of the clusters, see dpRefresh */
+#define DP_SCANS 5         /* intermediate restricted Gibbs scans of a
+			      split-merge move */
+
+typedef struct dpTable {
+  int n_max, n_dim;
+  int nstar;                /* clusters in use */
+  int *id;                  /* ids in use, then the free ones */
+  int *pos;                 /* pos[k]: where k is in id */
+  int *count;               /* members of each cluster */
+  double **mu;              /* parameters of each cluster */
+  double ***Sigma, ***InvSigma;
+  double *dens;             /* for the urn, packed by cluster: mu, the
+			       upper triangle of InvSigma, and the log of
+			       the normalizing constant */
+  double *q;                /* log weights of the urn */
+  double *sum, *ss;         /* n_dim, and n_dim x n_dim, by cluster */
+  int *slot;                /* position of a cluster among those kept */
+  int *memb, *side;         /* scratch for dpSplitMerge */
+  double *lpc;              /* and its constants, by count */
+  /* the blocked sampler: log weights of the sticks, by cluster, and
+     scratch for the labels */
+  double *lw, *qt, *u;
+  int n_threads;
+  /* the base measure: Normal-InvWishart, as in NIWupdate */
+  double *mu0, tau0, **S0;
+  int nu0;
+} dpTable;
+
+dpTable *newDPTable(int n_max, int n_dim, double *mu0, double tau0,
+		    int nu0, double **S0);
+void FreeDPTable(dpTable *t);
+int dpNew(dpTable *t);
+void dpJoin(dpTable *t, int k, double *Y);
+void dpLeave(dpTable *t, int k, double *Y);
+void dpMove(dpTable *t, int k, double *Yold, double *Y);
+void dpRefresh(dpTable *t, double **Y, int *C, int n);
+void dpSetDens(dpTable *t, int k);
+void dpUpdate(dpTable *t, int k, rngStream *rng, Workspace *ws);
+void dpRemix(dpTable *t, rngStream *rng, Workspace *ws);
+int dpDraw(dpTable *t, double *Y, double lq0, double u);
+void dpSplitMerge(dpTable *t, double **Y, int *C, int n, double alpha,
+		  int n_scan, double *stat, rngStream *rng, Workspace *ws);
+void dpBlocked(dpTable *t, int n_obs, int n_threads, rngStream *rng, Workspace *ws);
+int dpRelabel(dpTable *t, double **Y, int *C, int n, rngStream *rng);
+void dpSwapSticks(dpTable *t, double alpha, rngStream *rng);
+void dpSticks(dpTable *t, double alpha, rngStream *rng);
+double dpStickAlpha(dpTable *t, double a0, double b0, rngStream *rng);
+
+/*
+ * The clusters kept by a chain, see dpKeep: the n_par parameters of
+ * each of the n_keep clusters kept, draw after draw, with room for
+ * room of them, and a label for each of the n_unit units of each of
+ * the n_store draws, on width bytes
+ */
+typedef struct dpKept {
+  int n_unit, n_store, n_par;
+  size_t n_keep, room;
+  double *par;
+  size_t n_label;
+  int width;
+  void *label;
+} dpKept;
+
+dpKept *newDPKept(int n_dim, int n_unit, int n_store);
+void FreeDPKept(dpKept *k);
+int dpKeep(dpKept *k, dpTable *t, int *C);
+SEXP dpKeptValue(dpKept **k, int n);
+void **dotCArgs(SEXP args, int n);
+SEXP dotCValue(SEXP args, SEXP kept);
@@ -0,0 +1,250 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <R.h>
+#include "drawfile.h"
+
+/*
+ * Kept draws written to a binary file rather than returned through .C,
+ * for when they do not fit in memory (read back lazily by ecoDraws() in
+ * R).  The file is a header of DRAW_HEADER bytes,
+ *
+ *   "ECODRAWS", then int32: version, n_var, n_unit, n_chain, n_draw, chunk
+ *
+ * followed by the draws as native doubles: chain after chain, and chunk
+ * after chunk within a chain.  A chunk of b draws holds, for each
+ * quantity v and unit i (v slowest), the b draws of quantity v of unit
+ * i, so that one unit is read with one contiguous read per chunk.  The
+ * chunk starting at draw s of chain c is at byte
+ *
+ *   DRAW_HEADER + 8 n_var n_unit (c n_draw + s).
+ *
+ * A sampler fills a chunk draw after draw; a full chunk goes to a writer
+ * thread, which transposes it into the file while the sampler fills the
+ * next one.  On POSIX systems the file is mapped in memory, and the
+ * kernel writes it back.  Elsewhere, the chunks are written with stdio
+ * on the sampler's own thread.
+ */
+
+static size_t drawRow(drawFile *f) {
+  return (size_t) f->n_var * f->n_unit;
+}
+
+/*
+ * path: the file, overwritten
+ * returns: the file, with room for all the draws
+ */
+drawFile *openDrawFile(const char *path, int n_var, int n_unit, int n_chain, int n_draw) {
+  drawFile *f = (drawFile *) Calloc(1, drawFile);
+  char header[DRAW_HEADER];
+  int dims[6];
+
+  f->n_var = n_var;
+  f->n_unit = n_unit;
+  f->n_chain = n_chain;
+  f->n_draw = n_draw;
+  f->chunk = DRAW_CHUNK / drawRow(f);
+  if (f->chunk > n_draw) f->chunk = n_draw;
+  if (f->chunk < 1) f->chunk = 1;
+  f->size = DRAW_HEADER + sizeof(double) * drawRow(f) * n_chain * n_draw;
+
+  memset(header, 0, DRAW_HEADER);
+  memcpy(header, DRAW_MAGIC, 8);
+  dims[0] = DRAW_VERSION; dims[1] = n_var; dims[2] = n_unit;
+  dims[3] = n_chain; dims[4] = n_draw; dims[5] = f->chunk;
+  memcpy(header+8, dims, sizeof(dims));
+
+#ifndef _WIN32
+  f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (f->fd < 0) {
+    Free(f);
+    error("Unable to open the draw file %s: %s\n", path, strerror(errno));
+  }
+  /* reserve the disk space now: a full disk would otherwise only show
+     up as a fault when a page of the mapping is written back */
+#ifdef __linux__
+  errno = posix_fallocate(f->fd, 0, f->size);
+#else
+  errno = ftruncate(f->fd, f->size) ? errno : 0;
+#endif
+  if (!errno) {
+    f->map = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+    if (f->map == MAP_FAILED) f->map = NULL;
+  }
+  if (!f->map) {
+    int err = errno;
+    close(f->fd);
+    Free(f);
+    error("Unable to create the draw file %s: %s\n", path, strerror(err));
+  }
+  memcpy(f->map, header, DRAW_HEADER);
+#else
+  f->file = fopen(path, "wb");
+  if (!f->file) {
+    Free(f);
+    error("Unable to open the draw file %s\n", path);
+  }
+  if (fwrite(header, 1, DRAW_HEADER, f->file) != DRAW_HEADER) {
+    fclose(f->file);
+    Free(f);
+    error("Unable to write the draw file %s\n", path);
+  }
+#endif
+  return f;
+}
+
+void closeDrawFile(drawFile *f) {
+  int err;
+#ifndef _WIN32
+  err = munmap(f->map, f->size) | close(f->fd);
+#else
+  err = fclose(f->file) | f->failed;
+#endif
+  Free(f);
+  if (err)
+    error("Unable to write the draw file\n");
+}
+
+/* the n draws in buf (draw after draw), starting at draw start of chain,
+   into the file; scratch holds a chunk where the file is not mapped */
+static void writeChunk(drawFile *f, int chain, int start, int n, double *buf, double *scratch) {
+  size_t row = drawRow(f), v, v0, v1;
+  size_t off = DRAW_HEADER + sizeof(double) * row * ((size_t) chain * f->n_draw + start);
+  int t;
+#ifndef _WIN32
+  double *dst = (double *) (f->map + off);
+  (void) scratch;
+#else
+  double *dst = scratch;
+#endif
+
+  /* transpose, in blocks of quantities that stay in the cache */
+  for (v0 = 0; v0 < row; v0 = v1) {
+    v1 = (v0 + 64 < row) ? v0 + 64 : row;
+    for (t = 0; t < n; t++)
+      for (v = v0; v < v1; v++)
+	dst[v*n+t] = buf[t*row+v];
+  }
+#ifdef _WIN32
+  /* may run on the thread of a chain: the error is raised when the file
+     is closed */
+  if (fseeko64(f->file, off, SEEK_SET) || fwrite(dst, sizeof(double), row*n, f->file) != row*n)
+    f->failed = 1;
+#endif
+}
+
+#ifndef _WIN32
+/* the writer thread: writes the chunks it is handed until it is told to
+   quit; it never calls R */
+static void *writerMain(void *arg) {
+  drawWriter *w = (drawWriter *) arg;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->out_n && !w->quit)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (!w->out_n)
+      break;
+    pthread_mutex_unlock(&w->lock);
+    writeChunk(w->f, w->chain, w->out_start, w->out_n, w->out, NULL);
+    pthread_mutex_lock(&w->lock);
+    w->out_n = 0;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+#endif
+
+drawWriter *newDrawWriter(drawFile *f, int chain) {
+  drawWriter *w = (drawWriter *) Calloc(1, drawWriter);
+  w->f = f;
+  w->chain = chain;
+  w->start = w->fill = 0;
+  w->buf = Calloc(drawRow(f) * f->chunk, double);
+  w->out = Calloc(drawRow(f) * f->chunk, double);
+  w->out_n = 0;
+#ifndef _WIN32
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  w->quit = 0;
+  /* without the thread, the chunks are written on the sampler's thread */
+  w->running = !pthread_create(&w->thread, NULL, writerMain, w);
+#endif
+  return w;
+}
+
+/* where the next draw goes: quantity v of unit i at v*n_unit+i */
+double *drawSlot(drawWriter *w) {
+  return w->buf + drawRow(w->f) * w->fill;
+}
+
+/* the draw in drawSlot() is complete; a full chunk is handed over */
+void drawCommit(drawWriter *w) {
+  w->fill++;
+  if (w->fill < w->f->chunk && w->start + w->fill < w->f->n_draw)
+    return;
+#ifndef _WIN32
+  if (w->running) {
+    double *tmp;
+    pthread_mutex_lock(&w->lock);
+    while (w->out_n)
+      pthread_cond_wait(&w->cond, &w->lock);
+    tmp = w->out; w->out = w->buf; w->buf = tmp;
+    w->out_start = w->start;
+    w->out_n = w->fill;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+  else
+    writeChunk(w->f, w->chain, w->start, w->fill, w->buf, NULL);
+#else
+  writeChunk(w->f, w->chain, w->start, w->fill, w->buf, w->out);
+#endif
+  w->start += w->fill;
+  w->fill = 0;
+}
+
+/* a draw of W1 and W2 of the first n_unit rows of W */
+void drawPutW(drawWriter *w, double **W) {
+  int i, n = w->f->n_unit;
+  double *slot = drawSlot(w);
+
+  for (i = 0; i < n; i++) {
+    slot[i] = W[i][0];
+    slot[n+i] = W[i][1];
+  }
+  drawCommit(w);
+}
+
+/* waits for the last chunk; the draws of a chunk that is not full (the
+   run was interrupted) are dropped */
+void closeDrawWriter(drawWriter *w) {
+#ifndef _WIN32
+  if (w->running) {
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+#endif
+  Free(w->buf);
+  Free(w->out);
+  Free(w);
+}
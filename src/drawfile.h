@@ -0,0 +1,59 @@
+/******************************************************************
+  This file is a part of eco: R Package for Fitting Bayesian Models
+  of Ecological Inference for 2x2 Tables
+  by Kosuke Imai and Ying Lu
+  Copyright: GPL version 2 or later.
+*******************************************************************/
+
+#include <stdio.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define DRAW_MAGIC "ECODRAWS"
+#define DRAW_VERSION 1
+#define DRAW_HEADER 64          /* bytes before the draws */
+#define DRAW_CHUNK (1 << 20)    /* doubles in a chunk, at most */
+
+/*
+ * A file of kept draws (see drawfile.c): n_var quantities for each of
+ * n_unit units, n_draw draws for each of n_chain chains.  The draws of
+ * a chain are cut in chunks of chunk draws; within a chunk, the draws of
+ * each quantity of each unit are contiguous.
+ */
+typedef struct drawFile {
+  int n_var, n_unit, n_chain, n_draw, chunk;
+  size_t size;              /* bytes */
+#ifndef _WIN32
+  int fd;
+  char *map;                /* the whole file */
+#else
+  FILE *file;
+  int failed;               /* set when a chunk could not be written */
+#endif
+} drawFile;
+
+/* writes the draws of one chain, a chunk at a time, on its own thread */
+typedef struct drawWriter {
+  drawFile *f;
+  int chain;
+  int start, fill;          /* first draw of the chunk being filled, and
+			       how many it has */
+  double *buf;              /* the chunk being filled, draw after draw */
+  double *out;              /* the chunk being written */
+  int out_start, out_n;     /* its first draw and its draws, 0 if none */
+#ifndef _WIN32
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running, quit;
+#endif
+} drawWriter;
+
+drawFile *openDrawFile(const char *path, int n_var, int n_unit, int n_chain, int n_draw);
+void closeDrawFile(drawFile *f);
+drawWriter *newDrawWriter(drawFile *f, int chain);
+double *drawSlot(drawWriter *w);
+void drawCommit(drawWriter *w);
+void drawPutW(drawWriter *w, double **W);
+void closeDrawWriter(drawWriter *w);
@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 #include <Rmath.h>
 #include <R.h>
 #include <Rinternals.h>
@@ -20,151 +21,96 @@
 #include "bayes.h"
 #include "macros.h"
 #include "fintegrate.h"
+#include "density.h"
 //#include  <gsl/gsl_integration.h>
 
 /**
- * Bivariate normal distribution, with parameterization
- * see: http://mathworld.wolfram.com/BivariateNormalDistribution.html
- * see for param: http://www.math.uconn.edu/~binns/reviewII210.pdf
+ * Constants for TomoMoments, set up once per record by tomoIntegration
+ * so that the integrand itself only does per-node work
  */
-void NormConstT(double *t, int n, void *param)
-{
-  int ii;
-  int dim=2;
-  double *mu=doubleArray(dim);
-  double **Sigma=doubleMatrix(dim,dim);
-  double *W1,*W1p,*W2,*W2p;
-  double X, Y, rho;
-  double dtemp, inp, pfact;
-  int imposs;
-
-  W1 = doubleArray(n);
-  W1p = doubleArray(n);
-  W2 = doubleArray(n);
-  W2p = doubleArray(n);
-
-  Param *pp=(Param *)param;
-  mu[0]= pp->caseP.mu[0];
-  mu[1]= pp->caseP.mu[1];
-  Sigma[0][0]=pp->setP->Sigma[0][0];
-  Sigma[1][1]=pp->setP->Sigma[1][1];
-  Sigma[0][1]=pp->setP->Sigma[0][1];
-  Sigma[1][0]=pp->setP->Sigma[1][0];
-  rho=Sigma[0][1]/sqrt(Sigma[0][0]*Sigma[1][1]);
-  //Rprintf("TESTING: %4g %4g %4g %4g", pp->caseP.mu[0], pp->caseP.mu[1], pp->setP->Sigma[0][0],pp->setP->Sigma[0][1]);
-  X=pp->caseP.X;
-  Y=pp->caseP.Y;
-  imposs=0;
-
-  dtemp=1/(2*M_PI*sqrt(Sigma[0][0]*Sigma[1][1]*(1-rho*rho)));
-
-  for (ii=0; ii<n; ii++) {
-    imposs=0; inp=t[ii];
-    W1[ii]=getW1starFromT(t[ii],pp,&imposs);
-    if (!imposs) W2[ii]=getW2starFromT(t[ii],pp,&imposs);
-    if (imposs==1) t[ii]=0;
-    else {
-        W1p[ii]=getW1starPrimeFromT(t[ii],pp);
-        W2p[ii]=getW2starPrimeFromT(t[ii],pp);
-        pfact=sqrt(W1p[ii]*W1p[ii]+W2p[ii]*W2p[ii]);
-        t[ii]=exp(-1/(2*(1-rho*rho))*
-              ((W1[ii]-mu[0])*(W1[ii]-mu[0])/Sigma[0][0]+
-               (W2[ii]-mu[1])*(W2[ii]-mu[1])/Sigma[1][1]-
-                2*rho*(W1[ii]-mu[0])*(W2[ii]-mu[1])
-              /sqrt(Sigma[0][0]*Sigma[1][1])))*dtemp*pfact;
-  //if (pp->setP->weirdness)
-   //   Rprintf("Normc... %d %d %5g -> %5g %5g => %5g with %5g imposs %d\n", ii, n, inp, W1[ii], W2[ii],t[ii],pfact,imposs);
-      //char ch;
-      //scanf(" %c", &ch );
-    }
-  }
-  Free(W1);
-  Free(W1p);
-  Free(W2);
-  Free(W2p);
-  Free(mu);
-  FreeMatrix(Sigma,dim);
-}
+typedef struct tomoContext {
+  Param* param;
+  bvnConst bvn;        //bivariate normal of (W1*,W2*) for this record
+  double mu3[3];       //NCAR likelihood: mean of (W1*,W2*,X*)
+  double prec3[3][3];  //NCAR likelihood: setP->InvSigma3
+  double logc3;
+  double lx;           //NCAR likelihood: logit(X)
+} tomoContext;
+
+void setTomoContext(tomoContext* tc, Param* param, int lik);
+void tomoFixedRule(tomoContext* tc, double* moments, int lik);
+static void tomoNcarLik(tomoContext* tc, const double *W1s, const double *W2s, int n, double *out);
 
 /**
- * Integrand for computing sufficient statistic
- * Which statistic to estimate depends on param->suff (see macros.h)
+ * Fused integrand for the tomography line: at each node, evaluates the
+ * bivariate normal density (times the line Jacobian) once and returns it
+ * multiplied by each of the statistics in e_tomo_moments (see macros.h).
+ * The likelihood (component TM_Lik) is only filled in when nvec > TM_Lik.
  */
-void SuffExp(double *t, int n, void *param)
+void TomoMoments(double *t, int n, double *fx, int nvec, void *ex)
 {
-  int ii,imposs,i,j;
-  sufficient_stat suff;
-  Param *pp=(Param *)param;
-  int dim = (pp->setP->ncar==1) ? 3 : 2;
-  double *mu=doubleArray(dim);
-  double **Sigma=doubleMatrix(dim,dim);
-  double **InvSigma=doubleMatrix(dim,dim);/* inverse covariance matrix*/
-  //double Sigma[dim][dim];
-  //double InvSigma[dim][dim];
-  double *W1,*W1p,*W2,*W2p,*vtemp;
-  double inp,density,pfact,normc;
-
-  vtemp=doubleArray(dim);
-  W1 = doubleArray(n);
-  W1p = doubleArray(n);
-  W2 = doubleArray(n);
-  W2p = doubleArray(n);
-  mu[0]= pp->caseP.mu[0];
-  mu[1]= pp->caseP.mu[1];
-  for(i=0;i<dim;i++) {
-    for(j=0;j<dim;j++) {
-      if (dim==3) {
-        Sigma[i][j]=pp->setP->Sigma3[i][j];
-        InvSigma[i][j]=pp->setP->InvSigma3[i][j];
-      }
-      else {
-        Sigma[i][j]=pp->setP->Sigma[i][j];
-        InvSigma[i][j]=pp->setP->InvSigma[i][j];
+  int i0,ii,nb;
+  tomoContext *tc=(tomoContext *)ex;
+  caseParam *caseP=&(tc->param->caseP);
+  double m1=caseP->Wbounds[0][1] - caseP->Wbounds[0][0];
+  double m2=caseP->Wbounds[1][0] - caseP->Wbounds[1][1];
+  double W1[BVN_BATCH],W2[BVN_BATCH],W1s[BVN_BATCH],W2s[BVN_BATCH];
+  double jac[BVN_BATCH],dens[BVN_BATCH],lik[BVN_BATCH];
+  double W1p,W2p,density;
+  double *f;
+
+  for (i0=0; i0<n; i0+=BVN_BATCH) {
+    nb=(n-i0<BVN_BATCH) ? n-i0 : BVN_BATCH;
+    for (ii=0; ii<nb; ii++) {
+      W1[ii]=m1*t[i0+ii] + caseP->Wbounds[0][0];
+      W2[ii]=m2*t[i0+ii] + caseP->Wbounds[1][1];
+      if (W1[ii]==1 || W1[ii]==0 || W2[ii]==1 || W2[ii]==0) { //impossible point on the line
+        W1[ii]=W2[ii]=W1s[ii]=W2s[ii]=jac[ii]=0;
+        continue;
       }
+      W1s[ii]=log(W1[ii]/(1-W1[ii]));
+      W2s[ii]=log(W2[ii]/(1-W2[ii]));
+      W1p=m1/(W1[ii]*(1-W1[ii]));
+      W2p=m2/(W2[ii]*(1-W2[ii]));
+      jac[ii]=sqrt(W1p*W1p+W2p*W2p);
     }
-  }
-  normc=pp->caseP.normcT;
-  suff=pp->caseP.suff;
-  imposs=0;
-
-  for (ii=0; ii<n; ii++) {
-    imposs=0; inp=t[ii];
-    W1[ii]=getW1starFromT(t[ii],pp,&imposs);
-    if (!imposs) W2[ii]=getW2starFromT(t[ii],pp,&imposs);
-    if (imposs==1) t[ii]=0;
-    else {
-      W1p[ii]=getW1starPrimeFromT(t[ii],pp);
-      W2p[ii]=getW2starPrimeFromT(t[ii],pp);
-      pfact=sqrt(W1p[ii]*W1p[ii]+W2p[ii]*W2p[ii]);
-      vtemp[0] = W1[ii];
-      vtemp[1] = W2[ii];
-      density=dBVNtomo(vtemp, pp, 0,normc);
-      t[ii] = density*pfact;
-      if (suff==SS_W1star) t[ii]=W1[ii]*t[ii];
-      else if (suff==SS_W2star) t[ii]=W2[ii]*t[ii];
-      else if (suff==SS_W1star2) t[ii]=W1[ii]*W1[ii]*t[ii];
-      else if (suff==SS_W1W2star) t[ii]=W1[ii]*W2[ii]*t[ii];
-      else if (suff==SS_W2star2) t[ii]=W2[ii]*W2[ii]*t[ii];
-      else if (suff==SS_W1) t[ii]=invLogit(W1[ii])*t[ii];
-      else if (suff==SS_W2) t[ii]=invLogit(W2[ii])*t[ii];
-      else if (suff==SS_Loglik) {
-        if (dim == 3) {
-          //if(pp->setP->verbose>=2 && dim==3) Rprintf("InvSigma loglik: %5g %5g %5g %5g %5g %5g\n",InvSigma[0][0],InvSigma[0][1],InvSigma[1][0],InvSigma[1][1],InvSigma[1][2],InvSigma[2][2]);
-          vtemp[2]=logit(pp->caseP.X,"log-likelihood");
-          mu[0]=pp->setP->pdTheta[1];
-          mu[1]=pp->setP->pdTheta[2];
-          mu[2]=pp->setP->pdTheta[0];
-        }
-        t[ii]=dMVN(vtemp,mu,InvSigma,dim,0)*pfact;
-        //t[ii]=dMVN3(vtemp,mu,(double*)(&(InvSigma[0][0])),dim,0)*pfact;
-      }
-      else if (suff!=SS_Test) Rprintf("Error Suff= %d",suff);
+    dBVNbatch(W1s,W2s,nb,&tc->bvn,dens,0);
+    if (nvec>TM_Lik && tc->param->setP->ncar) tomoNcarLik(tc,W1s,W2s,nb,lik);
+    for (ii=0; ii<nb; ii++) {
+      f=fx+(i0+ii)*nvec;
+      density=dens[ii]*jac[ii];
+      f[TM_Normc]=density;
+      f[TM_W1star]=W1s[ii]*density;
+      f[TM_W2star]=W2s[ii]*density;
+      f[TM_W1star2]=W1s[ii]*W1s[ii]*density;
+      f[TM_W1W2star]=W1s[ii]*W2s[ii]*density;
+      f[TM_W2star2]=W2s[ii]*W2s[ii]*density;
+      f[TM_W1]=W1[ii]*density;
+      f[TM_W2]=W2[ii]*density;
+      if (nvec>TM_Lik)
+        f[TM_Lik]=(tc->param->setP->ncar) ? lik[ii]*jac[ii] : density;
     }
   }
-  Free(W1);Free(W1p);Free(W2);Free(W2p);Free(mu);Free(vtemp);
-  FreeMatrix(Sigma,dim); FreeMatrix(InvSigma,dim);
 }
 
+/**
+ * NCAR likelihood density of (W1*[j], W2*[j], logit(X)) for j=0..n-1,
+ * without the line Jacobian
+ * mutates: out
+ */
+static void tomoNcarLik(tomoContext* tc, const double *W1s, const double *W2s, int n, double *out)
+{
+  double v0,v1,v2=tc->lx-tc->mu3[2];
+  int j;
+
+  for (j=0; j<n; j++) {
+    v0=W1s[j]-tc->mu3[0];
+    v1=W2s[j]-tc->mu3[1];
+    out[j]=tc->logc3-0.5*(tc->prec3[0][0]*v0*v0 + tc->prec3[1][1]*v1*v1 + tc->prec3[2][2]*v2*v2 +
+                          2*(tc->prec3[0][1]*v0*v1 + tc->prec3[0][2]*v0*v2 + tc->prec3[1][2]*v1*v2));
+  }
+  vexp(out,n);
+}
 
 /**
  * Returns the log likelihood of a particular case (i.e, record, datapoint)
@@ -172,8 +118,9 @@ void SuffExp(double *t, int n, void *param)
 double getLogLikelihood(Param* param) {
   if (param->caseP.dataType==DPT_General  && !(param->caseP.Y>=.990 || param->caseP.Y<=.010)) {
     //non-survey data: do integration to find likelihood
-    param->caseP.suff=SS_Loglik;
-    return log(paramIntegration(&SuffExp,(void*)param));
+    double moments[TM_Len];
+    tomoIntegration(param,moments,1);
+    return log(moments[TM_Lik]);
 
 
   } else if (param->caseP.dataType==DPT_Homog_X1 || param->caseP.dataType==DPT_Homog_X0) {
@@ -194,27 +141,18 @@ double getLogLikelihood(Param* param) {
   } else if (param->caseP.dataType==DPT_Survey || (param->caseP.Y>=.990 || param->caseP.Y<=.010)) {
     //Survey data (or v tight bounds): multi-variate normal
     int dim=param->setP->ncar ? 3 : 2;
-    double *mu=doubleArray(dim);
-    double *vtemp=doubleArray(dim);
-    double **InvSig=doubleMatrix(dim,dim);/* inverse covariance matrix*/
-    int i,j;
-    for(i=0;i<dim;i++) {
-      for(j=0;j<dim;j++) {
-        if (dim==3) {
-          InvSig[i][j]=param->setP->InvSigma3[i][j];
-        }
-        else {
-          InvSig[i][j]=param->setP->InvSigma[i][j];
-        }
-      }
-    }
+    double mu[3], vtemp[3];
+    double *InvSig[3]; /* inverse covariance matrix*/
+    int i;
+    for(i=0;i<dim;i++)
+      InvSig[i]=(dim==3) ? param->setP->InvSigma3[i] : param->setP->InvSigma[i];
     double loglik;
     vtemp[0] = param->caseP.Wstar[0];
     vtemp[1] = param->caseP.Wstar[1];
     mu[0]= param->caseP.mu[0];
     mu[1]= param->caseP.mu[1];
     if (param->setP->ncar) {
-      vtemp[2]=logit(param->caseP.X,"log-likelihood survey");
+      vtemp[2]=log(param->caseP.X/(1-param->caseP.X)); //no logit(): may be on a worker thread
       mu[0]=param->setP->pdTheta[1];
       mu[1]=param->setP->pdTheta[2];
       mu[2]=param->setP->pdTheta[0];
@@ -223,7 +161,6 @@ double getLogLikelihood(Param* param) {
     else {
       loglik=dMVN(vtemp,mu,InvSig,dim,1);
     }
-    Free(mu); Free(vtemp); FreeMatrix(InvSig,dim);
     return loglik;
   }
   else { //Unknown type
@@ -324,42 +261,314 @@ double getW2starPrimeFromT(double t, Param* param) {
   return W2;
 }
 
+#define PI_LIMIT 100 /* maximum number of subintervals in paramIntegration */
+
 /**
  * parameterized line integration
  * lower bound is t=0, upper bound is t=1
+ * mutates: ier (Rdqags' error code, 0 on success)
  */
-double paramIntegration(integr_fn f, void *ex) {
+double paramIntegration(integr_fn f, void *ex, int *ier) {
   double epsabs=pow(10,-11), epsrel=pow(10,-11);
   double result=9999, anserr=9999;
-  int limit=100;
-  int last, neval, ier;
-  int lenw=5*limit;
-  int *iwork=(int *) Calloc(limit, int);
-  double *work=(double *)Calloc(lenw, double);
+  int limit=PI_LIMIT;
+  int last, neval;
+  int lenw=5*PI_LIMIT;
+  int iwork[PI_LIMIT];
+  double work[5*PI_LIMIT];
   double lb=0.00001; double ub=.99999;
   Rdqags(f, ex, &lb, &ub, &epsabs, &epsrel, &result,
-    &anserr, &neval, &ier, &limit, &lenw, &last, iwork, work);
-
-  Free(iwork);
-  Free(work);
-  if (ier==0) return result;
-  else {
-    Param* p = (Param*) ex;
-    Rprintf("Integration error %d: Sf %d X %5g Y %5g [%5g,%5g] -> %5g +- %5g\n",ier,p->caseP.suff,p->caseP.X,p->caseP.Y,p->caseP.Wbounds[0][0],p->caseP.Wbounds[0][1],result,anserr);
-    char ch;
-    scanf("Hit enter to continue %c", &ch );
-    return result;
+    &anserr, &neval, ier, &limit, &lenw, &last, iwork, work);
+  return result;
+}
+
+/* Gauss-Kronrod 21 point rule (as in QUADPACK's qk21): Kronrod abscissae,
+ * Kronrod weights and the weights of the embedded 10 point Gauss rule */
+static const double xgk21[11]={0.995657163025808080735527280689003,0.973906528517171720077964012084452,
+  0.930157491355708226001207180059508,0.865063366688984510732096688423493,0.780817726586416897063717578345042,
+  0.679409568299024406234327365114874,0.562757134668604683339000099272694,0.433395394129247190799265943165784,
+  0.294392862701460198131126603103866,0.148874338981631210884826001129720,0.0};
+static const double wgk21[11]={0.011694638867371874278064396062192,0.032558162307964727478818972459390,
+  0.054755896574351996031381300244580,0.075039674810919952767043140916190,0.093125454583697605535065465083366,
+  0.109387158802297641899210590325805,0.123491976262065851077208980216258,0.134709217311473325928054001771707,
+  0.142775938577060080797094273138717,0.147739104901338491374841515972068,0.149445554002916905664936468389821};
+static const double wg10[5]={0.066671344308688137593568809893332,0.149451349150580593145776339657697,
+  0.219086362515982043995534934228163,0.269266719309996355091226921569469,0.295524224714752870173892994651338};
+
+#define VINT_LIMIT 100 /* maximum number of subintervals */
+#define VINT_MAXVEC TM_Len /* maximum number of components */
+
+/**
+ * 21 point Gauss-Kronrod rule on [a,b] applied to each component of f
+ * mutates: res, err (estimates and error estimates, one per component)
+ */
+static void vecGK21(vec_integr_fn f, void *ex, int nvec, double a, double b, double *res, double *err) {
+  double x[21], fx[21*VINT_MAXVEC];
+  double c=0.5*(a+b), h=0.5*(b-a);
+  double resk, resg, resabs, resasc, mean, e;
+  int j,k;
+
+  for (j=0; j<10; j++) {
+    x[2*j]=c-h*xgk21[j];
+    x[2*j+1]=c+h*xgk21[j];
+  }
+  x[20]=c;
+  f(x,21,fx,nvec,ex);
+
+  for (k=0; k<nvec; k++) {
+    resk=wgk21[10]*fx[20*nvec+k];
+    resabs=fabs(resk);
+    resg=0;
+    for (j=0; j<10; j++) {
+      resk+=wgk21[j]*(fx[2*j*nvec+k]+fx[(2*j+1)*nvec+k]);
+      resabs+=wgk21[j]*(fabs(fx[2*j*nvec+k])+fabs(fx[(2*j+1)*nvec+k]));
+      if (j%2==1) resg+=wg10[j/2]*(fx[2*j*nvec+k]+fx[(2*j+1)*nvec+k]);
+    }
+    mean=0.5*resk;
+    resasc=wgk21[10]*fabs(fx[20*nvec+k]-mean);
+    for (j=0; j<10; j++)
+      resasc+=wgk21[j]*(fabs(fx[2*j*nvec+k]-mean)+fabs(fx[(2*j+1)*nvec+k]-mean));
+    //same error scaling as QUADPACK
+    e=fabs((resk-resg)*h);
+    resasc*=fabs(h); resabs*=fabs(h);
+    if (resasc!=0 && e!=0) e=resasc*fmin2(1,pow(200*e/resasc,1.5));
+    if (resabs>DBL_MIN/(50*DBL_EPSILON)) e=fmax2(50*DBL_EPSILON*resabs,e);
+    res[k]=resk*h;
+    err[k]=e;
+  }
+}
+
+/**
+ * Adaptive integration of a vector-valued function over t in (0.00001,.99999),
+ * with the same end points and tolerances as paramIntegration. Every component
+ * is computed from the same nodes; the interval with the largest error relative
+ * to the tolerance of a component that has not converged yet is bisected until
+ * each component meets Rdqags' test
+ *   err_k <= max(epsabs, epsrel*|I_k|)
+ * There is no extrapolation, so a component whose integrand is steep at an
+ * end of the line may run out of subintervals; see tomoIntegration.
+ * nvec must be at most VINT_MAXVEC.  Calls nothing from R, so it can run
+ * on a worker thread.
+ * mutates: result (nvec components)
+ * returns: 0 on success, or the bit mask (bit k for component k) of the
+ * components still above their tolerance when the subdivision limit was reached
+ */
+int vecIntegration(vec_integr_fn f, void *ex, int nvec, double *result) {
+  double epsabs=pow(10,-11), epsrel=pow(10,-11);
+  double lb=0.00001, ub=.99999;
+  double a[VINT_LIMIT], b[VINT_LIMIT];
+  double res[VINT_LIMIT][VINT_MAXVEC], err[VINT_LIMIT][VINT_MAXVEC];
+  double tol[VINT_MAXVEC], toterr[VINT_MAXVEC];
+  double worst, r, mid;
+  int last=1, i, k, split, failed;
+
+  a[0]=lb; b[0]=ub;
+  vecGK21(f,ex,nvec,lb,ub,res[0],err[0]);
+  for (;;) {
+    for (k=0; k<nvec; k++) {
+      result[k]=0; toterr[k]=0;
+      for (i=0; i<last; i++) {
+        result[k]+=res[i][k];
+        toterr[k]+=err[i][k];
+      }
+    }
+    failed=0;
+    for (k=0; k<nvec; k++) {
+      tol[k]=fmax2(epsabs,epsrel*fabs(result[k]));
+      if (toterr[k]>tol[k]) failed|=1<<k;
+    }
+    if (!failed || last==VINT_LIMIT) return failed;
+
+    //bisect the interval contributing most to the worst unconverged component
+    split=0; worst=-1;
+    for (i=0; i<last; i++)
+      for (k=0; k<nvec; k++) {
+        if (!(failed>>k & 1)) continue;
+        r=err[i][k]/tol[k];
+        if (r>worst) { worst=r; split=i; }
+      }
+    mid=0.5*(a[split]+b[split]);
+    a[last]=mid; b[last]=b[split]; b[split]=mid;
+    vecGK21(f,ex,nvec,a[split],b[split],res[split],err[split]);
+    vecGK21(f,ex,nvec,a[last],b[last],res[last],err[last]);
+    last++;
+  }
+}
+
+/* one component of TomoMoments, as an integr_fn for paramIntegration */
+typedef struct tomoComponent {
+  tomoContext* tc;
+  int nvec, k;
+} tomoComponent;
+
+static void TomoMoment(double *t, int n, void *ex) {
+  tomoComponent* tk=(tomoComponent*) ex;
+  double fx[21*TM_Len];
+  int i0,ii,nb;
+
+  for (i0=0; i0<n; i0+=21) {
+    nb=(n-i0<21) ? n-i0 : 21;
+    TomoMoments(t+i0,nb,fx,tk->nvec,tk->tc);
+    for (ii=0; ii<nb; ii++) t[i0+ii]=fx[ii*tk->nvec+tk->k];
   }
+}
 
+/**
+ * Integrates all tomography-line quantities of a record in a single pass
+ * (see e_tomo_moments in macros.h); bounds must already be set (setBounds)
+ * The components vecIntegration cannot bring within tolerance are done
+ * again one at a time by paramIntegration, whose extrapolation copes with
+ * the steep ends of the line.  This may run on a worker thread, so a
+ * failure is only recorded; the caller reports it on the main thread.
+ * lik: 1 to also compute the likelihood of the record (TM_Lik)
+ * mutates: moments (length TM_Len, unnormalized), param->caseP.intErr on failure
+ */
+void tomoIntegration(Param* param, double* moments, int lik) {
+  tomoContext tc;
+  tomoComponent tk;
+  int failed, ier;
+
+  setTomoContext(&tc,param,lik);
+  if (!lik) moments[TM_Lik]=0;
+  if (param->caseP.nodes!=NULL) {
+    tomoFixedRule(&tc,moments,lik);
+    return;
+  }
+  tk.tc=&tc;
+  tk.nvec=lik ? TM_Len : TM_Lik;
+  failed=vecIntegration(&TomoMoments,(void*)&tc,tk.nvec,moments);
+  for (tk.k=0; tk.k<tk.nvec; tk.k++)
+    if (failed>>tk.k & 1) {
+      moments[tk.k]=paramIntegration(&TomoMoment,(void*)&tk,&ier);
+      if (ier!=0) param->caseP.intErr=ier;
+    }
 }
 
 /**
- * integrate normalizing constant and set it in param
+ * Sets up the normal constants used by TomoMoments and tomoFixedRule
+ * lik: 1 if the likelihood will be integrated as well
+ * mutates: tc
  */
-void setNormConst(Param* param) {
-  param->caseP.normcT=paramIntegration(&NormConstT,(void*)param);
+void setTomoContext(tomoContext* tc, Param* param, int lik) {
+  setParam* setP=param->setP;
+  int i,j;
+
+  tc->param=param;
+  setBVNConst(&tc->bvn,param->caseP.mu[0],param->caseP.mu[1],
+              setP->Sigma[0][0],setP->Sigma[0][1],setP->Sigma[1][1]);
+  if (lik && setP->ncar) {
+    double *InvSig[3];
+    for (i=0; i<3; i++) {
+      InvSig[i]=setP->InvSigma3[i];
+      for (j=0; j<3; j++) tc->prec3[i][j]=setP->InvSigma3[i][j];
+    }
+    tc->mu3[0]=setP->pdTheta[1];
+    tc->mu3[1]=setP->pdTheta[2];
+    tc->mu3[2]=setP->pdTheta[0];
+    tc->logc3=-1.5*log(2*M_PI)+0.5*ddet(InvSig,3,1);
+    tc->lx=log(param->caseP.X/(1-param->caseP.X));
+  }
 }
 
+/**
+ * Fixed-rule counterpart of vecIntegration(TomoMoments): sums over the
+ * record's cached nodes, so only the quadratic form and one exp are
+ * evaluated per node (plus the trivariate form for the NCAR likelihood)
+ * mutates: moments (as in tomoIntegration)
+ */
+void tomoFixedRule(tomoContext* tc, double* moments, int lik) {
+  caseParam* caseP=&(tc->param->caseP);
+  int n=tc->param->setP->quadNodes;
+  double *W1s=caseP->nodes, *W2s=W1s+n, *wt=W1s+2*n, *W1=W1s+3*n, *W2=W1s+4*n;
+  double dens[BVN_BATCH];
+  double density;
+  int i0,ii,j,nb,k;
+
+  for (k=0; k<TM_Len; k++) moments[k]=0;
+  for (i0=0; i0<n; i0+=BVN_BATCH) {
+    nb=(n-i0<BVN_BATCH) ? n-i0 : BVN_BATCH;
+    dBVNbatch(W1s+i0,W2s+i0,nb,&tc->bvn,dens,0);
+    for (ii=0; ii<nb; ii++) {
+      j=i0+ii;
+      density=dens[ii]*wt[j];
+      moments[TM_Normc]+=density;
+      moments[TM_W1star]+=W1s[j]*density;
+      moments[TM_W2star]+=W2s[j]*density;
+      moments[TM_W1star2]+=W1s[j]*W1s[j]*density;
+      moments[TM_W1W2star]+=W1s[j]*W2s[j]*density;
+      moments[TM_W2star2]+=W2s[j]*W2s[j]*density;
+      moments[TM_W1]+=W1[j]*density;
+      moments[TM_W2]+=W2[j]*density;
+    }
+    if (lik && tc->param->setP->ncar) {
+      tomoNcarLik(tc,W1s+i0,W2s+i0,nb,dens);
+      for (ii=0; ii<nb; ii++) moments[TM_Lik]+=dens[ii]*wt[i0+ii];
+    }
+  }
+  if (lik && !tc->param->setP->ncar) moments[TM_Lik]=moments[TM_Normc];
+}
+
+/**
+ * Nodes and weights of the n-point Gauss-Legendre rule on [a,b]
+ * (Newton iteration on the Legendre polynomial, started from the
+ * usual cosine approximation of its roots)
+ * mutates: x, w
+ */
+void gaussLegendre(int n, double a, double b, double* x, double* w) {
+  int i,j,m=(n+1)/2;
+  double z,z1,p1,p2,p3,pp=1;
+  double c=0.5*(a+b), h=0.5*(b-a);
+
+  for (i=0; i<m; i++) {
+    z=cos(M_PI*(i+0.75)/(n+0.5));
+    do {
+      p1=1; p2=0;
+      for (j=0; j<n; j++) {
+        p3=p2; p2=p1;
+        p1=((2*j+1)*z*p2-j*p3)/(j+1);
+      }
+      pp=n*(z*p1-p2)/(z*z-1);
+      z1=z;
+      z=z1-p1/pp;
+    } while (fabs(z-z1)>3*DBL_EPSILON);
+    x[i]=c-h*z;
+    x[n-1-i]=c+h*z;
+    w[i]=2*h/((1-z*z)*pp*pp);
+    w[n-1-i]=w[i];
+  }
+}
+
+/**
+ * Fixed-rule mode: stores the theta-independent values of a record at the
+ * nodes t (weights w) of the rule, as five consecutive blocks of length n:
+ * W1*, W2*, weight times line Jacobian, W1, W2
+ * Bounds must already be set (setBounds)
+ * mutates: cache, param->caseP.nodes
+ */
+void setQuadNodes(Param* param, double* t, double* w, int n, double* cache) {
+  caseParam* caseP=&(param->caseP);
+  double m1=caseP->Wbounds[0][1] - caseP->Wbounds[0][0];
+  double m2=caseP->Wbounds[1][0] - caseP->Wbounds[1][1];
+  double W1,W2,W1p,W2p;
+  int j;
+
+  for (j=0; j<n; j++) {
+    W1=m1*t[j] + caseP->Wbounds[0][0];
+    W2=m2*t[j] + caseP->Wbounds[1][1];
+    if (W1==1 || W1==0 || W2==1 || W2==0) { //impossible point on the line
+      cache[j]=cache[n+j]=cache[2*n+j]=cache[3*n+j]=cache[4*n+j]=0;
+      continue;
+    }
+    W1p=m1/(W1*(1-W1));
+    W2p=m2/(W2*(1-W2));
+    cache[j]=log(W1/(1-W1));
+    cache[n+j]=log(W2/(1-W2));
+    cache[2*n+j]=w[j]*sqrt(W1p*W1p+W2p*W2p);
+    cache[3*n+j]=W1;
+    cache[4*n+j]=W2;
+  }
+  caseP->nodes=cache;
+}
 
 /**
  * Set the bounds on W1 and W2 in their parameter
@@ -6,10 +6,7 @@
 *******************************************************************/
 #include <R_ext/Applic.h>
 
-void NormConstT(double *t, int n, void *param);
-void SuffExp(double *t, int n, void *param);
 double getLogLikelihood(Param* param) ;
-void setNormConst(Param* param);
 double getW2starFromW1star(double X, double Y, double W1, int* imposs);
 double getW1starFromW2star(double X, double Y, double W2, int* imposs);
 double getW1FromW2(double X, double Y, double W2);
@@ -17,7 +14,11 @@ double getW1starFromT(double t, Param* param, int* imposs);
 double getW2starFromT(double t, Param* param, int* imposs);
 double getW1starPrimeFromT(double t, Param* param);
 double getW2starPrimeFromT(double t, Param* param);
-double paramIntegration(integr_fn f, void *ex);
-void setNormConst(Param* param);
+double paramIntegration(integr_fn f, void *ex, int *ier);
+void TomoMoments(double *t, int n, double *fx, int nvec, void *ex);
+int vecIntegration(vec_integr_fn f, void *ex, int nvec, double *result);
+void tomoIntegration(Param* param, double* moments, int lik);
+void gaussLegendre(int n, double a, double b, double* x, double* w);
+void setQuadNodes(Param* param, double* t, double* w, int n, double* cache);
 void setBounds(Param* param);
 
@@ -1,4 +1,3 @@
-
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>      
@@ -9,9 +8,295 @@
 #include "subroutines.h"
 #include "rand.h"
 #include "bayes.h"
+#include "density.h"
 #include "sample.h"
+#include "diagnostic.h"
+#include "drawfile.h"
+
+/* what the chains of cBaseeco share; read only while they run */
+typedef struct baseShared {
+  int n_samp, s_samp, x1_samp, x0_samp, t_samp, n_dim;
+  int n_gen, burn_in, nth, n_store, n_chains, verbose;
+  int x1, x0;
+  int method;                      /* how W is drawn, see wMethod */
+  /* priors and starting values */
+  double *mu0, tau0, **S0;
+  int nu0;
+  double *mustart, *Sigmastart;
+  /* data */
+  double **X, *minW1, *maxW1;
+  double *x1_W1, *x0_W2;           /* homogeneous areas */
+  double **S_W, **S_Wstar;         /* survey data */
+  /* precincts with the same (X, Y) share their grid, and the density on it */
+  int *caseOf, n_case;
+  double **Xcase;
+  gridTable *grid;
+  /* the run */
+  uint64_t seed;                   /* each chain takes a substream */
+  int n_threads;                   /* the most threads to use */
+  int stop;                        /* set when the user interrupts */
+  /* storage for the Gibbs draws, chain after chain */
+  double *pdSMu0, *pdSMu1, *pdSSig00, *pdSSig01, *pdSSig11;
+  double *pdSW1, *pdSW2;
+  /* or, with Wsummary, summaries of W for each chain, and the aggregate
+     W's of each kept draw */
+  int Wsummary, n_agg;
+  double *CI, *aggW;
+  drawSummary **sum;
+  double *pdSAgg;
+  drawFile *wfile;                 /* or the draws of W go to a file */
+  double *pdAccept;                /* Metropolis acceptance rates, summed
+				      over the chains */
+} baseShared;
+
+/* one chain of cBaseeco; its draws go to block chain of the storage */
+static void baseChain(baseShared *d, int chain) {
+  int n_samp = d->n_samp, s_samp = d->s_samp, x1_samp = d->x1_samp;
+  int x0_samp = d->x0_samp, t_samp = d->t_samp, n_dim = d->n_dim;
+  int n_case = d->n_case;
+  double **X = d->X, *minW1 = d->minW1, *maxW1 = d->maxW1;
+  int *caseOf = d->caseOf;
+  double **Xcase = d->Xcase;
+  gridTable *grid = d->grid;
+
+  double **W = doubleMatrix(t_samp, n_dim);       /* The W1 and W2 matrix */
+  double **Wstar = doubleMatrix(t_samp, n_dim);   /* logit tranformed W */       
+  double *Pg = NULL;                              /* cumulative density on the grids */
+  mhLine *mh = NULL;                              /* Metropolis: the W's as arrays */
+  int n_unit = n_samp+x1_samp+x0_samp;            /* units whose W's are kept */
+  drawSummary *sum = NULL;                        /* Wsummary: the W's kept */
+  drawWriter *wout = NULL;                        /* Wfile: the W's written */
+
+  /* model parameters */
+  double *mu = doubleArray(n_dim);                /* The mean */
+  double **Sigma = doubleMatrix(n_dim, n_dim);    /* The covariance matrix */
+  double **InvSigma = doubleMatrix(n_dim, n_dim); /* The inverse covariance matrix */
+
+  /* scratch memory for the samplers, and the threads of the W updates;
+     when chains run side by side, each one draws its W's on its own thread */
+  Workspace *ws = newWorkspace(WS_SIZE);
+  int n_threads = nThreads(d->n_threads);
+
+  /* random numbers: the W updates take one stream per precinct and sweep,
+     the rest is drawn from the serial stream of the chain */
+  uint64_t seed = rngSubseed(d->seed, chain);
+  rngStream crng;
+
+  /* misc variables */
+  int i, j, k, c, main_loop;   /* used for various loops */
+  int itemp, itempS, itempC, itempA, stop;
+  int progress = 1, itempP = ftrunc((double) d->n_gen/10);
+  double dtemp, dtemp1;
+
+  rngSeed(&crng, seed, RNG_SERIAL);
+
+  /* Initialize W, Wstar for n_samp */
+  for (i=0; i< n_samp; i++) {
+    if (X[i][1]!=0 && X[i][1]!=1) {
+      W[i][0]=minW1[i]+(maxW1[i]-minW1[i])*rngUnif(&crng);
+      W[i][1]=(X[i][1]-X[i][0]*W[i][0])/(1-X[i][0]);
+    }
+
+    if (X[i][1]==0) 
+      for (j=0; j<n_dim; j++) W[i][j]=0.0001;
+
+    if (X[i][1]==1) 
+      for (j=0; j<n_dim; j++) W[i][j]=0.9999;
+
+    for (j=0; j<n_dim; j++)
+      Wstar[i][j]=log(W[i][j])-log(1-W[i][j]);
+  }
+
+  /* read homeogenous areas information */
+  if (d->x1==1) 
+    for (i=0; i<x1_samp; i++) {
+      W[(n_samp+i)][0]=d->x1_W1[i];
+
+      if (W[(n_samp+i)][0]==0) 
+	W[(n_samp+i)][0]=0.0001;
+
+      if (W[(n_samp+i)][0]==1) 
+	W[(n_samp+i)][0]=0.9999;
+
+      Wstar[(n_samp+i)][0]=log(W[(n_samp+i)][0])-log(1-W[(n_samp+i)][0]);
+    }
+
+  if (d->x0==1) 
+    for (i=0; i<x0_samp; i++) {
+      W[(n_samp+x1_samp+i)][1]=d->x0_W2[i];
+
+      if (W[(n_samp+x1_samp+i)][1]==0) 
+	W[(n_samp+x1_samp+i)][1]=0.0001;
+      
+      if (W[(n_samp+x1_samp+i)][1]==1) 
+	W[(n_samp+x1_samp+i)][1]=0.9999;
+
+      Wstar[(n_samp+x1_samp+i)][1]=log(W[(n_samp+x1_samp+i)][1])-log(1-W[(n_samp+x1_samp+i)][1]);
+    }
+
+  /* the survey data */
+  for (i=0; i<s_samp; i++)
+    for (j=0; j<n_dim; j++) {
+      W[(n_samp+x1_samp+x0_samp+i)][j]=d->S_W[i][j];
+      Wstar[(n_samp+x1_samp+x0_samp+i)][j]=d->S_Wstar[i][j];
+    }
+
+  /* counters */
+  itempA=chain*d->n_store;                        /* for the parameters */
+  itempS=chain*d->n_store*n_unit;                 /* for W */
+  itempC=0; /* control nth draw */
+
+  if (d->method==W_GRID)
+    Pg = Calloc(grid->start[n_case], double);
+  if (d->method==W_METROPOLIS)
+    mh = MHPrep(X, minW1, maxW1, W, n_samp);
+  if (d->Wsummary)
+    sum = d->sum[chain] = newSummary(2*n_unit, d->CI);
+  if (d->wfile)
+    wout = newDrawWriter(d->wfile, chain);
+    
+  /* starting vales of mu and Sigma */
+  itemp = 0;
+  for(j=0;j<n_dim;j++){
+    mu[j] = d->mustart[j];
+
+    for(k=0;k<n_dim;k++)
+      Sigma[j][k]=d->Sigmastart[itemp++];
+  }
+  dinv(Sigma, n_dim, InvSigma);
+
+
+  for(main_loop=0; main_loop<d->n_gen; main_loop++){
+    /** update W, Wstar given mu, Sigma in regular areas **/
+    /* the W's are independent given mu and Sigma, and are drawn on
+       several threads; W_i uses its own stream for this sweep (the
+       Metropolis sampler one per block of W's, see rMHSweep), so the
+       draws do not depend on the number of threads */
+    if (d->method==W_GRID) {
+#pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1)
+      for (c=0; c<n_case; c++)
+	if ( Xcase[c][1]!=0 && Xcase[c][1]!=1 )
+	  GridProb(Pg+grid->start[c], grid, c, mu, InvSigma);
+    }
+
+    if (d->method==W_METROPOLIS)
+      rMHSweep(mh, mu, mu+1, 0, InvSigma, seed, (uint64_t)main_loop*t_samp,
+	       n_threads, W, Wstar);
+    else {
+#pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1)
+      for (i=0;i<n_samp;i++){
+	rngStream rng;
+	if ( X[i][1]!=0 && X[i][1]!=1 ) {
+	  rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+i);
+	  if (d->method==W_GRID)
+	    rGridDraw(W[i], grid, caseOf[i], Pg+grid->start[caseOf[i]], &rng);
+	  else
+	    rSlice(W[i], X[i], minW1[i], maxW1[i], mu, InvSigma, &rng);
+	  /*3 compute Wsta_i from W_i*/
+	  Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
+	  Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
+	}
+      }
+    }
+
+    /* update W2 given W1, mu and Sigma in x1 homeogeneous areas */
+    if (d->x1==1) {
+      dtemp1=Sigma[1][1]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
+      dtemp1=sqrt(dtemp1);
+#pragma omp parallel for private(dtemp) schedule(static) num_threads(n_threads) if(n_threads>1)
+      for (i=0; i<x1_samp; i++) {
+	rngStream rng;
+	rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+n_samp+i);
+	dtemp=mu[1]+Sigma[0][1]/Sigma[0][0]*(Wstar[n_samp+i][0]-mu[0]);
+	Wstar[n_samp+i][1]=dtemp+dtemp1*rngNorm(&rng);
+	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
+      }
+    }
+    
+    /* update W1 given W2, mu and Sigma in x0 homeogeneous areas */
+    if (d->x0==1) {
+      dtemp1=Sigma[0][0]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
+      dtemp1=sqrt(dtemp1);
+#pragma omp parallel for private(dtemp) schedule(static) num_threads(n_threads) if(n_threads>1)
+      for (i=0; i<x0_samp; i++) {
+	rngStream rng;
+	rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+n_samp+x1_samp+i);
+	dtemp=mu[0]+Sigma[0][1]/Sigma[1][1]*(Wstar[n_samp+x1_samp+i][1]-mu[1]);
+	Wstar[n_samp+x1_samp+i][0]=dtemp+dtemp1*rngNorm(&rng);
+	W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
+      }
+    }
+    
+    /* update mu, Sigma given wstar using effective sample of Wstar */
+    NIWupdate(Wstar, mu, Sigma, InvSigma, d->mu0, d->tau0, d->nu0, d->S0,
+	      t_samp, n_dim, &crng, ws);
+    
+    /*store Gibbs draw after burn-in and every nth draws */      
+    if (main_loop>=d->burn_in){
+      itempC++;
+
+      if (itempC==d->nth){
+	d->pdSMu0[itempA]=mu[0];
+	d->pdSMu1[itempA]=mu[1];
+	d->pdSSig00[itempA]=Sigma[0][0];
+	d->pdSSig01[itempA]=Sigma[0][1];
+	d->pdSSig11[itempA]=Sigma[1][1];
+
+	if (sum)
+	  summaryDrawW(sum, W, n_unit, d->aggW, d->n_agg,
+		       d->pdSAgg+itempA*2*d->n_agg, n_threads);
+	else if (wout)
+	  drawPutW(wout, W);
+	else
+	  for(i=0; i<n_unit; i++){
+	    d->pdSW1[itempS]=W[i][0];
+	    d->pdSW2[itempS]=W[i][1];
+	    itempS++;
+	  }
+	itempA++;
+	itempC=0;
+      }
+    } 
+
+    /* only the main thread may talk to R */
+    if (threadNum()==0) {
+      if (d->verbose)
+	if (itempP == main_loop) {
+	  if (d->n_chains>1)
+	    Rprintf("chain %d: ", chain+1);
+	  Rprintf("%3d percent done.\n", progress*10);
+	  itempP+=ftrunc((double) d->n_gen/10); progress++;
+	  R_FlushConsole();
+	}
+      if (checkInterrupt()) {
+#pragma omp atomic write
+	d->stop=1;
+      }
+    }
+#pragma omp atomic read
+    stop=d->stop;
+    if (stop) break;
+  } /* end of Gibbs sampler */ 
+
+  if (wout) closeDrawWriter(wout);
+  FreeMatrix(W, t_samp);
+  FreeMatrix(Wstar, t_samp);
+  if (Pg) free(Pg);
+  if (mh) {
+#pragma omp critical
+    MHAcceptRate(mh, d->n_gen, d->pdAccept);
+    FreeMH(mh);
+  }
+  free(mu);
+  FreeMatrix(Sigma,n_dim);
+  FreeMatrix(InvSigma, n_dim);
+  FreeWorkspace(ws);
+}
 
-/* Normal Parametric Model for 2x2 Tables */
+/* Normal Parametric Model for 2x2 Tables
+   With n_chains > 1 the chains run side by side on separate threads,
+   each with its own random number streams, and share the data and the
+   grids; their draws are stored one chain after the other */
 void cBaseeco(
 	      /*data input */
 	      double *pdX,     /* data (X, Y) */
@@ -52,15 +337,38 @@ void cBaseeco(
 
 	      /* flags */
 	      int *parameter,  /* 1 if save population parameter */
-	      int *Grid,       /* 1 if Grid algorithm is used; 0 for
-				  Metropolis */
-
-	      /* storage for Gibbs draws of mu/sigmat*/
+	      int *Grid,       /* how W is drawn: 0 for Metropolis, 1 for
+				  the grid, 2 for slice sampling */
+	      int *pin_step,   /* Grid: grid points per unit length of W1 */
+	      int *pin_chains, /* number of chains */
+	      int *pin_threads, /* most threads to use */
+	      int *Wsummary,   /* 1 to keep summaries of W instead of its draws */
+	      double *pdCI,    /* Wsummary: probabilities of the two quantiles */
+	      int *pin_agg,    /* Wsummary: number of sets of weights of the
+				  aggregate W's */
+	      double *pdAggW,  /* Wsummary: the weights, see summaryDrawW */
+	      char **Wfile,    /* if not "", the draws of W go to this file
+				  (see drawfile.c) instead of pdSW1, pdSW2 */
+
+	      /* storage for Gibbs draws of mu/sigmat, n_chains blocks */
 	      double *pdSMu0, double *pdSMu1, 
 	      double *pdSSig00, double *pdSSig01, double *pdSSig11,
            
-	      /* storage for Gibbs draws of W*/
-	      double *pdSW1, double *pdSW2
+	      /* storage for Gibbs draws of W, n_chains blocks */
+	      double *pdSW1, double *pdSW2,
+
+	      /* Wsummary: mean, sd and the two quantiles of W1 and W2 of
+		 each unit, and the aggregate W's of each kept draw,
+		 n_chains blocks */
+	      double *pdWSum, double *pdSAgg,
+
+	      /* split R-hat and bulk effective sample size of mu1, mu2,
+		 Sigma11, Sigma12 and Sigma22 */
+	      double *pdRhat, double *pdEss,
+
+	      /* Metropolis: acceptance rate of each precinct, averaged over
+		 the chains; NA where W is not drawn by Metropolis */
+	      double *pdAccept
 	      ){	   
   
   /* some integers */
@@ -69,41 +377,38 @@ void cBaseeco(
   int x1_samp = *sampx1;     /* sample size for X=1 */
   int x0_samp = *sampx0;     /* sample size for X=0 */
   int t_samp = n_samp+s_samp+x1_samp+x0_samp;  /* total sample size */
-  int nth = *pinth;  
   int n_dim = 2;             /* dimension */
-  int n_step = 1000;         /* 1/The default size of grid step */  
+  int n_step = *pin_step;    /* 1/The size of grid step */  
+  int n_chains = *pin_chains; /* number of chains */
+  int n_store = (*n_gen-*burn_in)/(*pinth); /* kept draws per chain */
 
   /* prior parameters */ 
-  double tau0 = *pdtau0;                          /* prior scale */
-  int nu0 = *pinu0;                               /* prior degrees of freedom */   
   double **S0 = doubleMatrix(n_dim, n_dim);       /* The prior S parameter for InvWish */
 
   /* data */
   double **X = doubleMatrix(n_samp, n_dim);       /* The Y and covariates */
-  double **W = doubleMatrix(t_samp, n_dim);       /* The W1 and W2 matrix */
-  double **Wstar = doubleMatrix(t_samp, n_dim);   /* logit tranformed W */       
   double **S_W = doubleMatrix(s_samp, n_dim);     /* The known W1 and W2 matrix*/
   double **S_Wstar = doubleMatrix(s_samp, n_dim); /* logit transformed S_W*/
 
-  /* grids */
-  double **W1g = doubleMatrix(n_samp, n_step);    /* grids for W1 */
-  double **W2g = doubleMatrix(n_samp, n_step);    /* grids for W2 */
-  int *n_grid = intArray(n_samp);                 /* grid size */
+  /* precincts with the same (X, Y) share their grid, and the density on it */
+  int *caseOf = intArray(n_samp);                 /* case of each precinct */
+  int *caseFirst = intArray(n_samp);              /* first precinct of each case */
+  int *caseCount = intArray(n_samp);              /* number of precincts of each case */
+  int n_case = uniqueXY(pdX, pdX+n_samp, n_samp, caseOf, caseFirst, caseCount);
+  double **Xcase = doubleMatrix(n_case, n_dim);   /* (X, Y) of each case */
+  double *minW1case = doubleArray(n_case);        /* bounds of W1 of each case */
+  double *maxW1case = doubleArray(n_case);
 
-  /* model parameters */
-  double *mu = doubleArray(n_dim);                /* The mean */
-  double **Sigma = doubleMatrix(n_dim, n_dim);    /* The covariance matrix */
-  double **InvSigma = doubleMatrix(n_dim, n_dim); /* The inverse covariance matrix */
+  /* what the chains share */
+  baseShared d;
+  double *draws[5] = {pdSMu0, pdSMu1, pdSSig00, pdSSig01, pdSSig11};
 
   /* misc variables */
-  int i, j, k, main_loop;   /* used for various loops */
-  int itemp, itempS, itempC, itempA;
-  int progress = 1, itempP = ftrunc((double) *n_gen/10);
-  double dtemp, dtemp1;
+  int i, j, k, c, n_threads;   /* used for various loops */
+  int itemp;
 
   /* get random seed */
   GetRNGstate();
-  
 
   /* read the priors */
   itemp=0;
@@ -117,51 +422,6 @@ void cBaseeco(
     for (i = 0; i < n_samp; i++) 
       X[i][j] = pdX[itemp++];
 
-
-  /* Initialize W, Wstar for n_samp */
-  for (i=0; i< n_samp; i++) {
-    if (X[i][1]!=0 && X[i][1]!=1) {
-      W[i][0]=runif(minW1[i], maxW1[i]);
-      W[i][1]=(X[i][1]-X[i][0]*W[i][0])/(1-X[i][0]);
-    }
-
-    if (X[i][1]==0) 
-      for (j=0; j<n_dim; j++) W[i][j]=0.0001;
-
-    if (X[i][1]==1) 
-      for (j=0; j<n_dim; j++) W[i][j]=0.9999;
-
-    for (j=0; j<n_dim; j++)
-      Wstar[i][j]=log(W[i][j])-log(1-W[i][j]);
-  }
-
-  /* read homeogenous areas information */
-  if (*x1==1) 
-    for (i=0; i<x1_samp; i++) {
-      W[(n_samp+i)][0]=x1_W1[i];
-
-      if (W[(n_samp+i)][0]==0) 
-	W[(n_samp+i)][0]=0.0001;
-
-      if (W[(n_samp+i)][0]==1) 
-	W[(n_samp+i)][0]=0.9999;
-
-      Wstar[(n_samp+i)][0]=log(W[(n_samp+i)][0])-log(1-W[(n_samp+i)][0]);
-    }
-
-  if (*x0==1) 
-    for (i=0; i<x0_samp; i++) {
-      W[(n_samp+x1_samp+i)][1]=x0_W2[i];
-
-      if (W[(n_samp+x1_samp+i)][1]==0) 
-	W[(n_samp+x1_samp+i)][1]=0.0001;
-      
-      if (W[(n_samp+x1_samp+i)][1]==1) 
-	W[(n_samp+x1_samp+i)][1]=0.9999;
-
-      Wstar[(n_samp+x1_samp+i)][1]=log(W[(n_samp+x1_samp+i)][1])-log(1-W[(n_samp+x1_samp+i)][1]);
-    }
-
   /* read the survey data */
   if (*survey==1) {
     itemp = 0;
@@ -177,126 +437,83 @@ void cBaseeco(
 	  S_W[i][j]=0.9999;
 
 	S_Wstar[i][j]=log(S_W[i][j])-log(1-S_W[i][j]);
-	W[(n_samp+x1_samp+x0_samp+i)][j]=S_W[i][j];
-	Wstar[(n_samp+x1_samp+x0_samp+i)][j]=S_Wstar[i][j];
       }
   }
 
-  /* counters */
-  itempA=0; /* for alpha */
-  itempS=0; /* for storage */
-  itempC=0; /* control nth draw */
-
   /*** calculate grids ***/
-  if (*Grid) 
-    GridPrep(W1g, W2g, X, maxW1, minW1, n_grid, n_samp, n_step);
-    
-  /* starting vales of mu and Sigma */
-  itemp = 0;
-  for(j=0;j<n_dim;j++){
-    mu[j] = mustart[j];
-
-    for(k=0;k<n_dim;k++)
-      Sigma[j][k]=Sigmastart[itemp++];
+  for (c=0; c<n_case; c++) {
+    for (j=0; j<n_dim; j++) Xcase[c][j]=X[caseFirst[c]][j];
+    minW1case[c]=minW1[caseFirst[c]];
+    maxW1case[c]=maxW1[caseFirst[c]];
   }
-  dinv(Sigma, n_dim, InvSigma);
 
+  d.n_samp=n_samp; d.s_samp=s_samp;
+  d.x1_samp=x1_samp; d.x0_samp=x0_samp; d.t_samp=t_samp; d.n_dim=n_dim;
+  d.n_gen=*n_gen; d.burn_in=*burn_in; d.nth=*pinth; d.n_store=n_store;
+  d.n_chains=n_chains; d.verbose=*verbose;
+  d.x1=*x1; d.x0=*x0; d.method=*Grid;
+  d.mu0=mu0; d.tau0=*pdtau0; d.S0=S0; d.nu0=*pinu0;
+  d.mustart=mustart; d.Sigmastart=Sigmastart;
+  d.X=X; d.minW1=minW1; d.maxW1=maxW1; d.x1_W1=x1_W1; d.x0_W2=x0_W2;
+  d.S_W=S_W; d.S_Wstar=S_Wstar;
+  d.caseOf=caseOf; d.n_case=n_case; d.Xcase=Xcase;
+  d.grid = (*Grid==W_GRID) ? GridPrep(Xcase, maxW1case, minW1case, n_case, n_step) : NULL;
+  d.seed=rngSeedFromR(); d.stop=0; d.n_threads=*pin_threads;
+  d.pdSMu0=pdSMu0; d.pdSMu1=pdSMu1;
+  d.pdSSig00=pdSSig00; d.pdSSig01=pdSSig01; d.pdSSig11=pdSSig11;
+  d.pdSW1=pdSW1; d.pdSW2=pdSW2;
+  d.Wsummary=*Wsummary; d.CI=pdCI; d.n_agg=*pin_agg; d.aggW=pdAggW;
+  d.sum = *Wsummary ? (drawSummary **) R_alloc(n_chains, sizeof(drawSummary *)) : NULL;
+  d.pdSAgg=pdSAgg;
+  d.wfile = (!*Wsummary && Wfile[0][0]) ?
+    openDrawFile(Wfile[0], 2, n_samp+x1_samp+x0_samp, n_chains, n_store) : NULL;
+  d.pdAccept=pdAccept;
+  for (i=0; i<n_samp+x1_samp+x0_samp; i++)
+    pdAccept[i] = (*Grid==W_METROPOLIS && i<n_samp && X[i][1]!=0 && X[i][1]!=1) ? 0 : NA_REAL;
 
-  
   /*** Gibbs sampler! ***/
   if (*verbose)
     Rprintf("Starting Gibbs Sampler...\n");
 
-  for(main_loop=0; main_loop<*n_gen; main_loop++){
-    /** update W, Wstar given mu, Sigma in regular areas **/
-
-    for (i=0;i<n_samp;i++){
-      if ( X[i][1]!=0 && X[i][1]!=1 ) {
-
-	if (*Grid)
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu, InvSigma, n_dim);
-	else 
-	  rMH(W[i], X[i], minW1[i], maxW1[i], mu, InvSigma, n_dim);
-      } 
-      /*3 compute Wsta_i from W_i*/
-      Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
-      Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
-    }
-
-    
-    /* update W2 given W1, mu and Sigma in x1 homeogeneous areas */
-    if (*x1==1)
-      for (i=0; i<x1_samp; i++) {
-	dtemp=mu[1]+Sigma[0][1]/Sigma[0][0]*(Wstar[n_samp+i][0]-mu[0]);
-	dtemp1=Sigma[1][1]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
-	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+i][1]=rnorm(dtemp, dtemp1);
-	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
-      }
-    
-    /* update W1 given W2, mu and Sigma in x0 homeogeneous areas */
-    if (*x0==1)
-      for (i=0; i<x0_samp; i++) {
-	dtemp=mu[0]+Sigma[0][1]/Sigma[1][1]*(Wstar[n_samp+x1_samp+i][1]-mu[1]);
-	dtemp1=Sigma[0][0]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
-	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+x1_samp+i][0]=rnorm(dtemp, dtemp1);
-	W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
-      }
-    
-    /* update mu, Sigma given wstar using effective sample of Wstar */
-    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim);
-    
-    /*store Gibbs draw after burn-in and every nth draws */      
-    if (main_loop>=*burn_in){
-      itempC++;
-
-      if (itempC==nth){
-	pdSMu0[itempA]=mu[0];
-	pdSMu1[itempA]=mu[1];
-	pdSSig00[itempA]=Sigma[0][0];
-	pdSSig01[itempA]=Sigma[0][1];
-	pdSSig11[itempA]=Sigma[1][1];
-	itempA++;
-
-	for(i=0; i<(n_samp+x1_samp+x0_samp); i++){
-	  pdSW1[itempS]=W[i][0];
-	  pdSW2[itempS]=W[i][1];
-	  itempS++;
-	}
-	itempC=0;
-      }
-    } 
-
+  n_threads=nThreads(*pin_threads);
+#pragma omp parallel for schedule(dynamic,1) num_threads(n_threads) if(n_threads>1 && n_chains>1)
+  for (c=0; c<n_chains; c++)
+    baseChain(&d, c);
 
-    if (*verbose)
-      if (itempP == main_loop) {
-	Rprintf("%3d percent done.\n", progress*10);
-	itempP+=ftrunc((double) *n_gen/10); progress++;
-	R_FlushConsole();
-      }
-    R_CheckUserInterrupt();
-  } /* end of Gibbs sampler */ 
-
-  if(*verbose)
+  if(*verbose && !d.stop)
     Rprintf("100 percent done.\n");
 
+  /** convergence diagnostics **/
+  if (!d.stop) {
+    for (j=0; j<5; j++)
+      mcmcDiag(draws[j], n_chains, n_store, pdRhat+j, pdEss+j);
+    for (i=0; i<n_samp; i++)
+      if (!ISNAN(pdAccept[i])) pdAccept[i]/=n_chains;
+    if (d.sum)
+      summaryWrite(d.sum, n_chains, pdWSum);
+  }
+  if (d.sum)
+    for (c=0; c<n_chains; c++)
+      FreeSummary(d.sum[c]);
+
   /** write out the random seed **/
   PutRNGstate();
 
   /* Freeing the memory */
   FreeMatrix(X, n_samp);
-  FreeMatrix(W, t_samp);
-  FreeMatrix(Wstar, t_samp);
   FreeMatrix(S_W, s_samp);
   FreeMatrix(S_Wstar, s_samp);
   FreeMatrix(S0, n_dim);
-  FreeMatrix(W1g, n_samp);
-  FreeMatrix(W2g, n_samp);
-  free(n_grid);
-  free(mu);
-  FreeMatrix(Sigma,n_dim);
-  FreeMatrix(InvSigma, n_dim);
-  
-} /* main */
+  if (d.grid) FreeGrid(d.grid);
+  FreeMatrix(Xcase, n_case);
+  free(minW1case);
+  free(maxW1case);
+  free(caseOf);
+  free(caseFirst);
+  free(caseCount);
+  if (d.wfile) closeDrawFile(d.wfile);
+
+  if (d.stop)
+    error("interrupted by the user\n");
 
+} /* main */
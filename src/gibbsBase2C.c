@@ -8,6 +8,7 @@
 #include "rand.h"
 #include "bayes.h"
 #include "sample.h"
+#include "drawfile.h"
 
 /* Normal Parametric Model for 2xC (with C > 2) Tables */
 void cBase2C(
@@ -40,6 +41,8 @@ void cBase2C(
 	     
 	     /* storage */
 	     int *parameter,  /* 1 if save population parameter */
+	     char **Wfile,    /* if not "", the draws of W go to this file
+				 (see drawfile.c) instead of pdSW */
 	     double *pdSmu, 
 	     double *pdSSigma,
 	     double *pdSW
@@ -68,6 +71,14 @@ void cBase2C(
   double **Sigma = doubleMatrix(n_col, n_col);    /* The covariance matrix */
   double **InvSigma = doubleMatrix(n_col, n_col); /* The inverse covariance matrix */
 
+  /* scratch memory for the samplers */
+  Workspace *ws = newWorkspace(WS_SIZE);
+
+  /* Wfile: the W's written */
+  drawFile *wfile = NULL;
+  drawWriter *wout = NULL;
+  double *slot;
+
   /* misc variables */
   int i, j, k, main_loop;   /* used for various loops */
   int itemp;
@@ -75,7 +86,7 @@ void cBase2C(
   int itempS = 0; /* for Sigma */
   int itempW = 0; /* for W */
   int itempC = 0; /* control nth draw */
-  int progress = 1, itempP = ftrunc((double) *n_gen/10);
+  int progress = 1, itempP = ftrunc((double) *n_gen/10), stop = 0;
   double dtemp, dtemp1;
   double *param = doubleArray(n_col);   /* Dirichlet parameters */
   double *dvtemp = doubleArray(n_col);
@@ -112,7 +123,7 @@ void cBase2C(
   for (i = 0; i < n_samp; i++) {
     k = 0; itemp = 1;
     while (itemp > 0) { /* rejection sampling */
-      rDirich(dvtemp, param, n_col);
+      rDirich(dvtemp, param, n_col, NULL);
       itemp = 0; k++;
       for (j = 0; j < n_col; j++)
 	if (dvtemp[j] > maxU[i][j] || dvtemp[j] < minU[i][j])
@@ -143,6 +154,11 @@ void cBase2C(
     for(j = 0; j < n_col; j++) 
       S0[j][k] = pdS0[itemp++];
 
+  if (Wfile[0][0]) {
+    wfile = openDrawFile(Wfile[0], n_col, n_samp, 1, (*n_gen-*burn_in)/nth);
+    wout = newDrawWriter(wfile, 0);
+  }
+
   /*** Gibbs sampler! ***/
   if (*verbose)
     Rprintf("Starting Gibbs sampler...\n");
@@ -150,13 +166,13 @@ void cBase2C(
     /** update W, Wstar given mu, Sigma **/
     for (i = 0; i < n_samp; i++){
       rMH2c(W[i], X[i], Y[i], minU[i], maxU[i], mu, InvSigma, n_col,
-	    *maxit, *reject);
+	    *maxit, *reject, ws);
       for (j = 0; j < n_col; j++) 
 	Wstar[i][j] = log(W[i][j])-log(1-W[i][j]);
     }
     
     /* update mu, Sigma given wstar using effective sample of Wstar */
-    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, n_samp, n_col);
+    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, n_samp, n_col, NULL, ws);
     
     /*store Gibbs draw after burn-in and every nth draws */      
     if (main_loop>=*burn_in){
@@ -168,9 +184,17 @@ void cBase2C(
 	    if (j <=k)
 	      pdSSigma[itempS++]=Sigma[j][k];
 	}
-	for(i = 0; i < n_samp; i++)
-	  for (j = 0; j < n_col; j++)
-	    pdSW[itempW++] = W[i][j];
+	if (wout) {
+	  slot = drawSlot(wout);
+	  for(i = 0; i < n_samp; i++)
+	    for (j = 0; j < n_col; j++)
+	      slot[j*n_samp+i] = W[i][j];
+	  drawCommit(wout);
+	}
+	else
+	  for(i = 0; i < n_samp; i++)
+	    for (j = 0; j < n_col; j++)
+	      pdSW[itempW++] = W[i][j];
 	itempC=0;
       }
     } 
@@ -180,16 +204,23 @@ void cBase2C(
 	itempP+=ftrunc((double) *n_gen/10); progress++;
 	R_FlushConsole();
       }
-    R_CheckUserInterrupt();
+    if (checkInterrupt()) {
+      stop = 1;
+      break;
+    }
   } /* end of Gibbs sampler */ 
 
-  if(*verbose)
+  if(*verbose && !stop)
     Rprintf("100 percent done.\n");
 
   /** write out the random seed **/
   PutRNGstate();
 
   /* Freeing the memory */
+  if (wfile) {
+    closeDrawWriter(wout);
+    closeDrawFile(wfile);
+  }
   FreeMatrix(S0, n_col);
   FreeMatrix(X, n_samp);
   FreeMatrix(W, n_samp);
@@ -200,5 +231,10 @@ void cBase2C(
   FreeMatrix(InvSigma, n_col);
   free(dvtemp);
   free(param);
+  FreeWorkspace(ws);
+
+  if (stop)
+    error("interrupted by the user\n");
+
 } /* main */
 
@@ -9,6 +9,7 @@
 #include "rand.h"
 #include "bayes.h"
 #include "sample.h"
+#include "drawfile.h"
 
 /* Normal Parametric Model for RxC (with R >= 2, C >= 2) Tables */
 void cBaseRC(
@@ -42,6 +43,8 @@ void cBaseRC(
 	     
 	     /* storage */
 	     int *parameter,  /* 1 if save population parameter */
+	     char **Wfile,    /* if not "", the draws of W go to this file
+				 (see drawfile.c) instead of pdSW */
 	     double *pdSmu, 
 	     double *pdSSigma,
 	     double *pdSW
@@ -75,6 +78,14 @@ void cBaseRC(
   double ***Sigma = doubleMatrix3D(n_col, n_dim, n_dim);    /* covariance */
   double ***InvSigma = doubleMatrix3D(n_col, n_dim, n_dim); /* inverse */
 
+  /* scratch memory for the samplers */
+  Workspace *ws = newWorkspace(WS_SIZE);
+
+  /* Wfile: the W's written */
+  drawFile *wfile = NULL;
+  drawWriter *wout = NULL;
+  double *slot;
+
   /* misc variables */
   int i, j, k, l, main_loop;   /* used for various loops */
   int itemp, counter;
@@ -82,7 +93,7 @@ void cBaseRC(
   int itempS = 0;           /* for Sigma */
   int itempW = 0;           /* for W */
   int itempC = 0;           /* control nth draw */
-  int progress = 1, itempP = ftrunc((double) *n_gen/10);
+  int progress = 1, itempP = ftrunc((double) *n_gen/10), stop = 0;
   double dtemp, dtemp1;
   double *param = doubleArray(n_col);   /* Dirichlet parameters */
   double *dvtemp = doubleArray(n_col);
@@ -126,13 +137,13 @@ void cBaseRC(
   /* initial values for W */
   for (k = 0; k < n_col; k++)
     param[k] = 1.0;
-  for (i = 0; i < n_samp; i++) {
+  for (i = 0; i < n_samp && !stop; i++) {
     for (k = 0; k < n_col; k++)
       Wsum[i][k] = 0.0;
-    for (j = 0; j < n_dim; j++) {
+    for (j = 0; j < n_dim && !stop; j++) {
       counter = 0; itemp = 1; 
       while (itemp > 0) { /* first try rejection sampling */
-	rDirich(dvtemp, param, n_col);
+	rDirich(dvtemp, param, n_col, NULL);
 	itemp = 0;
 	for (k = 0; k < n_col; k++) {
 	  if (dvtemp[k] < minU[i][j][k] || 
@@ -159,7 +170,10 @@ void cBaseRC(
 	  W[i][j][n_col-1] = dtemp;
 	  Wsum[i][n_col-1] += dtemp;
 	}
-	R_CheckUserInterrupt();
+	if (checkInterrupt()) {
+	  stop = 1;
+	  break;
+	}
       }
       for (l = 0; l < n_dim; l++) 
 	for (k = 0; k < n_col; k++)
@@ -173,10 +187,15 @@ void cBaseRC(
     for(j = 0; j < n_dim; j++) 
       S0[j][k] = pdS0[itemp++];
 
+  if (Wfile[0][0] && !stop) {
+    wfile = openDrawFile(Wfile[0], n_dim*n_col, n_samp, 1, (*n_gen-*burn_in)/nth);
+    wout = newDrawWriter(wfile, 0);
+  }
+
   /*** Gibbs sampler! ***/
   if (*verbose)
     Rprintf("Starting Gibbs sampler...\n");
-  for(main_loop = 0; main_loop < *n_gen; main_loop++){
+  for(main_loop = 0; main_loop < *n_gen && !stop; main_loop++){
     /** update W, Wstar given mu, Sigma **/
     for (i = 0; i < n_samp; i++) {
       /* sampling W through Metropolis Step for each row */
@@ -190,7 +209,7 @@ void cBaseRC(
 	/* Sample a candidate draw of W from truncated Dirichlet */
 	l = 0; itemp = 1;
 	while (itemp > 0) {
-	  rDirich(dvtemp, param, n_col);
+	  rDirich(dvtemp, param, n_col, NULL);
 	  itemp = 0;
 	  for (k = 0; k < n_col; k++) 
 	    if (dvtemp[k] > maxU[k] || dvtemp[k] < minU[i][j][k])
@@ -233,7 +252,7 @@ void cBaseRC(
     /* update mu, Sigma given wstar using effective sample of Wstar */
     for (k = 0; k < n_col; k++)
       NIWupdate(Wstar[k], mu[k], Sigma[k], InvSigma[k], mu0, tau0,
-		nu0, S0, n_samp, n_dim); 
+		nu0, S0, n_samp, n_dim, NULL, ws); 
     
     /*store Gibbs draw after burn-in and every nth draws */     
     if (main_loop >= *burn_in){
@@ -246,10 +265,19 @@ void cBaseRC(
 	      if (j <= i)
 		pdSSigma[itempS++]=Sigma[k][j][i];
 	  }
-	for(i = 0; i < n_samp; i++)
-	  for (k = 0; k < n_col; k++)
-	    for (j = 0; j < n_dim; j++)
-	      pdSW[itempW++] = W[i][j][k];
+	if (wout) {
+	  slot = drawSlot(wout);
+	  for(i = 0; i < n_samp; i++)
+	    for (k = 0; k < n_col; k++)
+	      for (j = 0; j < n_dim; j++)
+		slot[(k*n_dim+j)*n_samp+i] = W[i][j][k];
+	  drawCommit(wout);
+	}
+	else
+	  for(i = 0; i < n_samp; i++)
+	    for (k = 0; k < n_col; k++)
+	      for (j = 0; j < n_dim; j++)
+		pdSW[itempW++] = W[i][j][k];
 	itempC=0;
       }
     }
@@ -260,15 +288,22 @@ void cBaseRC(
 	itempP+=ftrunc((double) *n_gen/10); progress++;
 	R_FlushConsole();
       }
-    R_CheckUserInterrupt();
+    if (checkInterrupt()) {
+      stop = 1;
+      break;
+    }
   } /* end of Gibbs sampler */ 
-  if (*verbose)
+  if (*verbose && !stop)
     Rprintf("100 percent done.\n");
 
   /** write out the random seed **/
   PutRNGstate();
 
   /* Freeing the memory */
+  if (wfile) {
+    closeDrawWriter(wout);
+    closeDrawFile(wfile);
+  }
   FreeMatrix(S0, n_col);
   FreeMatrix(X, n_samp);
   FreeMatrix(Y, n_samp);
@@ -281,5 +316,10 @@ void cBaseRC(
   Free3DMatrix(InvSigma, n_col, n_dim);
   free(param);
   free(dvtemp);
+  FreeWorkspace(ws);
+
+  if (stop)
+    error("interrupted by the user\n");
+
 } /* main */
 
@@ -4,155 +4,111 @@
 #include <math.h>
 #include <Rmath.h>
 #include <R.h>
+#include <Rinternals.h>
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
 #include "bayes.h"
 #include "sample.h"
-
-void cDPeco(
-	    /*data input */
-	    double *pdX,     /* data (X, Y) */
-	    int *pin_samp,   /* sample size */
-
-	    /*MCMC draws */
-	    int *n_gen,      /* number of gibbs draws */ 
-	    int *burn_in,    /* number of draws to be burned in */
-	    int *pinth,      /* keep every nth draw */
-	    int *verbose,    /* 1 for output monitoring */
-
-	    /* prior specification*/
-	    int *pinu0,      /* prior df parameter for InvWish */
-	    double *pdtau0,  /* prior scale parameter for Sigma under G0*/ 
-	    double *mu0,     /* prior mean for mu under G0 */
-	    double *pdS0,    /* prior scale for Sigma */
-
-	    /* DP prior specification */
-	    double *alpha0,  /* precision parameter, can be fixed or updated*/
-	    int *pinUpdate,  /* 1 if alpha gets updated */
-	    double *pda0, double *pdb0, /* prior for alpha if alpha updated*/  
-
-	    /*incorporating survey data */
-	    int *survey,     /* 1 if survey data available (set of W_1, W_2) */
-	                     /* 0 otherwise*/
-	    int *sur_samp,   /* sample size of survey data*/
-	    double *sur_W,   /* set of known W_1, W_2 */
-
-	    /*incorporating homeogenous areas */
-	    int *x1,         /* 1 if X=1 type areas available 
-				W_1 known, W_2 unknown */
-	    int *sampx1,     /* number X=1 type areas */
-	    double *x1_W1,   /* values of W_1 for X1 type areas */
-
-	    int *x0,         /* 1 if X=0 type areas available 
-				W_2 known, W_1 unknown */
-	    int *sampx0,     /* number X=0 type areas */
-	    double *x0_W2,   /* values of W_2 for X0 type areas */
-
-	    /* bounds of W1 */
-	    double *minW1, double *maxW1,
-
-	    /* storage */
-	    int *parameter,  /* 1 if save population parameter */
-	    int *Grid,       /* 1 if Grid algorithm used; \
-				0 if Metropolis algorithm used*/
-
-	    /* storage for Gibbs draws of mu/sigmat*/
-	    double *pdSMu0, double *pdSMu1, 
-	    double *pdSSig00, double *pdSSig01, double *pdSSig11,           
-	    /* storage for Gibbs draws of W*/
-	    double *pdSW1, double *pdSW2,
-	    /* storage for Gibbs draws of alpha */
-	    double *pdSa,
-	    /* storage for nstar at each Gibbs draw*/
-	    int *pdSn
- 	    ){	   
+#include "diagnostic.h"
+#include "drawfile.h"
+#include "dpcluster.h"
+
+/* what the chains of cDPeco share; read only while they run */
+typedef struct DPShared {
+  int n_samp, s_samp, x1_samp, x0_samp, t_samp, n_dim;
+  int n_gen, burn_in, nth, n_store, n_chains, verbose;
+  int x1, x0;
+  int method;                      /* how W is drawn, see wMethod */
+  int trunc;                       /* 0 for the Polya urn, or the sticks
+				      of the blocked sampler */
+  int n_sm;                        /* split-merge moves per iteration */
+  /* priors */
+  double *mu0, tau0, **S0;
+  int nu0;
+  double alpha0;                   /* precision parameter, or its start */
+  int update;                      /* 1 if alpha gets updated */
+  double a0, b0;                   /* prior for alpha */
+  double **S_bvt;                  /* S paramter for BVT in q0 */
+  /* data */
+  double **X, *minW1, *maxW1;
+  double *x1_W1, *x0_W2;           /* homogeneous areas */
+  double **S_W, **S_Wstar;         /* survey data */
+  gridTable *grid;
+  /* the run */
+  uint64_t seed;                   /* each chain takes a substream */
+  int n_threads;                   /* the most threads to use */
+  int stop;                        /* set when the user interrupts, or
+				      when out of memory */
+  int nomem;                       /* set when out of memory */
+  /* storage for the Gibbs draws, chain after chain */
+  dpKept **kept;                   /* the clusters kept by each chain,
+				      or NULL */
+  double *pdSW1, *pdSW2, *pdSa;
+  int *pdSn;
+  double *pdSM;                    /* split-merge moves: 4 per chain */
+  double *avg;                     /* averages over the units of mu1, mu2,
+				      Sigma11, Sigma12, Sigma22 */
+  drawFile *wfile;                 /* or the draws of W go to a file */
+} DPShared;
+
+/* one chain of cDPeco; its draws go to block chain of the storage */
+static void DPchain(DPShared *d, int chain) {
   /*some integers */
-  int n_samp = *pin_samp;    /* sample size */
-  int s_samp = *sur_samp;    /* sample size of survey data */
-  int x1_samp = *sampx1;     /* sample size for X=1 */
-  int x0_samp = *sampx0;     /* sample size for X=0 */
-  int t_samp = n_samp+x1_samp+x0_samp+s_samp; /* total sample size */
-  int nth = *pinth;          /* keep every nth draw */ 
-  int n_dim = 2;             /* dimension */
-  int n_step=1000;           /* The default size of grid step */  
+  int n_samp = d->n_samp, s_samp = d->s_samp, x1_samp = d->x1_samp;
+  int x0_samp = d->x0_samp, t_samp = d->t_samp, n_dim = d->n_dim;
+  double **X = d->X, *minW1 = d->minW1, *maxW1 = d->maxW1;
 
   /*prior parameters */
-  double tau0 = *pdtau0;     /* prior scale */ 
-  int nu0 = *pinu0;          /* prior degree of freedom*/ 
-  double **S0 = doubleMatrix(n_dim,n_dim);/*The prior S parameter for InvWish*/
-  double alpha = *alpha0;      /* precision parameter*/
-  double a0 = *pda0, b0 = *pdb0; /* hyperprior for alpha */ 
+  double tau0 = d->tau0;     /* prior scale */ 
+  int nu0 = d->nu0;          /* prior degree of freedom*/ 
+  double *mu0 = d->mu0, **S0 = d->S0;
+  double alpha = d->alpha0;  /* precision parameter*/
+  double a0 = d->a0, b0 = d->b0; /* hyperprior for alpha */ 
+  int L = d->trunc;          /* sticks of the blocked sampler */
   
   /* data */
-  double **X = doubleMatrix(n_samp,n_dim);     /* The Y and covariates */
   double **W = doubleMatrix(t_samp,n_dim);     /* The W1 and W2 matrix */
   double **Wstar = doubleMatrix(t_samp,n_dim); /* The pseudo data  */
-  double **S_W = doubleMatrix(s_samp,n_dim);    /* The known W1 and W2 matrix*/
-  double **S_Wstar = doubleMatrix(s_samp,n_dim); /* The logit transformed S_W*/
-
-  /* grids */
-  double **W1g = doubleMatrix(n_samp, n_step); /* grids for W1 */
-  double **W2g = doubleMatrix(n_samp, n_step); /* grids for W2 */
-  int *n_grid = intArray(n_samp);              /* grids size */
 
   /* Model parameters */
-  /* Dirichlet variables */
-  double **mu = doubleMatrix(t_samp,n_dim);                /* mean matrix  */
-  double ***Sigma = doubleMatrix3D(t_samp,n_dim,n_dim);    /*covarince matrix*/
-  double ***InvSigma = doubleMatrix3D(t_samp,n_dim,n_dim); /* inv of Sigma*/
-  
+  /* Dirichlet variables: the distinct values, and who has which */
+  dpTable *tab = newDPTable(L ? L : t_samp, n_dim, mu0, tau0, nu0, S0);
+  double **mu = tab->mu, ***Sigma = tab->Sigma, ***InvSigma = tab->InvSigma;
   int nstar;		           /* # clusters with distict theta values */
   int *C = intArray(t_samp);       /* vector of cluster membership */
-  double *q = doubleArray(t_samp); /* Weights of posterior of Dirichlet */
-  double *qq = doubleArray(t_samp); /* cumulative weight vector of q */
-  double **S_bvt = doubleMatrix(n_dim,n_dim); /* S paramter for BVT in q0 */
 
-  /* variables defined in remixing step: cycle through all clusters */
-  double **Wstarmix = doubleMatrix(t_samp,n_dim);  /*data matrix used */ 
-  double *mu_mix = doubleArray(n_dim);             /*updated MEAN parameter */
-  double **Sigma_mix = doubleMatrix(n_dim,n_dim);  /*updated VAR parameter */
-  double **InvSigma_mix = doubleMatrix(n_dim,n_dim); /* Inv of Sigma_mix */
-  int nj;                            /* record # of obs in each cluster */
-  int *sortC = intArray(t_samp);     /* record (sorted)original obs id */
-  int *indexC = intArray(t_samp);   /* record  original obs id */
-  int *label = intArray(t_samp);    /* store index values */
+  /* scratch memory for the samplers */
+  Workspace *ws = newWorkspace(WS_SIZE);
+
+  /* random numbers: the serial stream of the chain */
+  rngStream crng;
+
+  /* Wfile: the W's written */
+  drawWriter *wout = d->wfile ? newDrawWriter(d->wfile, chain) : NULL;
 
   /* misc variables */
   int i, j, k, l, main_loop;   /* used for various loops */
-  int itemp;
-  int itempA=0; /* counter for alpha */
-  int itempS=0; /* counter for storage */
+  int unit_w=n_samp+x1_samp+x0_samp; /* units stored */
+  int n_keep=d->n_chains*d->n_store;   /* kept draws of all the chains */
+  int itempA=chain*d->n_store; /* counter for alpha */
+  int itempS=chain*d->n_store*unit_w; /* counter for storage */
   int itempC=0; /* counter to control nth draw */
-  int progress = 1, itempP = ftrunc((double) *n_gen/10);
+  int progress = 1, itempP = ftrunc((double) d->n_gen/10), stop;
   double dtemp, dtemp1;
-  double *vtemp = doubleArray(n_dim);
   double **mtemp = doubleMatrix(n_dim,n_dim); 
   double **mtemp1 = doubleMatrix(n_dim,n_dim); 
-  double **onedata = doubleMatrix(1, n_dim);
-
-  /* get random seed */
-  GetRNGstate();
-
-
-  /* read priors under G0*/
-  itemp=0;
-  for(k=0;k<n_dim;k++)
-    for(j=0;j<n_dim;j++) S0[j][k]=pdS0[itemp++];
-
-
-  /* read the data set */
-  itemp = 0;
-  for (j = 0; j < n_dim; j++) 
-    for (i = 0; i < n_samp; i++) X[i][j] = pdX[itemp++];
+  double *m, **S;              /* parameters of a unit */
+  double old[2];               /* Wstar of a unit before its update */
 
+  rngSeed(&crng, rngSubseed(d->seed, chain), RNG_SERIAL);
 
   /*Intialize W, Wsatr for n_samp */
   for (i=0; i< n_samp; i++) {
 
     if (X[i][1]!=0 && X[i][1]!=1) 
       {
-	W[i][0]=runif(minW1[i], maxW1[i]);
+	W[i][0]=minW1[i]+(maxW1[i]-minW1[i])*rngUnif(&crng);
 	W[i][1]=(X[i][1]-X[i][0]*W[i][0])/(1-X[i][0]);
       }
 
@@ -167,10 +123,10 @@ void cDPeco(
   }
 
   /*read homeogenous areas information */
-  if (*x1==1)
+  if (d->x1==1)
     for (i=0; i<x1_samp; i++) 
       {
-	W[(n_samp+i)][0]=x1_W1[i];
+	W[(n_samp+i)][0]=d->x1_W1[i];
 
 	if (W[(n_samp+i)][0]==0) 
 	  W[(n_samp+i)][0]=0.0001;
@@ -179,12 +135,13 @@ void cDPeco(
 	  W[(n_samp+i)][0]=0.9999;
 
 	Wstar[(n_samp+i)][0]=log(W[(n_samp+i)][0])-log(1-W[(n_samp+i)][0]);
+	Wstar[(n_samp+i)][1]=0;   /* drawn in the first iteration */
       }
 
-  if (*x0==1)
+  if (d->x0==1)
     for (i=0; i<x0_samp; i++) 
       {
-	W[(n_samp+x1_samp+i)][1]=x0_W2[i];
+	W[(n_samp+x1_samp+i)][1]=d->x0_W2[i];
 
 	if (W[(n_samp+x1_samp+i)][1]==0) 
 	  W[(n_samp+x1_samp+i)][1]=0.0001;
@@ -193,290 +150,473 @@ void cDPeco(
 	  W[(n_samp+x1_samp+i)][1]=0.9999;
 	
 	Wstar[(n_samp+x1_samp+i)][1]=log(W[(n_samp+x1_samp+i)][1])-log(1-W[(n_samp+x1_samp+i)][1]);
+	Wstar[(n_samp+x1_samp+i)][0]=0;
       }
 
-  /*read the survey data */
-  if (*survey==1) 
-    {
-      itemp = 0;
-      
-      for (j=0; j<n_dim; j++)
-	for (i=0; i<s_samp; i++) 
-	  {
-	    S_W[i][j]=sur_W[itemp++];
-	
-	    if (S_W[i][j]==0) 
-	      S_W[i][j]=0.0001;
-	    
-	    if (S_W[i][j]==1) 
-	      S_W[i][j]=0.9999;
-	    
-	    S_Wstar[i][j]=log(S_W[i][j])-log(1-S_W[i][j]);
-	    W[n_samp+x1_samp+x0_samp+i][j]=S_W[i][j];
-	    Wstar[n_samp+x1_samp+x0_samp+i][j]=S_Wstar[i][j];
-	  }
+  /* the survey data */
+  for (i=0; i<s_samp; i++)
+    for (j=0; j<n_dim; j++) {
+      W[n_samp+x1_samp+x0_samp+i][j]=d->S_W[i][j];
+      Wstar[n_samp+x1_samp+x0_samp+i][j]=d->S_Wstar[i][j];
     }
 
 
-  /* Calcualte grids */
-  if (*Grid)
-    GridPrep(W1g,W2g, X, maxW1, minW1, n_grid, n_samp, n_step);
-
-
-  /* parmeters for Bivaraite t-distribution-unchanged in MCMC */
-  for (j=0;j<n_dim;j++)
-    for(k=0;k<n_dim;k++)
-      mtemp[j][k]=S0[j][k]*(1+tau0)/(tau0*(nu0-n_dim+1));
-
-  dinv(mtemp, n_dim, S_bvt);
-
   /**draw initial values of mu_i, Sigma_i under G0  for all effective sample**/
   /*1. Sigma_i under InvWish(nu0, S0^-1) with E(Sigma)=S0/(nu0-3)*/
   /*   InvSigma_i under Wish(nu0, S0^-1 */
   /*2. mu_i|Sigma_i under N(mu0, Sigma_i/tau0) */
 
-  dinv(S0, n_dim, mtemp);
-
-  for(i=0;i<t_samp;i++)
-    {
-      /*draw from wish(nu0, S0^-1) */
-      rWish(InvSigma[i], mtemp, nu0, n_dim);
-      dinv(InvSigma[i], n_dim, Sigma[i]);
-
-      for (j=0;j<n_dim;j++)
-	for(k=0;k<n_dim;k++) 
-	  mtemp1[j][k]=Sigma[i][j][k]/tau0;
-
-      rMVN(mu[i], mu0, mtemp1, n_dim);
-    }
+  /*   blocked: L sticks of equal weight, and the labels drawn from
+       them */
+  if (L) {
+    dpBlocked(tab, t_samp, nThreads(d->n_threads), &crng, ws);
+    dpRelabel(tab, Wstar, C, t_samp, &crng);
+  }
+  else {
+    /*   or each in a cluster of its own */
+    dinv(S0, n_dim, mtemp);
 
+    for(i=0;i<t_samp;i++)
+      {
+	C[i]=k=dpNew(tab);
+	dpJoin(tab, k, Wstar[i]);
 
-  /* initialize the cluster membership */
+	/*draw from wish(nu0, S0^-1) */
+	rWish(InvSigma[k], mtemp, nu0, n_dim, &crng, ws);
+	dinv(InvSigma[k], n_dim, Sigma[k]);
 
-  nstar=t_samp;  /* the # of disticnt values */
+	for (j=0;j<n_dim;j++)
+	  for(l=0;l<n_dim;l++) 
+	    mtemp1[j][l]=Sigma[k][j][l]/tau0;
 
-  for(i=0;i<t_samp;i++)
-    C[i]=i; /*cluster is from 0...n_samp-1 */
+	rMVN(mu[k], mu0, mtemp1, n_dim, &crng, ws);
+	dpSetDens(tab, k);
+      }
+  }
 
   
-  if (*verbose)
-    Rprintf("Starting Gibbs Sampler...\n");
-
-  for(main_loop=0; main_loop<*n_gen; main_loop++){
+  for(main_loop=0; main_loop<d->n_gen; main_loop++){
     /**update W, Wstar given mu, Sigma only for the unknown W/Wstar**/
     for (i=0;i<n_samp;i++){
       if (X[i][1]!=0 && X[i][1]!=1) {
-	if (*Grid) 
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu[i], InvSigma[i], n_dim);
+	k=C[i];
+	if (d->method==W_GRID) 
+	  rGrid(W[i], d->grid, i, mu[k], InvSigma[k], &crng, ws);
+	else if (d->method==W_SLICE)
+	  rSlice(W[i], X[i], minW1[i], maxW1[i], mu[k], InvSigma[k], &crng);
 	else
-	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu[i], InvSigma[i], n_dim);
+	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu[k], InvSigma[k], n_dim, &crng);
       }
 
       /*3 compute Wsta_i from W_i*/
+      old[0]=Wstar[i][0]; old[1]=Wstar[i][1];
       Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
       Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
+      dpMove(tab, C[i], old, Wstar[i]);
     }
   
-    if (*x1==1)
+    if (d->x1==1)
       for (i=0; i<x1_samp; i++) {
-	dtemp=mu[n_samp+i][1]+Sigma[n_samp+i][0][1]/Sigma[n_samp+i][0][0]*(Wstar[n_samp+i][0]-mu[n_samp+i][0]);
-	dtemp1=Sigma[n_samp+i][1][1]*(1-Sigma[n_samp+i][0][1]*Sigma[n_samp+i][0][1]/(Sigma[n_samp+i][0][0]*Sigma[n_samp+i][1][1]));
+	m=mu[C[n_samp+i]]; S=Sigma[C[n_samp+i]];
+	dtemp=m[1]+S[0][1]/S[0][0]*(Wstar[n_samp+i][0]-m[0]);
+	dtemp1=S[1][1]*(1-S[0][1]*S[0][1]/(S[0][0]*S[1][1]));
 
-	Wstar[n_samp+i][1]=norm_rand()*sqrt(dtemp1)+dtemp;
+	old[0]=Wstar[n_samp+i][0]; old[1]=Wstar[n_samp+i][1];
+	Wstar[n_samp+i][1]=rngNorm(&crng)*sqrt(dtemp1)+dtemp;
 	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
+	dpMove(tab, C[n_samp+i], old, Wstar[n_samp+i]);
       }
 
   /*update W1 given W2, mu_ord and Sigma_ord in x0 homeogeneous areas */
-  if (*x0==1)
+  if (d->x0==1)
     for (i=0; i<x0_samp; i++) {
-      dtemp=mu[n_samp+x1_samp+i][0]+Sigma[n_samp+x1_samp+i][0][1]/Sigma[n_samp+x1_samp+i][1][1]*(Wstar[n_samp+x1_samp+i][1]-mu[n_samp+x1_samp+i][1]);
-      dtemp1=Sigma[n_samp+x1_samp+i][0][0]*(1-Sigma[n_samp+x1_samp+i][0][1]*Sigma[n_samp+x1_samp+i][0][1]/(Sigma[n_samp+x1_samp+i][0][0]*Sigma[n_samp+x1_samp+i][1][1]));
+      m=mu[C[n_samp+x1_samp+i]]; S=Sigma[C[n_samp+x1_samp+i]];
+      dtemp=m[0]+S[0][1]/S[1][1]*(Wstar[n_samp+x1_samp+i][1]-m[1]);
+      dtemp1=S[0][0]*(1-S[0][1]*S[0][1]/(S[0][0]*S[1][1]));
 
-      Wstar[n_samp+i][0]=norm_rand()*sqrt(dtemp1)+dtemp;
+      old[0]=Wstar[n_samp+x1_samp+i][0]; old[1]=Wstar[n_samp+x1_samp+i][1];
+      Wstar[n_samp+x1_samp+i][0]=rngNorm(&crng)*sqrt(dtemp1)+dtemp;
       W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
+      dpMove(tab, C[n_samp+x1_samp+i], old, Wstar[n_samp+x1_samp+i]);
     }
 
-  /**updating mu, Sigma given Wstar uisng effective sample size W_star**/
-  for (i=0; i<t_samp; i++){
-    /* generate weight vector q */
-    dtemp=0;
-    for (j=0; j<t_samp; j++){
-      if (j!=i)
-	q[j]=dMVN(Wstar[i], mu[j], InvSigma[j], n_dim, 0);
-      else
-	q[j]=alpha*dMVT(Wstar[i], mu0, S_bvt, nu0-n_dim+1, 2, 0);
-
-      dtemp+=q[j]; 
-      qq[j]=dtemp; /*compute qq, the cumlative of q*/    
-    }
-
-    /*standardize q and qq */
-    for (j=0; j<t_samp; j++) 
-      qq[j]/=dtemp;
-    
-    /** draw the configuration parameter **/
-    j=0; dtemp=unif_rand();
-
-    while (dtemp > qq[j]) 
-      j++;
-
-
-    /** Dirichlet update Sigma_i, mu_i|Sigma_i **/
-    /* j=i: posterior update given Wstar[i] */
-    if (j==i){
-      onedata[0][0] = Wstar[i][0];
-      onedata[0][1] = Wstar[i][1];
+  if (!L && main_loop%DP_REFRESH==DP_REFRESH-1)
+    dpRefresh(tab, Wstar, C, t_samp);
 
-      NIWupdate(onedata, mu[i], Sigma[i], InvSigma[i], mu0, tau0,nu0, S0, 1, n_dim);
-      C[i]=nstar;
-      nstar++;
-    }
-
-    /* j=i': replace with i' obs */
-    else {
-      /*1. mu_i=mu_j, Sigma_i=Sigma_j*/
-      /*2. update C[i]=C[j] */
-      for(k=0;k<n_dim;k++) {
-	mu[i][k]=mu[j][k];
-
-	for(l=0;l<n_dim;l++) {
-	  Sigma[i][k][l]=Sigma[j][k][l];
-	  InvSigma[i][k][l]=InvSigma[j][k][l];
-	}
+  /** blocked: all the labels at once given the sticks, then the
+      parameters of the sticks given their members, and their order **/
+  if (L) {
+    nstar=dpRelabel(tab, Wstar, C, t_samp, &crng);
+    dpRemix(tab, &crng, ws);
+    dpSwapSticks(tab, alpha, &crng);
+  }
+  else {
+    /**updating mu, Sigma given Wstar uisng effective sample size W_star**/
+    /* each observation in turn leaves its cluster and is put back in one
+       drawn from the urn of the others, or in a new one */
+    for (i=0; i<t_samp; i++){
+      dpLeave(tab, C[i], Wstar[i]);
+      dtemp=log(alpha)+dMVT(Wstar[i], mu0, d->S_bvt, nu0-n_dim+1, 2, 1);
+      k=dpDraw(tab, Wstar[i], dtemp, rngUnif(&crng));
+
+      /** Dirichlet update Sigma_i, mu_i|Sigma_i **/
+      /* a new cluster: posterior update given Wstar[i] */
+      if (k<0){
+	k=dpNew(tab);
+	dpJoin(tab, k, Wstar[i]);
+	dpUpdate(tab, k, &crng, ws);
       }
-      C[i]=C[j];
-    }
-    sortC[i]=C[i];
-  } /* end of i loop*/
-  
-
-  /** remixing step using effective sample of Wstar**/
-  for(i=0;i<t_samp;i++) 
-    indexC[i]=i;
-
-  R_qsort_int_I(sortC, indexC, 1, t_samp);
+      else
+	dpJoin(tab, k, Wstar[i]);
+      C[i]=k;
+    } /* end of i loop*/
+
+    /** split-merge moves **/
+    for (j=0; j<d->n_sm; j++)
+      dpSplitMerge(tab, Wstar, C, t_samp, alpha, DP_SCANS, d->pdSM+4*chain,
+		   &crng, ws);
   
-  nstar=0; 
-  i=0;
-
-  while (i<t_samp){
-    j=sortC[i]; /*saves the first element in a block of same values */
-    nj=0;       /* counter for a block of same values */
-    
-    /* get data for remixing */
-    while ((sortC[i]==j) && (i<t_samp)) {
-      label[nj]=indexC[i];
-
-      for (k=0; k<n_dim; k++)
-	Wstarmix[nj][k]=Wstar[label[nj]][k];
-
-      nj++; i++;
-    } /* i records the current position in IndexC */
-      /* nj records the # of obs in Psimix */
-
-    
-    /** posterior update for mu_mix, Sigma_mix based on Psimix **/
-    NIWupdate(Wstarmix, mu_mix,Sigma_mix, InvSigma_mix, mu0, tau0, nu0, S0, nj, n_dim);     
-    
-
-    /**update mu, Simgat with mu_mix, Sigmat_mix via label**/
-    for (j=0;j<nj;j++){
-      C[label[j]]=nstar;  /* updating C vector with no gap */
-
-      for (k=0; k<n_dim; k++){
-	mu[label[j]][k]=mu_mix[k];
-
-	for (l=0;l<n_dim;l++){
-	  Sigma[label[j]][k][l]=Sigma_mix[k][l];
-	  InvSigma[label[j]][k][l]=InvSigma_mix[k][l];
-	}
-      }
-    }
-    nstar++; /*finish update one distinct value*/
-  } /* nstar is the number of distinct values */
 
+    /** remixing step: the parameters of each cluster given its members **/
+    dpRemix(tab, &crng, ws);
+    nstar=tab->nstar; /* nstar is the number of distinct values */
+  }
 
-  
+  /** blocked: the weights of the sticks given their counts and alpha,
+      then alpha given the weights of all L sticks **/
+  if (L) {
+    dpSticks(tab, alpha, &crng);
+    if(d->update)
+      alpha=dpStickAlpha(tab, a0, b0, &crng);
+  }
   /** updating alpha **/
-  if(*pinUpdate) {
-    dtemp=b0-log(rbeta(alpha+1, (double) t_samp));
+  else if(d->update) {
+    dtemp=b0-log(rngBeta(&crng, alpha+1, (double) t_samp));
     dtemp1=(double)(a0+nstar-1)/(t_samp*dtemp);
 
-    if(unif_rand() < dtemp1)
-      alpha=rgamma(a0+nstar, 1/dtemp);
+    if(rngUnif(&crng) < dtemp1)
+      alpha=rngGamma(&crng, a0+nstar)/dtemp;
     else 
-      alpha=rgamma(a0+nstar-1, 1/dtemp);
+      alpha=rngGamma(&crng, a0+nstar-1)/dtemp;
   }
 
   
   /*store Gibbs draws after burn_in */
-   R_CheckUserInterrupt();
-
-  if (main_loop>=*burn_in) {
+  if (main_loop>=d->burn_in) {
      itempC++;
-    if (itempC==nth){
-      if(*pinUpdate) {
-	pdSa[itempA]=alpha;
+    if (itempC==d->nth){
+      if(d->update) {
+	d->pdSa[itempA]=alpha;
      }
-	pdSn[itempA]=nstar;     
-      itempA++;
-      
-      for(i=0; i<(n_samp+x1_samp+x0_samp); i++) {
-	pdSMu0[itempS]=mu[i][0];
-	pdSMu1[itempS]=mu[i][1];
-	pdSSig00[itempS]=Sigma[i][0][0];
-	pdSSig01[itempS]=Sigma[i][0][1];
-	pdSSig11[itempS]=Sigma[i][1][1];
-	pdSW1[itempS]=W[i][0];
-	pdSW2[itempS]=W[i][1];
+	d->pdSn[itempA]=nstar;     
+      if (d->kept && !dpKeep(d->kept[chain], tab, C)) {
+#pragma omp atomic write
+	d->nomem=1;
+#pragma omp atomic write
+	d->stop=1;
+      }
+
+      for (j=0; j<5; j++)
+	d->avg[j*n_keep+itempA]=0;
+      for(i=0; i<unit_w; i++) {
+	k=C[i];
+	d->avg[itempA]+=mu[k][0];
+	d->avg[n_keep+itempA]+=mu[k][1];
+	d->avg[2*n_keep+itempA]+=Sigma[k][0][0];
+	d->avg[3*n_keep+itempA]+=Sigma[k][0][1];
+	d->avg[4*n_keep+itempA]+=Sigma[k][1][1];
+	if (!wout) {
+	  d->pdSW1[itempS]=W[i][0];
+	  d->pdSW2[itempS]=W[i][1];
+	}
 	itempS++;
       }
+      for (j=0; j<5; j++)
+	d->avg[j*n_keep+itempA]/=unit_w;
+      itempA++;
+      if (wout)
+	drawPutW(wout, W);
       itempC=0; 
     }
   }
 
-  if (*verbose)
-    if (itempP == main_loop) {
-      Rprintf("%3d percent done.\n", progress*10);
-      itempP+=ftrunc((double) *n_gen/10); progress++;
-       R_FlushConsole();
+  /* only the main thread may talk to R */
+  if (threadNum()==0) {
+    if (d->verbose)
+      if (itempP == main_loop) {
+	if (d->n_chains>1)
+	  Rprintf("chain %d: ", chain+1);
+	Rprintf("%3d percent done.\n", progress*10);
+	itempP+=ftrunc((double) d->n_gen/10); progress++;
+	R_FlushConsole();
+      }
+    if (checkInterrupt()) {
+#pragma omp atomic write
+      d->stop=1;
     }
+  }
+#pragma omp atomic read
+  stop=d->stop;
+  if (stop) break;
   } /*end of MCMC for DP*/
   
+  /* Freeing the memory */
+  if (wout) closeDrawWriter(wout);
+  FreeMatrix(W, t_samp);
+  FreeMatrix(Wstar, t_samp);
+  FreeDPTable(tab);
+  free(C);
+  FreeMatrix(mtemp, n_dim);
+  FreeMatrix(mtemp1, n_dim);
+  FreeWorkspace(ws);
+}
+
+/* Nonparametric (Dirichlet process) Model for 2x2 Tables
+   With n_chains > 1 the chains run side by side on separate threads,
+   each with its own random number stream, and share the data and the
+   grids; their draws are stored one chain after the other */
+void cDPeco(
+	    /*data input */
+	    double *pdX,     /* data (X, Y) */
+	    int *pin_samp,   /* sample size */
+
+	    /*MCMC draws */
+	    int *n_gen,      /* number of gibbs draws */ 
+	    int *burn_in,    /* number of draws to be burned in */
+	    int *pinth,      /* keep every nth draw */
+	    int *verbose,    /* 1 for output monitoring */
+
+	    /* prior specification*/
+	    int *pinu0,      /* prior df parameter for InvWish */
+	    double *pdtau0,  /* prior scale parameter for Sigma under G0*/ 
+	    double *mu0,     /* prior mean for mu under G0 */
+	    double *pdS0,    /* prior scale for Sigma */
+
+	    /* DP prior specification */
+	    double *alpha0,  /* precision parameter, can be fixed or updated*/
+	    int *pinUpdate,  /* 1 if alpha gets updated */
+	    double *pda0, double *pdb0, /* prior for alpha if alpha updated*/  
+
+	    /*incorporating survey data */
+	    int *survey,     /* 1 if survey data available (set of W_1, W_2) */
+	                     /* 0 otherwise*/
+	    int *sur_samp,   /* sample size of survey data*/
+	    double *sur_W,   /* set of known W_1, W_2 */
+
+	    /*incorporating homeogenous areas */
+	    int *x1,         /* 1 if X=1 type areas available 
+				W_1 known, W_2 unknown */
+	    int *sampx1,     /* number X=1 type areas */
+	    double *x1_W1,   /* values of W_1 for X1 type areas */
+
+	    int *x0,         /* 1 if X=0 type areas available 
+				W_2 known, W_1 unknown */
+	    int *sampx0,     /* number X=0 type areas */
+	    double *x0_W2,   /* values of W_2 for X0 type areas */
+
+	    /* bounds of W1 */
+	    double *minW1, double *maxW1,
+
+	    /* storage */
+	    int *parameter,  /* 1 if save population parameter: the
+				clusters kept, see kept */
+	    int *Grid,       /* how W is drawn: 0 for Metropolis, 1 for
+				the grid, 2 for slice sampling */
+	    int *pin_step,   /* Grid: grid points per unit length of W1 */
+	    int *pin_trunc,  /* 0 for the Polya urn, or the number of
+				sticks of the blocked Gibbs sampler */
+	    int *pin_sm,     /* Polya urn: split-merge moves per iteration */
+	    int *pin_chains, /* number of chains */
+	    int *pin_threads, /* most threads to use */
+	    char **Wfile,    /* if not "", the draws of W go to this file
+				(see drawfile.c) instead of pdSW1, pdSW2 */
+
+	    /* storage for Gibbs draws of W*/
+	    double *pdSW1, double *pdSW2,
+	    /* storage for Gibbs draws of alpha */
+	    double *pdSa,
+	    /* storage for nstar at each Gibbs draw*/
+	    int *pdSn,
+	    /* split R-hat and bulk effective sample size of the averages
+	       over the units of mu1, mu2, Sigma11, Sigma12 and Sigma22 */
+	    double *pdRhat, double *pdEss,
+	    /* split-merge moves of each chain: splits proposed and
+	       accepted, merges proposed and accepted */
+	    double *pdSM,
+	    /* with parameter, the clusters kept, chain after chain (see
+	       dpKeptValue); otherwise R_NilValue */
+	    SEXP *kept
+ 	    ){	   
+  /*some integers */
+  int n_samp = *pin_samp;    /* sample size */
+  int s_samp = *sur_samp;    /* sample size of survey data */
+  int x1_samp = *sampx1;     /* sample size for X=1 */
+  int x0_samp = *sampx0;     /* sample size for X=0 */
+  int t_samp = n_samp+x1_samp+x0_samp+s_samp; /* total sample size */
+  int n_dim = 2;             /* dimension */
+  int n_step=*pin_step;      /* 1/The size of grid step */  
+  int n_chains = *pin_chains; /* number of chains */
+  int n_store = (*n_gen-*burn_in)/(*pinth); /* kept draws per chain */
+
+  /*prior parameters */
+  double tau0 = *pdtau0;     /* prior scale */ 
+  int nu0 = *pinu0;          /* prior degree of freedom*/ 
+  double **S0 = doubleMatrix(n_dim,n_dim);/*The prior S parameter for InvWish*/
+  double **S_bvt = doubleMatrix(n_dim,n_dim); /* S paramter for BVT in q0 */
+  
+  /* data */
+  double **X = doubleMatrix(n_samp,n_dim);     /* The Y and covariates */
+  double **S_W = doubleMatrix(s_samp,n_dim);    /* The known W1 and W2 matrix*/
+  double **S_Wstar = doubleMatrix(s_samp,n_dim); /* The logit transformed S_W*/
+
+  /* what the chains share */
+  DPShared d;
+
+  /* misc variables */
+  int i, j, k, c, n_threads;   /* used for various loops */
+  int itemp;
+  double **mtemp = doubleMatrix(n_dim,n_dim); 
+
+  /* get random seed */
+  GetRNGstate();
+
+
+  /* read priors under G0*/
+  itemp=0;
+  for(k=0;k<n_dim;k++)
+    for(j=0;j<n_dim;j++) S0[j][k]=pdS0[itemp++];
+
+
+  /* read the data set */
+  itemp = 0;
+  for (j = 0; j < n_dim; j++) 
+    for (i = 0; i < n_samp; i++) X[i][j] = pdX[itemp++];
+
+  /*read the survey data */
+  if (*survey==1) 
+    {
+      itemp = 0;
+      
+      for (j=0; j<n_dim; j++)
+	for (i=0; i<s_samp; i++) 
+	  {
+	    S_W[i][j]=sur_W[itemp++];
+	
+	    if (S_W[i][j]==0) 
+	      S_W[i][j]=0.0001;
+	    
+	    if (S_W[i][j]==1) 
+	      S_W[i][j]=0.9999;
+	    
+	    S_Wstar[i][j]=log(S_W[i][j])-log(1-S_W[i][j]);
+	  }
+    }
+
+
+  /* parmeters for Bivaraite t-distribution-unchanged in MCMC */
+  for (j=0;j<n_dim;j++)
+    for(k=0;k<n_dim;k++)
+      mtemp[j][k]=S0[j][k]*(1+tau0)/(tau0*(nu0-n_dim+1));
+
+  dinv(mtemp, n_dim, S_bvt);
+
+  d.n_samp=n_samp; d.s_samp=s_samp; d.x1_samp=x1_samp; d.x0_samp=x0_samp;
+  d.t_samp=t_samp; d.n_dim=n_dim;
+  d.n_gen=*n_gen; d.burn_in=*burn_in; d.nth=*pinth; d.n_store=n_store;
+  d.n_chains=n_chains; d.verbose=*verbose;
+  d.x1=*x1; d.x0=*x0; d.method=*Grid; d.trunc=*pin_trunc;
+  d.n_sm=*pin_sm;
+  d.mu0=mu0; d.tau0=tau0; d.S0=S0; d.nu0=nu0;
+  d.alpha0=*alpha0; d.update=*pinUpdate; d.a0=*pda0; d.b0=*pdb0;
+  d.S_bvt=S_bvt;
+  d.X=X; d.minW1=minW1; d.maxW1=maxW1; d.x1_W1=x1_W1; d.x0_W2=x0_W2;
+  d.S_W=S_W; d.S_Wstar=S_Wstar;
+  /* Calcualte grids */
+  d.grid = (*Grid==W_GRID) ? GridPrep(X, maxW1, minW1, n_samp, n_step) : NULL;
+  d.seed=rngSeedFromR(); d.stop=0; d.n_threads=*pin_threads;
+  d.nomem=0;
+  d.kept=NULL;
+  if (*parameter) {
+    d.kept=(dpKept **) calloc(n_chains, sizeof(dpKept *));
+    for (c=0; d.kept && c<n_chains; c++)
+      if (!(d.kept[c]=newDPKept(n_dim, n_samp+x1_samp+x0_samp, n_store)))
+	d.nomem=1;
+    if (!d.kept)
+      d.nomem=1;
+  }
+  d.avg = doubleArray(5*n_chains*n_store);
+  d.pdSW1=pdSW1; d.pdSW2=pdSW2; d.pdSa=pdSa; d.pdSn=pdSn;
+  d.pdSM=pdSM;
+  for (i=0; i<4*n_chains; i++)
+    pdSM[i]=0;
+  d.wfile = Wfile[0][0] ?
+    openDrawFile(Wfile[0], 2, n_samp+x1_samp+x0_samp, n_chains, n_store) : NULL;
+
   if (*verbose)
+    Rprintf("Starting Gibbs Sampler...\n");
+
+  n_threads=nThreads(*pin_threads);
+  d.stop=d.nomem;
+  if (!d.stop) {
+#pragma omp parallel for schedule(dynamic,1) num_threads(n_threads) if(n_threads>1 && n_chains>1)
+    for (c=0; c<n_chains; c++)
+      DPchain(&d, c);
+  }
+  
+  if (*verbose && !d.stop)
     Rprintf("100 percent done.\n");
+
+  /** convergence diagnostics, on the averages over the units **/
+  if (!d.stop)
+    for (j=0; j<5; j++)
+      mcmcDiag(d.avg+j*n_chains*n_store, n_chains, n_store, pdRhat+j, pdEss+j);
   
   /** write out the random seed **/
    PutRNGstate();
   
   /* Freeing the memory */
   FreeMatrix(S0, n_dim);
+  FreeMatrix(S_bvt, n_dim);
   FreeMatrix(X, n_samp);
-  FreeMatrix(W, t_samp);
-  FreeMatrix(Wstar, t_samp);
   FreeMatrix(S_W, s_samp);
   FreeMatrix(S_Wstar, s_samp);
-  FreeMatrix(W1g, n_samp);
-  FreeMatrix(W2g, n_samp);
-  free(n_grid);
-  FreeMatrix(mu, t_samp);
-  Free3DMatrix(Sigma, t_samp,n_dim);
-  Free3DMatrix(InvSigma, t_samp, n_dim);
-  free(C);
-  free(q);
-  free(qq);
-  FreeMatrix(S_bvt, n_dim);
-  FreeMatrix(Wstarmix, t_samp);
-  free(mu_mix);
-  FreeMatrix(Sigma_mix, n_dim);
-  FreeMatrix(InvSigma_mix, n_dim);
-  free(sortC);
-  free(indexC);
-  free(label);
-  free(vtemp);
   FreeMatrix(mtemp, n_dim);
-  FreeMatrix(mtemp1, n_dim);
-  free(onedata);
-} /* main */
+  free(d.avg);
+  if (d.grid) FreeGrid(d.grid);
+  if (d.wfile) closeDrawFile(d.wfile);
+
+  *kept = R_NilValue;
+  if (d.kept) {
+    if (!d.stop)
+      *kept = dpKeptValue(d.kept, n_chains);
+    for (c=0; c<n_chains; c++)
+      FreeDPKept(d.kept[c]);
+    free(d.kept);
+  }
 
+  if (d.nomem)
+    error("Out of memory error in keeping the clusters\n");
+  if (d.stop)
+    error("interrupted by the user\n");
+
+} /* main */
 
+/*
+ * The .Call entry of cDPeco: args holds its arguments but kept, as
+ * they would be given to .C, and is returned updated as by .C, with
+ * pdSPar and pdSC, the clusters kept, appended
+ */
+SEXP cDPecoCall(SEXP args) {
+  SEXP res = PROTECT(duplicate(args)), kept;
+  void **a = dotCArgs(res, 40);
+
+  cDPeco(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9],
+	 a[10], a[11], a[12], a[13], a[14], a[15], a[16], a[17], a[18],
+	 a[19], a[20], a[21], a[22], a[23], a[24], a[25], a[26], a[27],
+	 a[28], a[29], a[30], a[31], a[32], a[33], a[34], a[35], a[36],
+	 a[37], a[38], a[39], &kept);
+  PROTECT(kept);
+  res = dotCValue(res, kept);
+  UNPROTECT(2);
+  return res;
+}
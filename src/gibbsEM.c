@@ -11,19 +11,58 @@
 #include "bayes.h"
 #include "macros.h"
 #include "fintegrate.h"
-
-
+#include "datasource.h"
+
+/* number of records per block of the E-step; see ecoEStep */
+#define ESTEP_BLOCK 64
+
+/* lazy E-step: a full sweep over the records at least every this many E-steps */
+#define LAZY_SWEEP 10
+/* lazy E-step: records whose moments are predicted to move by less than this
+   fraction of the last step of theta are not integrated again */
+#define LAZY_REL 0.1
+
+/* columns of a history row: theta (at most 9), loglik, E-steps saved */
+#define HIST_COLS 11
+
+/* state of one row of the SEM R matrix, kept for the whole SEM run (see ecoSEM) */
+typedef struct semRow {
+  setParam setP;    //private copy: the M-step writes into it
+  Param* params;    //copies of the records, pointing to setP
+  double** Wstar;   //E-step scratch
+  double** partial;
+  double suff[10];
+  double phiTI[9];  //phi^t_i
+  double phiTp1I[9]; //phi^{t+1}_i
+  int index;        //the parameter taken from pdTheta rather than optTheta
+} semRow;
+
+
+void initRecord(Param* param, double X, double Y);
 void readData(Param* params, int n_dim, double* pdX, double* sur_W, double* x1_W1, double* x0_W2,
                 int n_samp, int s_samp, int x1_samp, int x0_samp);
-void ecoSEM(double* optTheta, double* pdTheta, Param* params, double Rmat_old[7][7], double Rmat[7][7]);
+void ecoSEM(double* optTheta, double* pdTheta, Param* params, double Rmat_old[7][7], double Rmat[7][7], semRow* rows);
+semRow* newSemRows(Param* params);
+void freeSemRows(semRow* rows, setParam* setP);
 void ecoEStep(Param* params, double* suff);
+void ecoEStepWork(Param* params, double* suff, double** Wstar, double** partial);
+void ecoEStepReport(Param* params, double** Wstar);
+void reportLogit(Param* param, int lik);
+void ecoEStepLazy(Param* params, double* suff);
+lazyEStep* newLazyEStep(setParam* setP);
+void freeLazyEStep(lazyEStep* lz, setParam* setP);
+void ecoEStepCase(Param* param, double* Wstar, double* loglik);
+void addSuffStat(caseParam* caseP, double* Wstar, int ncar, double* suff);
 void ecoMStep(double* Suff, double* pdTheta, Param* params);
 void ecoMStepNCAR(double* Suff, double* pdTheta, Param* params);
 void ecoMStepCCAR(double* pdTheta, Param* params);
 void MStepHypTest(Param* params, double* pdTheta);
 void initTheta(double* pdTheta_in,Param* params, double* pdTheta);
 void initNCAR(Param* params, double* pdTheta);
-void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double history_full[][10]);
+void setTheta(Param* params, double* pdTheta);
+void ecoEMStep(Param* params, double* pdTheta, double* Suff);
+double ecoSquarem(Param* params, double* pdTheta, double* t_pdTheta_old, double* Suff, double* stepMax, double* loglik);
+void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double history_full[][HIST_COLS]);
 int closeEnough(double* pdTheta, double* pdTheta_old, int len, double maxerr);
 int semDoneCheck(setParam* setP);
 void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp, double* suff, int verbose, double minW1, double maxW1);
@@ -72,10 +111,13 @@ void cEMeco(
 	    double *minW1, double *maxW1,
 
 	    /* options */
-	    int *flag,    /*0th (rightmost) bit: 1 = NCAR, 0=normal; 1st bit: 1 = fixed rho, 0 = not fixed rho*/
+	    int *flag,    /*0th (rightmost) bit: 1 = NCAR, 0=normal; 1st bit: 1 = fixed rho, 0 = not fixed rho;
+			    2nd bit: 1 = SEM; 3rd bit: 1 = SQUAREM acceleration; 4th bit: 1 = lazy E-step*/
 	    int *verbosiosity,    /*How much to print out, 0=silent, 1=cycle, 2=data*/
       int *calcLoglik,    /*How much to print out, 0=silent, 1=cycle, 2=data*/
 	    int *hypTest_L,   /* number of hypothesis constraints */
+	    int *quadNodes,   /* 0: adaptive quadrature; >0: fixed Gauss-Legendre rule with this many nodes */
+	    int *pin_threads, /* most threads to use */
 	    double *optTheta,  /*optimal theta obtained from previous EM result; if set, then we're doing SEM*/
 
 	    /* storage */
@@ -87,13 +129,21 @@ void cEMeco(
       double *inSample, /* In Sample info */
       double *DMmatrix,  /* DM matrix for SEM*/
       int *itersUsed, /* number of iterations used */
-      double *history /* history of param (transformed) as well as logliklihood*/
+      double *history /* history of param (transformed), logliklihood and E-steps saved by acceleration*/
 	    ){
 
-  int n_samp  = *pin_samp;    /* sample size */
+  int n_rows  = *pin_samp;    /* sample size */
   int s_samp  = *survey ? *sur_samp : 0;     /* sample size of survey data */
   int x1_samp = *x1 ? *sampx1 : 0;       /* sample size for X=1 */
   int x0_samp = *x0 ? *sampx0 : 0;       /* sample size for X=0 */
+
+  //precincts with the same (X,Y) have the same E-step, so they are collapsed
+  //into one record, weighted by their number
+  int *caseOf=intArray(n_rows);     /* record of each precinct */
+  int *caseFirst=intArray(n_rows);  /* first precinct of each record */
+  int *caseCount=intArray(n_rows);  /* number of precincts of each record */
+  int n_samp=uniqueXY(pdX,pdX+n_rows,n_rows,caseOf,caseFirst,caseCount); /* number of distinct (X,Y) */
+  double *pdXcase=doubleArray(2*n_samp); /* their (X,Y), laid out as pdX */
   //int t_samp=n_samp+s_samp+x1_samp+x0_samp;  /* total sample size*/
   int t_samp=n_samp+s_samp;  /* total sample size, ignoring homog data*/
   int n_dim=2;        /* dimensions */
@@ -104,6 +154,13 @@ void cEMeco(
   setP.fixedRho=bit(*flag,1);
   setP.sem=bit(*flag,2) & (optTheta[2]!=-1.1);
   setP.ccar=0; setP.ccar_nvar=0;
+  //acceleration is not used for the SEM run, nor under NCAR with fixed rho
+  //(whose M-step keeps state from the previous iteration)
+  setP.accel=bit(*flag,3) && !setP.sem && !(setP.ncar && setP.fixedRho);
+  setP.estepSaved=0;
+  //the lazy E-step is not used for the SEM run either, nor with acceleration
+  //(whose loglik check needs the loglik of every record at the current theta)
+  int lazy=bit(*flag,4) && !setP.sem && !setP.accel;
 
   //hard-coded hypothesis test
   //hypTest is the number of constraints.  hyptTest==0 when we're not checking a hypothesis
@@ -117,11 +174,17 @@ void cEMeco(
   }
 
   setP.verbose=*verbosiosity;
-  if (setP.verbose>=1) Rprintf("OPTIONS::  Ncar: %s; Fixed Rho: %s; SEM: %s\n",setP.ncar==1 ? "Yes" : "No",
-   setP.fixedRho==1 ? "Yes" : "No",setP.sem==1 ? "Second run" : (bit(*flag,2)==1 ? "First run" : "No"));
+  if (setP.verbose>=1) Rprintf("OPTIONS::  Ncar: %s; Fixed Rho: %s; SEM: %s; SQUAREM: %s\n",setP.ncar==1 ? "Yes" : "No",
+   setP.fixedRho==1 ? "Yes" : "No",setP.sem==1 ? "Second run" : (bit(*flag,2)==1 ? "First run" : "No"),
+   setP.accel==1 ? "Yes" : (bit(*flag,3)==1 ? "Not available" : "No"));
+  if (setP.verbose>=1 && bit(*flag,4)) Rprintf("OPTIONS::  Lazy E-step: %s\n",lazy ? "Yes" : "Not available");
+  if (setP.verbose>=1 && n_samp<n_rows) Rprintf("DATA::  %d precincts, %d distinct (X,Y)\n",n_rows,n_samp);
   setP.calcLoglik=*calcLoglik;
+  setP.quadNodes=*quadNodes;
+  setP.n_threads=*pin_threads;
   setP.convergence=*convergence;
   setP.t_samp=t_samp; setP.n_samp=n_samp; setP.s_samp=s_samp; setP.x1_samp=x1_samp; setP.x0_samp=x0_samp;
+  setP.t_weight=n_rows+s_samp;
   int param_len=setP.ccar ? setP.ccar_nvar : (setP.ncar ? 9 : 5);
   setP.param_len=param_len;
   setP.pdTheta=doubleArray(param_len);
@@ -138,7 +201,9 @@ void cEMeco(
   double *t_pdTheta_old=doubleArray(param_len);
   double Rmat_old[7][7];
   double Rmat[7][7];
-  double history_full[*iteration_max+1][10];
+  double history_full[*iteration_max+1][HIST_COLS];
+  double stepMax=1, loglik_prev; /* SQUAREM: maximum step length, loglik at the start of the cycle */
+  semRow* semRows=NULL; /* SEM: buffers of the R matrix rows */
 
   /* misc variables */
   int i, j,main_loop, start;   /* used for various loops */
@@ -150,14 +215,21 @@ void cEMeco(
   Param* params=(Param*) R_alloc(t_samp,sizeof(Param));
 
   for(i=0;i<t_samp;i++) params[i].setP=&setP;
-  readData(params, n_dim, pdX, sur_W, x1_W1, x0_W2, n_samp, s_samp, x1_samp, x0_samp);
+  for(i=0;i<n_samp;i++) {
+    pdXcase[i]=pdX[caseFirst[i]];
+    pdXcase[n_samp+i]=pdX[n_rows+caseFirst[i]];
+  }
+  readData(params, n_dim, pdXcase, sur_W, x1_W1, x0_W2, n_samp, s_samp, x1_samp, x0_samp);
+  for(i=0;i<n_samp;i++) params[i].caseP.weight=caseCount[i];
+  setP.lazy=lazy ? newLazyEStep(&setP) : NULL;
 
 
 
   /***Begin main loop ***/
   main_loop=1;start=1;
   while (main_loop<=*iteration_max && (start==1 ||
-          (setP.sem==0 && !closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence)) ||
+          (setP.sem==0 && (!closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence) ||
+                           (setP.lazy && !setP.lazy->exact))) ||
           (setP.sem==1 && !semDoneCheck((setParam*)&setP)))) {
   //while (main_loop<=*iteration_max && (start==1 || !closeEnough(transformTheta(pdTheta),transformTheta(pdTheta_old),param_len,*convergence))) {
 
@@ -166,22 +238,8 @@ void cEMeco(
       initTheta(pdTheta_in,params,pdTheta);
       transformTheta(pdTheta,t_pdTheta,param_len, &setP);
       setHistory(t_pdTheta,0,0,(setParam*)&setP,history_full);
-      if (!setP.ncar) {
-        for(i=0;i<t_samp;i++) {
-          params[i].caseP.mu[0] = pdTheta[0];
-          params[i].caseP.mu[1] = pdTheta[1];
-        }
-        setP.Sigma[0][0] = pdTheta[2];
-        setP.Sigma[1][1] = pdTheta[3];
-        setP.Sigma[0][1] = pdTheta[4]*sqrt(pdTheta[2]*pdTheta[3]);
-        setP.Sigma[1][0] = setP.Sigma[0][1];
-        dinv2D((double*)&setP.Sigma[0][0], 2, (double*)&setP.InvSigma[0][0], "Start of main loop");
-      }
-      else {
-        if (setP.fixedRho) ncarFixedRhoTransform(pdTheta);
-        initNCAR(params,pdTheta);
-        if (setP.fixedRho) ncarFixedRhoUnTransform(pdTheta);
-      }
+      setTheta(params,pdTheta);
+      if (setP.sem) semRows=newSemRows(params);
       start=0;
     }
     for(i=0;i<param_len;i++) setP.pdTheta[i]=pdTheta[i];
@@ -199,26 +257,37 @@ void cEMeco(
         Rprintf(" Prev LL: %5.2f",Suff[setP.suffstat_len]);
       Rprintf("\n");
     }
-    //keep the old theta around for comaprison
-    for(i=0;i<param_len;i++) pdTheta_old[i]=pdTheta[i];
-    transformTheta(pdTheta_old,t_pdTheta_old,param_len,&setP);
-
-
-    ecoEStep(params, Suff);
-    if (!setP.ncar)
-      ecoMStep(Suff,pdTheta,params);
-    else
-      ecoMStepNCAR(Suff,pdTheta,params);
-    transformTheta(pdTheta,t_pdTheta,param_len,&setP);
-    //char ch;
-    //scanf(" %c", &ch );
+    if (!setP.accel) {
+      //keep the old theta around for comaprison
+      for(i=0;i<param_len;i++) pdTheta_old[i]=pdTheta[i];
+      transformTheta(pdTheta_old,t_pdTheta_old,param_len,&setP);
+
+      ecoEMStep(params, pdTheta, Suff);
+      transformTheta(pdTheta,t_pdTheta,param_len,&setP);
+      if (setP.lazy) {
+        //path length of theta, and a full sweep to confirm convergence
+        double step=0;
+        for(i=0;i<param_len;i++) step+=(t_pdTheta[i]-t_pdTheta_old[i])*(t_pdTheta[i]-t_pdTheta_old[i]);
+        setP.lazy->path+=sqrt(step);
+        setP.lazy->tol=LAZY_REL*sqrt(step);
+        setP.lazy->forceFull=closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence);
+      }
+      //char ch;
+      //scanf(" %c", &ch );
 
-    //if we're in the second run through of SEM
-    if (setP.sem==1) {
-      ecoSEM(optTheta, pdTheta, params, Rmat_old, Rmat);
+      //if we're in the second run through of SEM
+      if (setP.sem==1) {
+        ecoSEM(optTheta, pdTheta, params, Rmat_old, Rmat, semRows);
+      }
+      else {
+        setHistory(t_pdTheta,(main_loop<=1) ? 0 : Suff[setP.suffstat_len],main_loop,(setParam*)&setP,history_full);
+      }
     }
     else {
-      setHistory(t_pdTheta,(main_loop<=1) ? 0 : Suff[setP.suffstat_len],main_loop,(setParam*)&setP,history_full);
+      //one SQUAREM cycle; t_pdTheta_old is set to where its last EM step started
+      setP.estepSaved+=ecoSquarem(params,pdTheta,t_pdTheta_old,Suff,&stepMax,&loglik_prev);
+      transformTheta(pdTheta,t_pdTheta,param_len,&setP);
+      setHistory(t_pdTheta,loglik_prev,main_loop,(setParam*)&setP,history_full);
     }
 
 
@@ -246,14 +315,15 @@ void cEMeco(
   Param* param;
   Suff[setP.suffstat_len]=0.0;
   for(i=0;i<param_len;i++) setP.pdTheta[i]=pdTheta[i];
+  for(i=0;i<n_rows;i++)
+    for(j=0;j<2;j++) inSample[i*2+j]=params[caseOf[i]].caseP.W[j];
   for(i=0;i<t_samp;i++) {
-     param=&(params[i]);
-    if(i<n_samp) {
-     for(j=0;j<2;j++) inSample[i*2+j]=param->caseP.W[j];
-      //setBounds(param);
-      //setNormConst(param);
-    }
-    Suff[setP.suffstat_len]+=getLogLikelihood(param);
+    param=&(params[i]);
+    param->caseP.intErr=0;
+    Suff[setP.suffstat_len]+=param->caseP.weight*getLogLikelihood(param);
+    reportLogit(param,1);
+    if (param->caseP.intErr!=0)
+      Rprintf("Integration error %d: X %5g Y %5g [%5g,%5g]\n",param->caseP.intErr,param->caseP.X,param->caseP.Y,param->caseP.Wbounds[0][0],param->caseP.Wbounds[0][1]);
   }
 
   if (setP.verbose>=1) {
@@ -282,8 +352,8 @@ void cEMeco(
 
   *itersUsed=main_loop;
   for(i=0;i<(*itersUsed);i++) {
-    for(j=0;j<(param_len+1);j++)
-      history[i*(param_len+1)+j]=history_full[i][j];
+    for(j=0;j<(param_len+2);j++)
+      history[i*(param_len+2)+j]=history_full[i][j];
   }
 
 
@@ -292,10 +362,183 @@ void cEMeco(
 
   /* Freeing the memory */
   Free(pdTheta_old);
+  Free(caseOf); Free(caseFirst); Free(caseCount); Free(pdXcase);
+  if (semRows) freeSemRows(semRows,&setP);
+  if (setP.lazy) freeLazyEStep(setP.lazy,&setP);
   //FreeMatrix(Rmat_old,5);
   //FreeMatrix(Rmat,5);
   }
 
+/**
+ * Online (stochastic approximation) EM, for data sets too large for cEMeco.
+ * The records are read from a source (see datasource.c) in batches of
+ * batch_size, and only one batch is in memory at a time.  Each batch gets
+ * an E-step at the current theta; its sufficient statistics s_b are blended
+ * into running ones, s <- (1-g_k) s + g_k s_b with g_k = k^(-kappa) for the
+ * k-th batch, and the M-step is taken from the running statistics.
+ * Convergence is checked after each pass over the data, on theta.
+ * Important mutations (i.e., outputs): pdTheta, Suff, history
+ */
+void cEMecoOnline(
+		  /* data source */
+		  char **file,         /* text file with a record per line, "" to use pdX */
+		  int *header,         /* 1 if the first line of the file holds column names */
+		  int *xcol, int *ycol, /* columns of X and Y in the file (from 1) */
+		  double *pdX,         /* in-memory data (X, Y), if no file */
+		  int *pin_samp,       /* in-memory sample size */
+
+		  double *pdTheta_in,  /* starting theta, as for cEMeco */
+		  int *batch_size,     /* records per batch */
+		  double *kappa,       /* decay of the step size, in (0.5,1] */
+		  int *iteration_max,  /* maximum number of passes over the data */
+		  double *convergence, /* abs value limit before stopping */
+
+		  /* options */
+		  int *flag,           /*0th (rightmost) bit: 1 = NCAR, 0=normal; 1st bit: 1 = fixed rho, 0 = not fixed rho */
+		  int *verbosiosity,   /*How much to print out, 0=silent, 1=cycle, 2=data*/
+		  int *calcLoglik,     /*1: sum up the loglik of each pass (at the theta of each batch) */
+		  int *quadNodes,      /* 0: adaptive quadrature; >0: fixed Gauss-Legendre rule with this many nodes */
+		  int *pin_threads,    /* most threads to use */
+
+		  /* storage */
+		  double *pdTheta,     /*EM result */
+		  double *Suff,        /*running sufficient statistics, and the loglik of the last pass */
+		  int *nRecords,       /* number of records in a pass */
+		  int *itersUsed,      /* number of passes used */
+		  double *history      /* history of param (transformed) and loglik, after each pass */
+		  ) {
+
+  int m_max=*batch_size;
+  int i,j,k,m,pass,param_len,n_rec;
+  int stop=0,bad_line=0;
+  double gamma,passLoglik;
+
+  setParam setP;
+  setP.ncar=bit(*flag,0);
+  setP.fixedRho=bit(*flag,1);
+  if (setP.ncar && setP.fixedRho) error("The online EM cannot fix rho under NCAR");
+  ecoSource* src=openSource(file[0],*header,*xcol-1,*ycol-1,pdX,*pin_samp);
+  setP.sem=0; setP.accel=0; setP.estepSaved=0; setP.lazy=NULL;
+  setP.ccar=0; setP.ccar_nvar=0; setP.hypTest=0;
+  setP.verbose=*verbosiosity;
+  setP.calcLoglik=*calcLoglik;
+  setP.quadNodes=*quadNodes;
+  setP.n_threads=*pin_threads;
+  setP.convergence=*convergence;
+  setP.s_samp=0; setP.x1_samp=0; setP.x0_samp=0;
+  param_len=setP.ncar ? 9 : 5;
+  setP.param_len=param_len;
+  setP.suffstat_len=(setP.ncar ? 9 : 5);
+  setP.pdTheta=doubleArray(param_len);
+
+  /* one batch of records and the scratch of its E-step */
+  Param* params=(Param*) Calloc(m_max,Param);
+  double *X=doubleArray(m_max), *Y=doubleArray(m_max);
+  double **Wstar=doubleMatrix(m_max,5);
+  double **partial=doubleMatrix((m_max+ESTEP_BLOCK-1)/ESTEP_BLOCK,setP.suffstat_len+1);
+  double *bSuff=doubleArray(setP.suffstat_len+1); //statistics of the batch
+  double *t_pdTheta=doubleArray(param_len), *t_pdTheta_old=doubleArray(param_len);
+  double history_full[*iteration_max+1][HIST_COLS];
+  double *t_node=NULL, *w_node=NULL, *cache=NULL;
+  for(i=0;i<m_max;i++) params[i].setP=&setP;
+  if (setP.quadNodes>0) {
+    t_node=doubleArray(setP.quadNodes); w_node=doubleArray(setP.quadNodes);
+    cache=doubleArray(m_max*5*setP.quadNodes);
+    gaussLegendre(setP.quadNodes,0.00001,.99999,t_node,w_node);
+  }
+
+  if (setP.verbose>=1) Rprintf("Online EM: batches of %d\n",m_max);
+  k=0; n_rec=0;
+  for(pass=1;pass<=*iteration_max;pass++) {
+    setP.iter=pass;
+    passLoglik=0;
+    rewindSource(src);
+    while ((m=readSource(src,X,Y,m_max))>0) {
+      if (pass==1) n_rec+=m;
+      setP.t_samp=setP.n_samp=m;
+      setP.t_weight=m;
+      for(i=0;i<m;i++) {
+        initRecord(&(params[i]),X[i],Y[i]);
+        if (setP.quadNodes>0 && params[i].caseP.Y<.990 && params[i].caseP.Y>.010)
+          setQuadNodes(&(params[i]),t_node,w_node,setP.quadNodes,cache+i*5*setP.quadNodes);
+      }
+      if (k==0) {
+        initTheta(pdTheta_in,params,pdTheta);
+        transformTheta(pdTheta,t_pdTheta,param_len,&setP);
+        setHistory(t_pdTheta,0,0,&setP,history_full);
+      }
+      setTheta(params,pdTheta);
+
+      ecoEStepWork(params,bSuff,Wstar,partial);
+      ecoEStepReport(params,Wstar);
+      k++;
+      gamma=pow((double)k,-(*kappa));
+      for(j=0;j<setP.suffstat_len;j++)
+        Suff[j]=(k==1) ? bSuff[j] : (1-gamma)*Suff[j]+gamma*bSuff[j];
+      passLoglik+=bSuff[setP.suffstat_len];
+
+      if (!setP.ncar)
+        ecoMStep(Suff,pdTheta,params);
+      else {
+        //the moments of logit(X), constant in cEMeco, are running ones
+        //here, to stay consistent with the running E[X W*]
+        pdTheta[0]=Suff[0];
+        pdTheta[3]=Suff[3]-Suff[0]*Suff[0];
+        ecoMStepNCAR(Suff,pdTheta,params);
+      }
+      if (checkInterrupt()) {
+        stop=1;
+        break;
+      }
+    }
+    /* the source is closed and the batch freed before any error() below */
+    if (m<0) bad_line=src->pos;
+    if (stop || bad_line) break;
+
+    for(j=0;j<param_len;j++) t_pdTheta_old[j]=t_pdTheta[j];
+    transformTheta(pdTheta,t_pdTheta,param_len,&setP);
+    Suff[setP.suffstat_len]=passLoglik;
+    setHistory(t_pdTheta,(setP.calcLoglik==1 && pass>1) ? passLoglik : 0,pass,&setP,history_full);
+    if (setP.verbose>=1) {
+      Rprintf("pass %d/%d:",pass,*iteration_max);
+      for(i=0;i<param_len;i++)
+        if (setP.varParam[i]) {
+          if (pdTheta[i]>=0) Rprintf("% 5.3f",pdTheta[i]);
+          else Rprintf(" % 5.2f",pdTheta[i]);
+        }
+      if (setP.calcLoglik==1 && pass>1) Rprintf(" LL: %5.2f",passLoglik);
+      Rprintf("\n");
+    }
+    R_FlushConsole();
+    if (pass==1) {
+      if (n_rec==0) break;
+      *nRecords=n_rec;
+    }
+    if (closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence)) break;
+  }
+
+  if (!stop && !bad_line && n_rec>0) {
+    *itersUsed=(pass>*iteration_max) ? *iteration_max : pass;
+    for(i=0;i<=(*itersUsed);i++)
+      for(j=0;j<(param_len+2);j++)
+        history[i*(param_len+2)+j]=history_full[i][j];
+  }
+
+  closeSource(src);
+  Free(params); Free(X); Free(Y); Free(bSuff);
+  FreeMatrix(Wstar,m_max);
+  FreeMatrix(partial,(m_max+ESTEP_BLOCK-1)/ESTEP_BLOCK);
+  Free(t_pdTheta); Free(t_pdTheta_old); Free(setP.pdTheta);
+  if (cache) { Free(t_node); Free(w_node); Free(cache); }
+
+  if (stop)
+    error("interrupted by the user\n");
+  if (bad_line)
+    error("Line %d of the data file is longer than %d characters\n", bad_line, SOURCE_LINE);
+  if (n_rec==0)
+    error("No records in the data");
+}
+
 /**
  * initializes Theta, varParam, and semDone
  * input: pdTheta_in,params
@@ -320,11 +563,11 @@ void initTheta(double* pdTheta_in,Param* params, double* pdTheta) {
     pdTheta[0]=0; mu3sq=0;
     for(i=0;i<setP->t_samp;i++) {
       lx=logit(params[i].caseP.X,"initpdTheta0");
-      pdTheta[0] += lx;
-      mu3sq += lx*lx;
+      pdTheta[0] += params[i].caseP.weight*lx;
+      mu3sq += params[i].caseP.weight*lx*lx;
     }
-    pdTheta[0] = pdTheta[0]/setP->t_samp;
-    mu3sq = mu3sq/setP->t_samp;
+    pdTheta[0] = pdTheta[0]/setP->t_weight;
+    mu3sq = mu3sq/setP->t_weight;
     pdTheta[3] = mu3sq-pdTheta[0]*pdTheta[0]; //variance
     //fill from pdTheta_in
     pdTheta[1]=pdTheta_in[0];
@@ -356,149 +599,310 @@ void initTheta(double* pdTheta_in,Param* params, double* pdTheta) {
 
 void ecoEStep(Param* params, double* suff) {
 
-  int t_samp,n_samp,s_samp,x1_samp,x0_samp,i,j,temp0,temp1, verbose;
-  double loglik,testdens;
-  Param* param; setParam* setP; caseParam* caseP;
-  setP=params[0].setP;
-  verbose=setP->verbose;
+  int t_samp,n_block;
+  setParam* setP=params[0].setP;
 
+  if (setP->lazy) {
+    ecoEStepLazy(params, suff);
+    return;
+  }
   t_samp=setP->t_samp;
-  n_samp=setP->n_samp;
-  x1_samp=setP->x1_samp;
-  x0_samp=setP->x0_samp;
-  s_samp=setP->s_samp;
-
+  n_block=(t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK;
   double **Wstar=doubleMatrix(t_samp,5);     /* pseudo data(transformed)*/
-  loglik=0;
-  if (verbose>=3 && !setP->sem) Rprintf("E-step start\n");
-  for (i = 0; i<n_samp; i++) {
-    param = &(params[i]);
-    caseP=&(param->caseP);
-    if (caseP->Y>=.990 || caseP->Y<=.010) { //if Y is near the edge, then W1 and W2 are very constrained
-      Wstar[i][0]=logit(caseP->Y,"Y maxmin W1");
-      Wstar[i][1]=logit(caseP->Y,"Y maxmin W2");
-      Wstar[i][2]=Wstar[i][0]*Wstar[i][0];
-      Wstar[i][3]=Wstar[i][0]*Wstar[i][1];
-      Wstar[i][4]=Wstar[i][1]*Wstar[i][1];
-      caseP->Wstar[0]=Wstar[i][0];
-      caseP->Wstar[1]=Wstar[i][1];
-      caseP->W[0]=caseP->Y;
-      caseP->W[1]=caseP->Y;
-      if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(param);
-      //Rprintf("Skipping %d, Y=%5g",i,caseP->Y);
-    }
-    else {
-      setBounds(param); //I think you only have to do this once...check later
-      /*if (verbose>=2 && setP->iter==12 && i==422) {
-        Rprintf("Bounds: %5g %5g %5g %5g\n",caseP->Wbounds[0][0],caseP->Wbounds[0][1],caseP->Wbounds[1][0],caseP->Wbounds[1][1]);
-        setP->weirdness=1;
-      }
-      else setP->weirdness=0;*/
-
-      setNormConst(param);
-      for (j=0;j<5;j++) {
-        caseP->suff=j;
-        Wstar[i][j]=paramIntegration(&SuffExp,param);
-        if (j<2)
-          caseP->Wstar[j]=Wstar[i][j];
-      }
-      caseP->suff=SS_W1;
-      caseP->W[0]=paramIntegration(&SuffExp,param);
-      caseP->suff=SS_W2;
-      caseP->W[1]=paramIntegration(&SuffExp,param);
-      caseP->suff=SS_Test;
-      testdens=paramIntegration(&SuffExp,param);
-      if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(param);
-
-      //report error E1 if E[W1],E[W2] is not on the tomography line
-      if (fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1]))>0.011) {
-        Rprintf("E1 %d %5g %5g %5g %5g %5g %5g %5g %5g err:%5g\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], caseP->normcT,Wstar[i][0],Wstar[i][1],Wstar[i][2],fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1])));
-        char ch;
-        scanf("Hit enter to continue %c\n", &ch );
-      }
-      //report error E2 if Jensen's inequality doesn't hold
-      if (Wstar[i][4]<pow(Wstar[i][1],2) || Wstar[i][2]<pow(Wstar[i][0],2))
-        Rprintf("E2 %d %5g %5g %5g %5g %5g %5g %5g %5g\n", i, caseP->X, caseP->Y, caseP->normcT, caseP->mu[1],Wstar[i][0],Wstar[i][1],Wstar[i][2],Wstar[i][4]);
-      //used for debugging if necessary
-      if (verbose>=2 && !setP->sem && ((i<10 && verbose>=3) || (caseP->mu[1] < -1.7 && caseP->mu[0] > 1.4)))
-        Rprintf("%d %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], param->setP->Sigma[0][1], caseP->normcT, caseP->W[0],caseP->W[1],Wstar[i][2]);
+  double **partial=doubleMatrix(n_block,setP->suffstat_len+1); /* per-block suff and loglik */
+
+  if (setP->verbose>=3 && !setP->sem) Rprintf("E-step start\n");
+  ecoEStepWork(params, suff, Wstar, partial);
+  ecoEStepReport(params, Wstar);
+
+  FreeMatrix(Wstar,t_samp);
+  FreeMatrix(partial,n_block);
+}
+
+/**
+  * The computation of ecoEStep, without any call into R, so that it can also
+  * run on a worker thread (see ecoSEM).
+  * Records are processed in blocks of ESTEP_BLOCK, on several threads unless
+  * we already are on one.  Each block keeps its own partial sums, which are
+  * added up in block order so the result does not depend on the number of threads.
+  * Wstar: t_samp x 5, partial: (number of blocks) x (suffstat_len+1) scratch
+  * mutates: suff, Wstar (the pseudo data), params
+ **/
+void ecoEStepWork(Param* params, double* suff, double** Wstar, double** partial) {
+
+  int t_samp,i,j,b,n_block,n_threads,suffstat_len;
+  setParam* setP=params[0].setP;
+
+  t_samp=setP->t_samp;
+  suffstat_len=setP->suffstat_len;
+  n_block=(t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK;
+
+  //only the outermost E-step spreads over the worker pool
+  n_threads=nThreads(setP->n_threads);
+
+#pragma omp parallel for private(i,j) schedule(dynamic) num_threads(n_threads) if(n_threads>1 && n_block>1)
+  for (b=0; b<n_block; b++) {
+    Param scratch;    /* thread-private copy of the record being integrated */
+    double caseLoglik;
+    for (j=0; j<=suffstat_len; j++) partial[b][j]=0;
+    for (i=b*ESTEP_BLOCK; i<t_samp && i<(b+1)*ESTEP_BLOCK; i++) {
+      scratch=params[i];
+      ecoEStepCase(&scratch, Wstar[i], &caseLoglik);
+      params[i].caseP=scratch.caseP;
+      addSuffStat(&(params[i].caseP), Wstar[i], setP->ncar, partial[b]);
+      partial[b][suffstat_len]+=params[i].caseP.weight*caseLoglik;
     }
   }
 
+  /* homogeneous areas (x1_samp, x0_samp) are not handled by the current version */
+
+  /*Calculate sufficient statistics */
+  for (j=0; j<=suffstat_len; j++)
+    suff[j]=0;
+  for (b=0; b<n_block; b++)
+    for (j=0; j<=suffstat_len; j++)
+      suff[j]+=partial[b][j];
+
+  for(j=0; j<suffstat_len; j++)
+    suff[j]=suff[j]/setP->t_weight;
+  //Rprintf("%5g suff0,2,4 %5g %5g %5g\n",setP->pdTheta[6],suff[0],suff[2],suff[4]);
+  //if(verbose>=1) Rprintf("Log liklihood %15g\n",suff[suffstat_len]);
+}
+
+/**
+  * Reports anything odd found by ecoEStepWork; main thread only
+  * input: params, Wstar as left by ecoEStepWork
+ **/
+void ecoEStepReport(Param* params, double** Wstar) {
+
+  int i,verbose,lik;
+  Param* param; setParam* setP; caseParam* caseP;
+  setP=params[0].setP;
+  verbose=setP->verbose;
+  lik=(setP->calcLoglik==1 && setP->iter>1) || setP->accel;
 
-  /* Use the values given by the survey data */
-  //Calculate loglik also
-  for (i=n_samp; i<n_samp+s_samp; i++) {
+  for (i = 0; i<setP->t_samp; i++)
+    reportLogit(&(params[i]),lik);
+  for (i = 0; i<setP->n_samp; i++) {
     param = &(params[i]);
     caseP=&(param->caseP);
-    Wstar[i][0]=caseP->Wstar[0];
-    Wstar[i][1]=caseP->Wstar[1];
-    Wstar[i][2]=Wstar[i][0]*Wstar[i][0];
-    Wstar[i][3]=Wstar[i][0]*Wstar[i][1];
-    Wstar[i][4]=Wstar[i][1]*Wstar[i][1];
-    if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(param);
+    if (caseP->Y>=.990 || caseP->Y<=.010) continue;
+    if (caseP->intErr!=0)
+      Rprintf("Integration error %d: X %5g Y %5g [%5g,%5g]\n",caseP->intErr,caseP->X,caseP->Y,caseP->Wbounds[0][0],caseP->Wbounds[0][1]);
+    //report error E1 if E[W1],E[W2] is not on the tomography line
+    if (fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1]))>0.011) {
+      Rprintf("E1 %d %5g %5g %5g %5g %5g %5g %5g %5g err:%5g\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], caseP->normcT,Wstar[i][0],Wstar[i][1],Wstar[i][2],fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1])));
+      char ch;
+      scanf("Hit enter to continue %c\n", &ch );
+    }
+    //report error E2 if Jensen's inequality doesn't hold
+    if (Wstar[i][4]<pow(Wstar[i][1],2) || Wstar[i][2]<pow(Wstar[i][0],2))
+      Rprintf("E2 %d %5g %5g %5g %5g %5g %5g %5g %5g\n", i, caseP->X, caseP->Y, caseP->normcT, caseP->mu[1],Wstar[i][0],Wstar[i][1],Wstar[i][2],Wstar[i][4]);
+    //used for debugging if necessary
+    if (verbose>=2 && !setP->sem && ((i<10 && verbose>=3) || (caseP->mu[1] < -1.7 && caseP->mu[0] > 1.4)))
+      Rprintf("%d %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], param->setP->Sigma[0][1], caseP->normcT, caseP->W[0],caseP->W[1],Wstar[i][2]);
   }
+}
 
-  /* analytically compute E{W2_i|Y_i} given W1_i, mu and Sigma in x1 homeogeneous areas */
-  for (i=n_samp+s_samp; i<n_samp+s_samp+x1_samp; i++) {
-    /*temp0=params[i].caseP.Wstar[0];
-    temp1=params[i].caseP.mu[1]+setP->Sigma[0][1]/setP->Sigma[0][0]*(temp0-params[i].caseP.mu[0]);
-    Wstar[i][0]=temp0;
-    Wstar[i][1]=temp1;
-    Wstar[i][2]=temp0*temp0;
-    Wstar[i][3]=temp0*temp1;
-    Wstar[i][4]=temp1*temp1;*/
+/**
+  * Prints what logit() would have about a record whose logits were taken
+  * quietly by ecoEStepCase (and getLogLikelihood if lik), which may run
+  * on a worker thread; main thread only
+ **/
+void reportLogit(Param* param, int lik) {
+  caseParam* caseP=&(param->caseP);
+  if (caseP->dataType==DPT_Survey) {
+    if (lik && param->setP->ncar && (caseP->X>=1 || caseP->X<=0))
+      Rprintf("log-likelihood survey: %5g is out of logit range\n",caseP->X);
   }
+  else if (caseP->Y>=1 || caseP->Y<=0)
+    Rprintf("Y maxmin W1: %5g is out of logit range\n",caseP->Y);
+}
 
-  /*analytically compute E{W1_i|Y_i} given W2_i, mu and Sigma in x0 homeogeneous areas */
-  for (i=n_samp+s_samp+x1_samp; i<n_samp+s_samp+x1_samp+x0_samp; i++) {
-    /*temp1=params[i].caseP.Wstar[1];
-    temp0=params[i].caseP.mu[0]+setP->Sigma[0][1]/setP->Sigma[1][1]*(temp1-params[i].caseP.mu[1]);
-    Wstar[i][0]=temp0;
-    Wstar[i][1]=temp1;
-    Wstar[i][2]=temp0*temp0;
-    Wstar[i][3]=temp0*temp1;
-    Wstar[i][4]=temp1*temp1;*/
+/**
+ * Lazy E-step: like ecoEStep, but a record is only integrated again when
+ * its moments are predicted to have moved by more than lz->tol (a fraction
+ * LAZY_REL of the last step of theta, set by cEMeco) since its last
+ * integration; otherwise its cached contribution is used.
+ * The prediction is first order: the largest change of the record's
+ * moments per unit of theta path length seen at its previous integration,
+ * times the length of the path theta has travelled since (which bounds
+ * how far theta has moved).  Records whose moments do not depend on theta
+ * (survey data, Y at the edge) are only integrated on full sweeps.
+ * Every LAZY_SWEEP E-steps, and when lz->forceFull is set, all records are
+ * integrated and the sums are recomputed; in between they are updated by
+ * difference.  The loglik of the skipped records is the cached one.
+ * mutates: suff, params, setP->lazy
+ **/
+void ecoEStepLazy(Param* params, double* suff) {
+
+  int t_samp,i,j,k,b,n_block,n_threads,suffstat_len,full,n_int;
+  setParam* setP=params[0].setP;
+  lazyEStep* lz=setP->lazy;
+
+  t_samp=setP->t_samp;
+  suffstat_len=setP->suffstat_len;
+  n_block=(t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK;
+  full=(lz->forceFull || lz->sinceFull>=LAZY_SWEEP-1);
+
+  n_threads=nThreads(setP->n_threads);
+
+  n_int=0;
+#pragma omp parallel for private(i,j,k) schedule(dynamic) num_threads(n_threads) if(n_threads>1 && n_block>1) reduction(+:n_int)
+  for (b=0; b<n_block; b++) {
+    Param scratch;
+    double Wstar[5], contrib[suffstat_len+1];
+    double dist, move;
+    if (full)
+      for (j=0; j<=suffstat_len; j++) lz->partial[b][j]=0;
+    for (i=b*ESTEP_BLOCK; i<t_samp && i<(b+1)*ESTEP_BLOCK; i++) {
+      dist=lz->path-lz->pathAt[i];
+      if (!full && !(dist>0 && lz->slope[i]*dist>lz->tol)) continue;
+      scratch=params[i];
+      for (j=0; j<=suffstat_len; j++) contrib[j]=0;
+      ecoEStepCase(&scratch, Wstar, &contrib[suffstat_len]);
+      params[i].caseP=scratch.caseP;
+      contrib[suffstat_len]*=params[i].caseP.weight;
+      addSuffStat(&(params[i].caseP), Wstar, setP->ncar, contrib);
+      if (dist>0) { //how fast did the moments move
+        move=0;
+        for (k=0; k<5; k++)
+          if (fabs(Wstar[k]-lz->Wstar[i][k])>move) move=fabs(Wstar[k]-lz->Wstar[i][k]);
+        lz->slope[i]=(lz->pathAt[i]<0) ? HUGE_VAL : move/dist;
+        lz->pathAt[i]=lz->path;
+      }
+      for (k=0; k<5; k++) lz->Wstar[i][k]=Wstar[k];
+      for (j=0; j<=suffstat_len; j++) {
+        lz->partial[b][j]+=full ? contrib[j] : contrib[j]-lz->contrib[i][j];
+        lz->contrib[i][j]=contrib[j];
+      }
+      n_int++;
+    }
   }
 
+  ecoEStepReport(params, lz->Wstar);
 
-  /*Calculate sufficient statistics */
-  for (j=0; j<setP->suffstat_len; j++)
+  for (j=0; j<=suffstat_len; j++)
     suff[j]=0;
+  for (b=0; b<n_block; b++)
+    for (j=0; j<=suffstat_len; j++)
+      suff[j]+=lz->partial[b][j];
+  for(j=0; j<suffstat_len; j++)
+    suff[j]=suff[j]/setP->t_weight;
+
+  lz->sinceFull=full ? 0 : lz->sinceFull+1;
+  lz->exact=full;
+  lz->forceFull=0;
+  lz->nIntegrated=n_int;
+  if (setP->verbose>=2) Rprintf("lazy E-step: %d of %d records integrated%s\n",n_int,t_samp,full ? " (full sweep)" : "");
+}
 
-
-  //CAR: (0) E[W1*] (1) E[W2*] (2) E[W1*^2] (3) E[W2*^2] (4) E[W1*W2*] (5) loglik
-  //NCAR: (0) X, (1) W1, (2) W2, (3) X^2, (4) W1^2, (5) W2^2, (6) x*W1, (7) X*W2, (8) W1*W2, (9) loglik
-  /* compute sufficient statistics */
-  for (i=0; i<t_samp; i++) {
-    if (!setP->ncar) {
-      suff[0] += Wstar[i][0];  /* sumE(W_i1|Y_i) */
-      suff[1] += Wstar[i][1];  /* sumE(W_i2|Y_i) */
-      suff[2] += Wstar[i][2];  /* sumE(W_i1^2|Y_i) */
-      suff[3] += Wstar[i][4];  /* sumE(W_i2^2|Y_i) */
-      suff[4] += Wstar[i][3];  /* sumE(W_i1*W_i2|Y_i) */
-    }
-    else if (setP->ncar) {
-      double lx= logit(params[i].caseP.X,"mstep X");
-      suff[0] += lx;
-      suff[1] += Wstar[i][0];
-      suff[2] += Wstar[i][1];
-      suff[3] += lx*lx;
-      suff[4] += Wstar[i][2];
-      suff[5] += Wstar[i][4];
-      suff[6] += params[i].caseP.Wstar[0]*lx;
-      suff[7] += params[i].caseP.Wstar[1]*lx;
-      suff[8] += Wstar[i][3];
-    }
+lazyEStep* newLazyEStep(setParam* setP) {
+  int i;
+  lazyEStep* lz=(lazyEStep*) Calloc(1,lazyEStep);
+  lz->Wstar=doubleMatrix(setP->t_samp,5);
+  lz->contrib=doubleMatrix(setP->t_samp,setP->suffstat_len+1);
+  lz->partial=doubleMatrix((setP->t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK,setP->suffstat_len+1);
+  lz->slope=doubleArray(setP->t_samp);
+  lz->pathAt=doubleArray(setP->t_samp);
+  for (i=0; i<setP->t_samp; i++) {
+    lz->slope[i]=HUGE_VAL;
+    lz->pathAt[i]=-1; //never integrated
   }
+  lz->path=0;
+  lz->tol=0;
+  lz->forceFull=1;
+  lz->sinceFull=0;
+  lz->exact=0;
+  return lz;
+}
 
-  for(j=0; j<setP->suffstat_len; j++)
-    suff[j]=suff[j]/t_samp;
-  //Rprintf("%5g suff0,2,4 %5g %5g %5g\n",setP->pdTheta[6],suff[0],suff[2],suff[4]);
-  //if(verbose>=1) Rprintf("Log liklihood %15g\n",loglik);
-  suff[setP->suffstat_len]=loglik;
+void freeLazyEStep(lazyEStep* lz, setParam* setP) {
+  FreeMatrix(lz->Wstar,setP->t_samp);
+  FreeMatrix(lz->contrib,setP->t_samp);
+  FreeMatrix(lz->partial,(setP->t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK);
+  Free(lz->slope);
+  Free(lz->pathAt);
+  Free(lz);
+}
 
-  FreeMatrix(Wstar,t_samp);
+/**
+ * E-step for a single record, general (i < n_samp) or survey.
+ * Only touches its own Param, so records can be processed concurrently;
+ * must not call into R (no printing, hence no logit()), see
+ * ecoEStepReport for error reporting.
+ * Mutates: Wstar (the five conditional moments), loglik (contribution of
+ * the record, 0 unless setP->calcLoglik or setP->accel), param->caseP
+ */
+void ecoEStepCase(Param* param, double* Wstar, double* loglik) {
+  int j;
+  setParam* setP=param->setP;
+  caseParam* caseP=&(param->caseP);
+
+  caseP->intErr=0;
+  *loglik=0;
+  if (caseP->dataType==DPT_Survey) {
+    /* Use the values given by the survey data */
+    Wstar[0]=caseP->Wstar[0];
+    Wstar[1]=caseP->Wstar[1];
+  }
+  else if (caseP->Y>=.990 || caseP->Y<=.010) { //if Y is near the edge, then W1 and W2 are very constrained
+    Wstar[0]=log(caseP->Y/(1-caseP->Y));
+    Wstar[1]=Wstar[0];
+    caseP->Wstar[0]=Wstar[0];
+    caseP->Wstar[1]=Wstar[1];
+    caseP->W[0]=caseP->Y;
+    caseP->W[1]=caseP->Y;
+  }
+  else {
+    double moments[TM_Len];
+    int lik=(setP->calcLoglik==1 && setP->iter>1) || setP->accel;
+    tomoIntegration(param,moments,lik); //bounds were set by readData
+    caseP->normcT=moments[TM_Normc];
+    for (j=0;j<5;j++)
+      Wstar[j]=moments[TM_W1star+j]/caseP->normcT;
+    caseP->Wstar[0]=Wstar[0];
+    caseP->Wstar[1]=Wstar[1];
+    caseP->W[0]=moments[TM_W1]/caseP->normcT;
+    caseP->W[1]=moments[TM_W2]/caseP->normcT;
+    if (lik) *loglik=log(moments[TM_Lik]);
+    return;
+  }
+  Wstar[2]=Wstar[0]*Wstar[0];
+  Wstar[3]=Wstar[0]*Wstar[1];
+  Wstar[4]=Wstar[1]*Wstar[1];
+  if ((setP->calcLoglik==1 && setP->iter>1) || setP->accel) *loglik=getLogLikelihood(param);
+}
+
+/**
+ * Adds the contribution of one record, times its weight, to the (unnormalized)
+ * sufficient statistics
+ * Wstar holds the record's five conditional moments, as filled by ecoEStepCase
+ * CAR: (0) E[W1*] (1) E[W2*] (2) E[W1*^2] (3) E[W2*^2] (4) E[W1*W2*]
+ * NCAR: (0) X, (1) W1, (2) W2, (3) X^2, (4) W1^2, (5) W2^2, (6) x*W1, (7) X*W2, (8) W1*W2
+ * Mutates: suff
+ */
+void addSuffStat(caseParam* caseP, double* Wstar, int ncar, double* suff) {
+  double w=caseP->weight;
+  if (!ncar) {
+    suff[0] += w*Wstar[0];  /* sumE(W_i1|Y_i) */
+    suff[1] += w*Wstar[1];  /* sumE(W_i2|Y_i) */
+    suff[2] += w*Wstar[2];  /* sumE(W_i1^2|Y_i) */
+    suff[3] += w*Wstar[4];  /* sumE(W_i2^2|Y_i) */
+    suff[4] += w*Wstar[3];  /* sumE(W_i1*W_i2|Y_i) */
+  }
+  else {
+    double lx= log(caseP->X/(1-caseP->X));
+    suff[0] += w*lx;
+    suff[1] += w*Wstar[0];
+    suff[2] += w*Wstar[1];
+    suff[3] += w*lx*lx;
+    suff[4] += w*Wstar[2];
+    suff[5] += w*Wstar[4];
+    suff[6] += w*caseP->Wstar[0]*lx;
+    suff[7] += w*caseP->Wstar[1]*lx;
+    suff[8] += w*Wstar[3];
+  }
 }
 
 /**
@@ -656,12 +1060,12 @@ void ecoMStepNCAR(double* Suff, double* pdTheta, Param* params) {
         matrixMul(tmp42,Zmat_t,4,2,2,4,tmp44);
         for (i=0;i<4;i++)
           for(j=0;j<4;j++)
-            denom[i][j]+=tmp44[i][j];
+            denom[i][j]+=params[ii].caseP.weight*tmp44[i][j];
         //for (i=0;i<2;i++) tmp21[i][0]=(params[ii].caseP.Wstar[i] - pdTheta[i+1]); //Wtilde ??
         for (i=0;i<2;i++) tmp21[i][0]=params[ii].caseP.Wstar[i]; //Wstar
         //matrixMul(Zmat,InvSigma,4,2,2,2,tmp42);  //no need to repeat calculation
         matrixMul(tmp42,tmp21,4,2,2,1,tmp41);
-        for (i=0;i<4;i++) numer[i][0]+=tmp41[i][0];
+        for (i=0;i<4;i++) numer[i][0]+=params[ii].caseP.weight*tmp41[i][0];
     }
     dinv(denom,4,denom);
     matrixMul(denom,numer,4,4,4,1,numer);
@@ -770,10 +1174,10 @@ void ecoMStepCCAR(double* pdTheta, Param* params) {
       matrixMul(tmpk2,Z_i_t,k,2,2,k,tmpkk);
       for (i=0;i<k;i++)
         for(j=0;j<k;j++)
-          denom[i][j]+=tmpkk[i][j];
+          denom[i][j]+=params[ii].caseP.weight*tmpkk[i][j];
       for (i=0;i<2;i++) tmp21[i][0]=params[ii].caseP.Wstar[i]; //Wstar
       matrixMul(tmpk2,tmp21,k,2,2,1,tmpk1);
-      for (i=0;i<k;i++) numer[i][0]+=tmpk1[i][0];
+      for (i=0;i<k;i++) numer[i][0]+=params[ii].caseP.weight*tmpk1[i][0];
   }
   dinv(denom,k,denom);
   matrixMul(denom,numer,k,k,k,1,numer);
@@ -804,7 +1208,7 @@ void ecoMStepCCAR(double* pdTheta, Param* params) {
     matrixMul(tmp21,tmp12,2,1,1,2,tmp22);
     for(i=0; i<2;i++)
       for(j=0; j<2;j++)
-        setP->Sigma[i][j] += tmp22[i][j];
+        setP->Sigma[i][j] += params[ii].caseP.weight*tmp22[i][j];
   }
   dinv2D((double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"CCAR M-step S2");
 
@@ -863,11 +1267,11 @@ void MStepHypTest(Param* params, double* pdTheta) {
   //numerator
   for(k=0;k<2;k++) temp_DbyL[k][0]=0;
   for(i=0;i<setP->t_samp;i++) {
-    temp_DbyL[0][0]+=params[i].caseP.Wstar[0];
-    temp_DbyL[1][0]+=params[i].caseP.Wstar[1];
+    temp_DbyL[0][0]+=params[i].caseP.weight*params[i].caseP.Wstar[0];
+    temp_DbyL[1][0]+=params[i].caseP.weight*params[i].caseP.Wstar[1];
   }
   matrixMul(hypTestCoeffT,temp_DbyL,l,dim,dim,l,temp_LbyL);
-  temp_LbyL[0][0]=temp_LbyL[0][0]-(setP->t_samp*setP->hypTestResult);
+  temp_LbyL[0][0]=temp_LbyL[0][0]-(setP->t_weight*setP->hypTestResult);
   matrixMul(Sigma,setP->hypTestCoeff,dim,dim,dim,l,temp_DbyL);
   for(k=0;k<2;k++) temp_DbyL[k][0]*=temp_LbyL[0][0];
 
@@ -875,7 +1279,7 @@ void MStepHypTest(Param* params, double* pdTheta) {
   //matrixMul(hypTestCoeffT,InvSigma,l,dim,dim,dim,temp_LbyD);
   matrixMul(hypTestCoeffT,Sigma,l,dim,dim,dim,temp_LbyD);
   matrixMul(temp_LbyD,setP->hypTestCoeff,l,dim,dim,l,temp_LbyL);
-  denom=setP->t_samp*temp_LbyL[0][0];
+  denom=setP->t_weight*temp_LbyL[0][0];
 
   //offset theta
   for(k=0;k<2;k++) {
@@ -935,6 +1339,143 @@ void initNCAR(Param* params, double* pdTheta) {
   }
 }
 
+/**
+ * Sets up params for theta (natural scale), as the M-step leaves them:
+ * the case means, Sigma and InvSigma, and under NCAR Sigma3 and InvSigma3
+ * input: pdTheta
+ * mutates: params, setP->pdTheta
+ */
+void setTheta(Param* params, double* pdTheta) {
+  setParam* setP=params[0].setP;
+  int i;
+  if (!setP->ncar) {
+    for(i=0;i<setP->t_samp;i++) {
+      params[i].caseP.mu[0] = pdTheta[0];
+      params[i].caseP.mu[1] = pdTheta[1];
+    }
+    setP->Sigma[0][0] = pdTheta[2];
+    setP->Sigma[1][1] = pdTheta[3];
+    setP->Sigma[0][1] = pdTheta[4]*sqrt(pdTheta[2]*pdTheta[3]);
+    setP->Sigma[1][0] = setP->Sigma[0][1];
+    dinv2D((double*)&setP->Sigma[0][0], 2, (double*)&setP->InvSigma[0][0], "setTheta");
+  }
+  else {
+    //reference: (0) mu_3, (1) mu_1, (2) mu_2, (3) sig_3, (4) sig_1, (5) sig_2, (6) r_13, (7) r_23, (8) r_12
+    setP->Sigma3[0][0] = pdTheta[4];
+    setP->Sigma3[1][1] = pdTheta[5];
+    setP->Sigma3[2][2] = pdTheta[3];
+    setP->Sigma3[0][1] = pdTheta[8]*sqrt(pdTheta[4]*pdTheta[5]);
+    setP->Sigma3[0][2] = pdTheta[6]*sqrt(pdTheta[4]*pdTheta[3]);
+    setP->Sigma3[1][2] = pdTheta[7]*sqrt(pdTheta[5]*pdTheta[3]);
+    setP->Sigma3[1][0] = setP->Sigma3[0][1];
+    setP->Sigma3[2][0] = setP->Sigma3[0][2];
+    setP->Sigma3[2][1] = setP->Sigma3[1][2];
+    dinv2D((double*)(&(setP->Sigma3[0][0])), 3, (double*)(&(setP->InvSigma3[0][0])),"setTheta S3");
+    if (setP->fixedRho) ncarFixedRhoTransform(pdTheta);
+    initNCAR(params,pdTheta);
+    if (setP->fixedRho) ncarFixedRhoUnTransform(pdTheta);
+  }
+  for(i=0;i<setP->param_len;i++) setP->pdTheta[i]=pdTheta[i];
+}
+
+/**
+ * One EM step from the theta params are currently set up for
+ * (pdTheta must hold that same theta: the fixed-rho M-steps read it)
+ * mutates: pdTheta (the updated theta), Suff (E-step at the old theta,
+ * including its loglik), params
+ */
+void ecoEMStep(Param* params, double* pdTheta, double* Suff) {
+  ecoEStep(params, Suff);
+  if (!params[0].setP->ncar)
+    ecoMStep(Suff,pdTheta,params);
+  else
+    ecoMStepNCAR(Suff,pdTheta,params);
+}
+
+/**
+ * Is theta (natural scale) usable as a parameter: finite, positive
+ * variances and correlations inside (-1,1)
+ */
+static int validTheta(double* pdTheta, setParam* setP) {
+  int i;
+  for(i=0;i<setP->param_len;i++)
+    if (!R_FINITE(pdTheta[i])) return 0;
+  if (!setP->ncar)
+    return pdTheta[2]>0 && pdTheta[3]>0 && fabs(pdTheta[4])<1;
+  return pdTheta[4]>0 && pdTheta[5]>0 &&
+    fabs(pdTheta[6])<1 && fabs(pdTheta[7])<1 && fabs(pdTheta[8])<1;
+}
+
+/**
+ * One SQUAREM cycle (Varadhan and Roland, 2008, scheme S3) on the EM map,
+ * in the transformed space of transformTheta.
+ * Two EM steps t1=F(t0), t2=F(t1) give r=t1-t0 and v=t2-t1-r; the cycle
+ * jumps to t'=t0-2a*r+a^2*v with a=-|r|/|v| (kept between -stepMax and -1)
+ * and takes one more EM step from there.  If t' is not a valid parameter,
+ * or its loglik is below that of t0, the jump is dropped and the cycle
+ * ends at t2; stepMax grows by 4 whenever the longest step is accepted.
+ * A jump of length |a| goes about as far as 2|a| EM steps, so the cycle
+ * saves 2|a|+1-3 E-steps (one is lost when the jump is dropped).
+ * input: pdTheta (t0, natural scale), params set up for it
+ * mutates: pdTheta (end of the cycle), params (set up for it), Suff (the
+ * E-step that gave pdTheta), t_pdTheta_old (start of the last EM step, for
+ * the convergence check), stepMax, loglik (loglik at t0)
+ * returns: the number of E-steps saved
+ */
+double ecoSquarem(Param* params, double* pdTheta, double* t_pdTheta_old, double* Suff, double* stepMax, double* loglik) {
+  setParam* setP=params[0].setP;
+  int len=setP->param_len;
+  int i;
+  double t0[9], t1[9], t2[9], tp[9], r[9], v[9], theta2[9], thetap[9];
+  double suff2[10]; //Suff of the second EM step, with its loglik
+  double sr2=0, sv2=0, alpha;
+
+  transformTheta(pdTheta,t0,len,setP);
+  ecoEMStep(params,pdTheta,Suff);
+  *loglik=Suff[setP->suffstat_len];
+  transformTheta(pdTheta,t1,len,setP);
+  ecoEMStep(params,pdTheta,Suff);
+  transformTheta(pdTheta,t2,len,setP);
+  for(i=0;i<=setP->suffstat_len;i++) suff2[i]=Suff[i];
+  for(i=0;i<len;i++) {
+    theta2[i]=pdTheta[i];
+    r[i]=t1[i]-t0[i];
+    v[i]=t2[i]-t1[i]-r[i];
+    sr2+=r[i]*r[i];
+    sv2+=v[i]*v[i];
+  }
+  for(i=0;i<len;i++) t_pdTheta_old[i]=t1[i];
+  if (sv2==0) return 0; //no curvature: nothing to extrapolate
+
+  alpha=-sqrt(sr2/sv2);
+  if (alpha>-1) alpha=-1;
+  if (alpha<-(*stepMax)) alpha=-(*stepMax);
+  for(i=0;i<len;i++)
+    tp[i]=t0[i]-2*alpha*r[i]+alpha*alpha*v[i];
+  untransformTheta(tp,thetap,len,setP);
+  for(i=0;i<len;i++)
+    if (!setP->varParam[i]) thetap[i]=theta2[i]; //keep constants exact
+
+  if (validTheta(thetap,setP)) {
+    for(i=0;i<len;i++) pdTheta[i]=thetap[i];
+    setTheta(params,pdTheta);
+    ecoEMStep(params,pdTheta,Suff);
+    if (Suff[setP->suffstat_len]>=*loglik) {
+      if (alpha==-(*stepMax)) *stepMax*=4;
+      transformTheta(thetap,t_pdTheta_old,len,setP);
+      return -2*alpha-2;
+    }
+  }
+  //fall back to the plain EM point
+  if (*stepMax>1) *stepMax/=4;
+  if (*stepMax<1) *stepMax=1;
+  for(i=0;i<len;i++) pdTheta[i]=theta2[i];
+  for(i=0;i<=setP->suffstat_len;i++) Suff[i]=suff2[i];
+  setTheta(params,pdTheta);
+  if (setP->verbose>=2) Rprintf("SQUAREM step %5g rejected\n",alpha);
+  return validTheta(thetap,setP) ? -1 : 0;
+}
+
 /**
  * CCAR initialize
  * Note that fixed rho is currently unimplemented
@@ -966,164 +1507,177 @@ void initCCAR(Param* params, double* pdTheta) {
   }
 }
 
+/**
+ * Allocates the buffers of the SEM rows, one per free parameter
+ * (setP->varParam must be set, see initTheta)
+ */
+semRow* newSemRows(Param* params) {
+  setParam* setP=params[0].setP;
+  int i,len=0;
+  int n_block=(setP->t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK;
+  for(i=0;i<setP->param_len;i++)
+    if(setP->varParam[i]) len++;
+  semRow* rows=(semRow*) Calloc(len,semRow);
+  for(i=0;i<len;i++) {
+    rows[i].params=(Param*) Calloc(setP->t_samp,Param);
+    rows[i].Wstar=doubleMatrix(setP->t_samp,5);
+    rows[i].partial=doubleMatrix(n_block,setP->suffstat_len+1);
+  }
+  return rows;
+}
+
+void freeSemRows(semRow* rows, setParam* setP) {
+  int i,len=0;
+  for(i=0;i<setP->param_len;i++)
+    if(setP->varParam[i]) len++;
+  for(i=0;i<len;i++) {
+    Free(rows[i].params);
+    FreeMatrix(rows[i].Wstar,setP->t_samp);
+    FreeMatrix(rows[i].partial,(setP->t_samp+ESTEP_BLOCK-1)/ESTEP_BLOCK);
+  }
+  Free(rows);
+}
+
 /**
  * input: optTheta,pdTheta,params,Rmat
  * mutate/output: matrices Rmat and Rmat_old (dimensions of param_len x param_len)
  * optTheta is optimal theta
  * pdTheta is current theta
  * Rmat_old contains the input Rmat
+ * rows: buffers from newSemRows
+ * The rows not done yet are independent given optTheta and pdTheta: each
+ * gets its own copy of setP and of the records, and their E-steps run
+ * concurrently, one row per thread.  Everything that calls into R (setting
+ * up the parameters, reporting, the M-step) stays on the main thread.
  */
- void ecoSEM(double* optTheta, double* pdTheta, Param* params, double Rmat_old[7][7], double Rmat[7][7]) {
+void ecoSEM(double* optTheta, double* pdTheta, Param* params, double Rmat_old[7][7], double Rmat[7][7], semRow* rows) {
   //assume we have optTheta, ie \hat{phi}
   //pdTheta is phi^{t+1}
-  int i,j,verbose,len,param_len;
-  setParam setP_sem=*(params[0].setP);
-  param_len=setP_sem.param_len;
-  double *SuffSem=doubleArray(setP_sem.suffstat_len+1); //sufficient stats
-  double phiTI[param_len]; //phi^t_i
-  double phiTp1I[param_len]; //phi^{t+1}_i
+  int i,j,k,verbose,len,param_len,n_todo,n_threads;
+  setParam* setP=params[0].setP;
+  semRow* row;
+  int todo[7]; //rows not done yet
+  param_len=setP->param_len;
   double t_optTheta[param_len]; //transformed optimal
   double t_phiTI[param_len]; //transformed phi^t_i
   double t_phiTp1I[param_len]; //transformed phi^{t+1}_i
-  Param* params_sem=(Param*) Calloc(params->setP->t_samp,Param);
-  verbose=setP_sem.verbose;
+  verbose=setP->verbose;
   //determine length of R matrix
   len=0;
   for(j=0; j<param_len;j++)
-    if(setP_sem.varParam[j]) len++;
+    if(setP->varParam[j]) len++;
 
   //first, save old Rmat
   for(i=0;i<len;i++)
     for(j=0;j<len;j++)
       Rmat_old[i][j]=Rmat[i][j];
 
+  n_todo=0;
   for(i=0;i<len;i++) {
-    if (!setP_sem.semDone[i]) { //we're not done with this row
-      //step 1: set phi^t_i
-      if (verbose>=2) Rprintf("Theta(%d):",(i+1));
-      int switch_index_ir=0; int switch_index_it;
-      for(j=0;j<param_len;j++) {
-        if (!setP_sem.varParam[j]) //const
-          phiTI[j]=optTheta[j];
-        else {
-          if (i==switch_index_ir) {
-            phiTI[j]=pdTheta[j]; //current value
-            switch_index_it=j;
-          }
-          else phiTI[j]=optTheta[j]; //optimal value
-          switch_index_ir++;
-        }
-        if (verbose>=2) Rprintf(" %5g ", phiTI[j]);
-      }
-      //if (setP_sem.fixedRho) {
-      //  phiTI[len-1]=pdTheta[len-1];
-      //  phiTp1I[len-1]=pdTheta[len-1];
-      // if (verbose>=2) Rprintf(" %5g ", phiTI[len-1]);
-      //}
-      if (verbose>=2) Rprintf("\n");
-      for(j=0;j<param_len;j++) phiTp1I[j]=phiTI[j]; //init next iteration
-
-      //step 2: run an E-step and an M-step with phi^t_i
-      //initialize params
-      if (!setP_sem.ncar) {
-        for(j=0;j<setP_sem.t_samp;j++) {
-          params_sem[j].setP=&setP_sem;
-          params_sem[j].caseP=params[j].caseP;
-          params_sem[j].caseP.mu[0] = phiTI[0];
-          params_sem[j].caseP.mu[1] = phiTI[1];
-        }
-        setP_sem.Sigma[0][0] = phiTI[2];
-        setP_sem.Sigma[1][1] = phiTI[3];
-        setP_sem.Sigma[0][1] = phiTI[4]*sqrt(phiTI[2]*phiTI[3]);
-        setP_sem.Sigma[1][0] = setP_sem.Sigma[0][1];
-        dinv2D((double*)(&(setP_sem.Sigma[0][0])), 2, (double*)(&(setP_sem.InvSigma[0][0])), "SEM: CAR init ");
-      }
+    if (setP->semDone[i]) { //keep row the same
+      for(j = 0; j<len; j++)
+        Rmat[i][j]=Rmat_old[i][j];
+      continue;
+    }
+    row=&rows[i];
+    //step 1: set phi^t_i
+    if (verbose>=2) Rprintf("Theta(%d):",(i+1));
+    int switch_index_ir=0;
+    for(j=0;j<param_len;j++) {
+      if (!setP->varParam[j]) //const
+        row->phiTI[j]=optTheta[j];
       else {
-        for(j=0;j<setP_sem.t_samp;j++) {
-          params_sem[j].setP=&setP_sem;
-          params_sem[j].caseP=params[j].caseP;
-        }
-        setP_sem.Sigma3[0][0] = phiTI[4];
-        setP_sem.Sigma3[1][1] = phiTI[5];
-        setP_sem.Sigma3[2][2] = phiTI[3];
-
-        //covariances
-        setP_sem.Sigma3[0][1] = phiTI[8]*sqrt(phiTI[4]*phiTI[5]);
-        setP_sem.Sigma3[0][2] = phiTI[6]*sqrt(phiTI[4]*phiTI[3]);
-        setP_sem.Sigma3[1][2] = phiTI[7]*sqrt(phiTI[5]*phiTI[3]);
-
-        //symmetry
-        setP_sem.Sigma3[1][0] = setP_sem.Sigma3[0][1];
-        setP_sem.Sigma3[2][0] = setP_sem.Sigma3[0][2];
-        setP_sem.Sigma3[2][1] = setP_sem.Sigma3[1][2];
-        if (verbose>=2) {
-          Rprintf("Sigma3: %5g %5g %5g %5g %5g %5g; %5g %5g\n",setP_sem.Sigma3[0][0],setP_sem.Sigma3[0][1],setP_sem.Sigma3[1][1],setP_sem.Sigma3[0][2],setP_sem.Sigma3[1][2],setP_sem.Sigma3[2][2],*(&(setP_sem.Sigma3[0][0])+0),*(&(setP_sem.Sigma3[0][0])+8));
-        }
-        dinv2D((double*)(&(setP_sem.Sigma3[0][0])), 3, (double*)(&(setP_sem.InvSigma3[0][0])),"SEM: NCAR Sig3 init");
-        if (verbose>=2) {
-          Rprintf("Check 1");
-        }
-        if (setP_sem.fixedRho) ncarFixedRhoTransform(phiTI);
-        initNCAR(params_sem,phiTI);
-        if (setP_sem.fixedRho) ncarFixedRhoUnTransform(phiTI);
-        if (verbose>=2) {
-          Rprintf("Check 2");
+        if (i==switch_index_ir) {
+          row->phiTI[j]=pdTheta[j]; //current value
+          row->index=j;
         }
+        else row->phiTI[j]=optTheta[j]; //optimal value
+        switch_index_ir++;
       }
+      if (verbose>=2) Rprintf(" %5g ", row->phiTI[j]);
+    }
+    if (verbose>=2) Rprintf("\n");
+
+    //initialize the row's copy of params with phi^t_i
+    row->setP=*setP;
+    row->setP.pdTheta=row->phiTI;
+    row->setP.calcLoglik=0; //the loglik of the rows is not used
+    row->setP.accel=0;
+    row->setP.lazy=NULL;
+    for(j=0;j<setP->t_samp;j++) {
+      row->params[j].setP=&(row->setP);
+      row->params[j].caseP=params[j].caseP;
+    }
+    setTheta(row->params,row->phiTI);
+    todo[n_todo++]=i;
+  }
 
-      //if (verbose>=2) {
-      //  Rprintf("Sigma: %5g %5g %5g %5g\n",setP_sem.Sigma[0][0],setP_sem.Sigma[0][1],setP_sem.Sigma[1][0],setP_sem.Sigma[1][1]);
-      //}
-
-      ecoEStep(params_sem, SuffSem);
-      if (!params[0].setP->ncar)
-        ecoMStep(SuffSem,phiTp1I,params_sem);
-      else
-        ecoMStepNCAR(SuffSem,phiTp1I,params_sem);
-
-      //step 3: create new R matrix row
-      transformTheta(phiTp1I,t_phiTp1I,setP_sem.param_len,&setP_sem);
-      transformTheta(optTheta,t_optTheta,setP_sem.param_len,&setP_sem);
-      transformTheta(phiTI,t_phiTI,setP_sem.param_len,&setP_sem);
-      /*if (verbose>=2) {
-        Rprintf("T+1:");
-        for (j=0;j<param_len;j++) Rprintf(" %5g ", phiTp1I[j]);
-        Rprintf("\nOpt:");
-        for (j=0;j<param_len;j++) Rprintf(" %5g ", optTheta[j]);
-        Rprintf("\n 2nd item: %5g %5g %5g %5g", t_phiTp1I[2], t_optTheta[2], t_phiTI[switch_index_it], t_optTheta[switch_index_it]);
-      }*/
-      int index_jr=0;
-      for(j = 0; j<param_len; j++) {
-        if (setP_sem.varParam[j]) {
-          Rmat[i][index_jr]=(t_phiTp1I[j]-t_optTheta[j])/(t_phiTI[switch_index_it]-t_optTheta[switch_index_it]);
-          index_jr++;
-        }
-      }
+  //step 2: run the E-steps with phi^t_i
+  n_threads=nThreads(setP->n_threads);
+  if (n_threads>n_todo) n_threads=n_todo;
+#pragma omp parallel for private(row) schedule(dynamic) num_threads(n_threads) if(n_threads>1)
+  for(k=0;k<n_todo;k++) {
+    row=&rows[todo[k]];
+    ecoEStepWork(row->params,row->suff,row->Wstar,row->partial);
+  }
 
-      //step 4: check for difference
-      params[0].setP->semDone[i]=closeEnough((double*)Rmat[i],(double*)Rmat_old[i],len,sqrt(params[0].setP->convergence));
+  transformTheta(optTheta,t_optTheta,param_len,setP);
+  for(k=0;k<n_todo;k++) {
+    i=todo[k];
+    row=&rows[i];
+    ecoEStepReport(row->params,row->Wstar);
 
+    //step 3: M-step, and create new R matrix row
+    for(j=0;j<param_len;j++) row->phiTp1I[j]=row->phiTI[j]; //init next iteration
+    if (!setP->ncar)
+      ecoMStep(row->suff,row->phiTp1I,row->params);
+    else
+      ecoMStepNCAR(row->suff,row->phiTp1I,row->params);
+
+    transformTheta(row->phiTp1I,t_phiTp1I,param_len,setP);
+    transformTheta(row->phiTI,t_phiTI,param_len,setP);
+    int index_jr=0;
+    for(j = 0; j<param_len; j++) {
+      if (setP->varParam[j]) {
+        Rmat[i][index_jr]=(t_phiTp1I[j]-t_optTheta[j])/(t_phiTI[row->index]-t_optTheta[row->index]);
+        index_jr++;
+      }
     }
-    else { //keep row the same
-      for(j = 0; j<len; j++)
-        Rmat[i][j]=Rmat_old[i][j];
-    }
+
+    //step 4: check for difference
+    setP->semDone[i]=closeEnough((double*)Rmat[i],(double*)Rmat_old[i],len,sqrt(setP->convergence));
   }
+
   if(verbose>=1) {
     for(i=0;i<len;i++) {
-      Rprintf("\nR Matrix row %d (%s): ", (i+1), (params[0].setP->semDone[i]) ? "    Done" : "Not done");
+      Rprintf("\nR Matrix row %d (%s): ", (i+1), (setP->semDone[i]) ? "    Done" : "Not done");
       for(j=0;j<len;j++) {
         Rprintf(" %5.2f ",Rmat[i][j]);
       }
     }
     Rprintf("\n\n");
   }
-  Free(SuffSem);
-  Free(params_sem);
 }
 
 
 
+/**
+ * Sets up a general record from its (X, Y)
+ * mutates: param->caseP
+ */
+void initRecord(Param* param, double X, double Y) {
+  caseParam* caseP=&(param->caseP);
+  caseP->dataType=DPT_General;
+  //fix X edge cases
+  caseP->X=(X >= 1) ? .9999 : ((X <= 0) ? 0.0001 : X);
+  //fix Y edge cases
+  caseP->Y=(Y >= 1) ? .9999 : ((Y <= 0) ? 0.0001 : Y);
+  caseP->nodes=NULL;
+  caseP->weight=1;
+  //the bounds only depend on (X,Y)
+  setBounds(param);
+}
+
 /**
  * Read in the data set and population params
  * inputs:
@@ -1148,14 +1702,23 @@ void initCCAR(Param* params, double* pdTheta) {
       params[i].caseP.data[j] = pdX[itemp++];
     }
 
-  for (i = 0; i < n_samp; i++) {
-    params[i].caseP.dataType=DPT_General;
-    params[i].caseP.X=params[i].caseP.data[0];
-    params[i].caseP.Y=params[i].caseP.data[1];
-    //fix X edge cases
-    params[i].caseP.X=(params[i].caseP.X >= 1) ? .9999 : ((params[i].caseP.X <= 0) ? 0.0001 : params[i].caseP.X);
-    //fix Y edge cases
-    params[i].caseP.Y=(params[i].caseP.Y >= 1) ? .9999 : ((params[i].caseP.Y <= 0) ? 0.0001 : params[i].caseP.Y);
+  for (i = 0; i < n_samp; i++)
+    initRecord(&(params[i]), params[i].caseP.data[0], params[i].caseP.data[1]);
+
+  /* fixed-rule quadrature: the node values are theta-independent, so compute them once */
+  if (setP->quadNodes>0) {
+    int n_node=setP->quadNodes, n_cached=0;
+    double *t_node=doubleArray(n_node), *w_node=doubleArray(n_node), *cache;
+    for (i = 0; i < n_samp; i++)
+      if (params[i].caseP.Y<.990 && params[i].caseP.Y>.010) n_cached++;
+    cache=(double*) R_alloc(n_cached*5*n_node, sizeof(double));
+    gaussLegendre(n_node,0.00001,.99999,t_node,w_node);
+    for (i = 0; i < n_samp; i++)
+      if (params[i].caseP.Y<.990 && params[i].caseP.Y>.010) {
+        setQuadNodes(&(params[i]),t_node,w_node,n_node,cache);
+        cache+=5*n_node;
+      }
+    Free(t_node); Free(w_node);
   }
 
   /*read the survey data */
@@ -1165,6 +1728,8 @@ void initCCAR(Param* params, double* pdTheta) {
     for (i=n_samp; i<n_samp+s_samp; i++) {
       dtemp=sur_W[itemp++];
       params[i].caseP.dataType=DPT_Survey;
+      params[i].caseP.nodes=NULL;
+      params[i].caseP.weight=1;
       if (j<n_dim) {
         params[i].caseP.W[j]=(dtemp == 1) ? .9999 : ((dtemp==0) ? .0001 : dtemp);
         params[i].caseP.Wstar[j]=logit(params[i].caseP.W[j],"Survey read");
@@ -1344,13 +1909,16 @@ void ncarFixedRhoTransform(double* pdTheta) {
 
 /**
  * Input transformed theta, loglikelihood, iteration
+ * (the E-steps saved so far are taken from setP)
  * Mutates: history_full
  **/
-void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double history_full[][10]) {
+void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double history_full[][HIST_COLS]) {
   int len=setP->param_len;
   int j;
   for(j=0;j<len;j++)
     history_full[iter][j]=t_pdTheta[j];
+  history_full[iter][len]=0;
+  history_full[iter][len+1]=setP->estepSaved;
   if (iter>0) history_full[iter-1][len]=loglik;
 }
 
@@ -1388,9 +1956,7 @@ void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp,
   int n_step=5000;    /* The default size of grid step */
   int ndraw=10000;
   int trapod=0;       /* 1 if use trapozodial ~= in numer. int.*/
-  int *n_grid=intArray(n_samp);                /* grid size */
-  double **W1g=doubleMatrix(n_samp, n_step);   /* grids for W1 */
-  double **W2g=doubleMatrix(n_samp, n_step);   /* grids for W2 */
+  gridTable *grid;                             /* grids */
   double *vtemp=doubleArray(n_dim);
   int *mflag=intArray(n_step);
   double *prob_grid=doubleArray(n_step);
@@ -1409,7 +1975,7 @@ void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp,
     for(j=0;j<n_dim;j++)
       X[i][j]=params[i].caseP.data[j];
 
-  GridPrep(W1g, W2g, (double**) params[i].caseP.data, (double*)&maxW1, (double*)&minW1, n_grid, n_samp, n_step);
+  grid=GridPrep((double**) params[i].caseP.data, (double*)&maxW1, (double*)&minW1, n_samp, n_step);
 
     for (i=0; i<n_step; i++) {
     mflag[i]=0;
@@ -1419,18 +1985,19 @@ void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp,
   //update W, Wstar given mu, Sigma in regular areas
   for (i=0;i<n_samp;i++){
     if ( params[i].caseP.Y!=0 && params[i].caseP.Y!=1 ) {
+      double *W1gi=grid->W1g+grid->start[i], *W2gi=grid->W2g+grid->start[i];
       // project BVN(mu, Sigma) on the inth tomo line
       dtemp=0;
-      for (j=0;j<n_grid[i];j++){
-        vtemp[0]=log(W1g[i][j])-log(1-W1g[i][j]);
-        vtemp[1]=log(W2g[i][j])-log(1-W2g[i][j]);
+      for (j=0;j<gridSize(grid, i);j++){
+        vtemp[0]=log(W1gi[j])-log(1-W1gi[j]);
+        vtemp[1]=log(W2gi[j])-log(1-W2gi[j]);
         prob_grid[j]=dMVN(vtemp, params[i].caseP.mu, (double**)(params[i].setP->InvSigma), 2, 1) -
-          log(W1g[i][j])-log(W2g[i][j])-log(1-W1g[i][j])-log(1-W2g[i][j]);
+          log(W1gi[j])-log(W2gi[j])-log(1-W1gi[j])-log(1-W2gi[j]);
         prob_grid[j]=exp(prob_grid[j]);
         dtemp+=prob_grid[j];
         prob_grid_cum[j]=dtemp;
       }
-      for (j=0;j<n_grid[i];j++){
+      for (j=0;j<gridSize(grid, i);j++){
         prob_grid_cum[j]/=dtemp; //standardize prob.grid
       }
       // MC numerical integration, compute E(W_i|Y_i, X_i, theta)
@@ -1442,29 +2009,29 @@ void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp,
       itemp=1;
 
       for (k=0; k<ndraw; k++){
-        j=findInterval(prob_grid_cum, n_grid[i],
+        j=findInterval(prob_grid_cum, gridSize(grid, i),
 		      (double)(1+k)/(ndraw+1), 1, 1, itemp, mflag);
         itemp=j-1;
 
 
-        if ((W1g[i][j]==0) || (W1g[i][j]==1))
-          Rprintf("W1g%5d%5d%14g", i, j, W1g[i][j]);
-        if ((W2g[i][j]==0) || (W2g[i][j]==1))
-          Rprintf("W2g%5d%5d%14g", i, j, W2g[i][j]);
+        if ((W1gi[j]==0) || (W1gi[j]==1))
+          Rprintf("W1g%5d%5d%14g", i, j, W1gi[j]);
+        if ((W2gi[j]==0) || (W2gi[j]==1))
+          Rprintf("W2g%5d%5d%14g", i, j, W2gi[j]);
 
         if (j==0 || trapod==0) {
-          W[i][0]=W1g[i][j];
-          W[i][1]=W2g[i][j];
+          W[i][0]=W1gi[j];
+          W[i][1]=W2gi[j];
         }
         else if (j>=1 && trapod==1) {
           if (prob_grid_cum[j]!=prob_grid_cum[(j-1)]) {
             dtemp1=((double)(1+k)/(ndraw+1)-prob_grid_cum[(j-1)])/(prob_grid_cum[j]-prob_grid_cum[(j-1)]);
-            W[i][0]=dtemp1*(W1g[i][j]-W1g[i][(j-1)])+W1g[i][(j-1)];
-            W[i][1]=dtemp1*(W2g[i][j]-W2g[i][(j-1)])+W2g[i][(j-1)];
+            W[i][0]=dtemp1*(W1gi[j]-W1gi[(j-1)])+W1gi[(j-1)];
+            W[i][1]=dtemp1*(W2gi[j]-W2gi[(j-1)])+W2gi[(j-1)];
           }
           else if (prob_grid_cum[j]==prob_grid_cum[(j-1)]) {
-            W[i][0]=W1g[i][j];
-            W[i][1]=W2g[i][j];
+            W[i][0]=W1gi[j];
+            W[i][1]=W2gi[j];
           }
         }
         temp0=log(W[i][0])-log(1-W[i][0]);
@@ -1505,8 +2072,8 @@ void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp,
   for(j=0; j<5; j++)
     suff[j]=suff[j]/t_samp;
 
-  Free(n_grid);Free(vtemp);Free(mflag);Free(prob_grid);Free(prob_grid_cum);
-  FreeMatrix(W1g,n_samp);FreeMatrix(W2g,n_samp);FreeMatrix(X,n_samp);
+  FreeGrid(grid);Free(vtemp);Free(mflag);Free(prob_grid);Free(prob_grid_cum);
+  FreeMatrix(X,n_samp);
   FreeMatrix(W,t_samp);FreeMatrix(Wstar,t_samp);
 
 }
@@ -8,7 +8,10 @@
 #include "subroutines.h"
 #include "rand.h"
 #include "bayes.h"
+#include "density.h"
 #include "sample.h"
+#include "diagnostic.h"
+#include "drawfile.h"
 
 /* Normal Parametric Model for 2x2 Tables with Contextual Effects */
 void cBaseecoX(
@@ -51,8 +54,17 @@ void cBaseecoX(
 
 	       /* flags */
 	       int *parameter,   /* 1 if save population parameter */
-	       int *Grid,        /* 1 if Grid algorithm is used; 0 for
-				    Metropolis */
+	       int *Grid,        /* how W is drawn: 0 for Metropolis, 1 for
+				    the grid, 2 for slice sampling */
+	       int *pin_step,    /* Grid: grid points per unit length of W1 */
+	       int *pin_threads, /* most threads to use */
+	       int *Wsummary,    /* 1 to keep summaries of W instead of its draws */
+	       double *pdCI,     /* Wsummary: probabilities of the two quantiles */
+	       int *pin_agg,     /* Wsummary: number of sets of weights of the
+				    aggregate W's */
+	       double *pdAggW,   /* Wsummary: the weights, see summaryDrawW */
+	       char **Wfile,     /* if not "", the draws of W go to this file
+				    (see drawfile.c) instead of pdSW1, pdSW2 */
 	       
 	       /* storage for Gibbs draws of mu/sigmat*/
 	       double *pdSMu0, double *pdSMu1, double *pdSMu2, 
@@ -60,7 +72,15 @@ void cBaseecoX(
 	       double *pdSSig11, double *pdSSig12, double *pdSSig22,           
 
 	       /* storage for Gibbs draws of W*/
-	       double *pdSW1, double *pdSW2
+	       double *pdSW1, double *pdSW2,
+
+	       /* Wsummary: mean, sd and the two quantiles of W1 and W2 of
+		  each unit, and the aggregate W's of each kept draw */
+	       double *pdWSum, double *pdSAgg,
+
+	       /* Metropolis: acceptance rate of each precinct; NA where W
+		  is not drawn by Metropolis */
+	       double *pdAccept
 	       ){	
    
   /* some integers */
@@ -71,7 +91,7 @@ void cBaseecoX(
   int t_samp = n_samp+s_samp+x1_samp+x0_samp;  /* total sample size */
   int nth = *pinth;  
   int n_dim = 2;             /* dimension */
-  int n_step = 1000;         /* 1/The default size of grid step */  
+  int n_step = *pin_step;    /* 1/The size of grid step */  
 
   /* prior parameters */
   double tau0 = *pdtau0;   
@@ -86,29 +106,39 @@ void cBaseecoX(
   double **S_W = doubleMatrix(s_samp, n_dim+1);     /* known W1, W2, X */
   double **S_Wstar = doubleMatrix(s_samp, n_dim+1); /* logit
 						       transformed S_W */
-  /* grids */
-  double **W1g = doubleMatrix(n_samp, n_step);
-  double **W2g = doubleMatrix(n_samp, n_step);
-  int *n_grid = intArray(n_samp);           /* grid size */
+  /* grids, or the W's of the Metropolis sampler as arrays */
+  gridTable *grid = NULL;
+  mhLine *mh = NULL;
+  int n_unit = n_samp+x1_samp+x0_samp;      /* units whose W's are kept */
+  drawSummary *sum = NULL;                  /* Wsummary: the W's kept */
+  drawFile *wfile = NULL;                   /* Wfile: the W's written */
+  drawWriter *wout = NULL;
   
   /* ordinary model variables */
   double *mu = doubleArray(n_dim+1);
   double **Sigma = doubleMatrix(n_dim+1,n_dim+1);
   double **InvSigma = doubleMatrix(n_dim+1,n_dim+1);
   
-  /* conditional mean & variance for (W1, W2) given X */
-  double *mu_w = doubleArray(n_dim);
+  /* conditional variance for (W1, W2) given X; the conditional mean
+     depends on the X of each precinct */
   double **Sigma_w = doubleMatrix(n_dim,n_dim);
   double **InvSigma_w = doubleMatrix(n_dim,n_dim);
   
+  /* scratch memory for the samplers, and for each thread of the W updates */
+  Workspace *ws = newWorkspace(WS_SIZE);
+  int n_threads = nThreads(*pin_threads);
+  Workspace **tws = newWorkspaces(n_threads, WS_SIZE);
+  uint64_t seed;                                  /* of the streams of the W updates */
+
   /* misc variables */
   int i, j, k, t, main_loop;   /* used for various loops */
   int itemp, itempS, itempC, itempA;
-  int progress = 1, itempP = ftrunc((double) *n_gen/10);
+  int progress = 1, itempP = ftrunc((double) *n_gen/10), stop = 0;
   double dtemp, dtemp1;
   
   /* get random seed */
   GetRNGstate();
+  seed = rngSeedFromR();
   
   /* priors */
   itemp = 0;
@@ -180,8 +210,16 @@ void cBaseecoX(
   itempC=0; /* control nth draw */
 
   /*** calculate grids ***/
-  if (*Grid)
-    GridPrep(W1g, W2g, X, maxW1, minW1, n_grid, n_samp, n_step);
+  if (*Grid==W_GRID)
+    grid = GridPrep(X, maxW1, minW1, n_samp, n_step);
+  if (*Grid==W_METROPOLIS)
+    mh = MHPrep(X, minW1, maxW1, W, n_samp);
+  if (*Wsummary)
+    sum = newSummary(2*n_unit, pdCI);
+  else if (Wfile[0][0]) {
+    wfile = openDrawFile(Wfile[0], 2, n_unit, 1, (*n_gen-*burn_in)/nth);
+    wout = newDrawWriter(wfile, 0);
+  }
     
   /* starting values of mu and Sigma */
   itemp = 0;
@@ -203,46 +241,82 @@ void cBaseecoX(
     dinv(Sigma_w, n_dim, InvSigma_w);    
 
     /**update W, Wstar given mu, Sigma in regular areas**/
-    for (i=0; i<n_samp; i++){
-      for (j=0; j<n_dim; j++) 
-	mu_w[j]=mu[j]+Sigma[n_dim][j]/Sigma[n_dim][n_dim]*(Wstar[i][2]-mu[n_dim]);
-      if ( X[i][1]!=0 && X[i][1]!=1 ) {
-	if (*Grid)
-	  rGrid(W[i], W1g[i],W2g[i], n_grid[i], mu_w, InvSigma_w,
-		n_dim);
-	else
-	  rMH(W[i], X[i], minW1[i], maxW1[i], mu_w, InvSigma_w, n_dim);
-      } 
-      /*3 compute Wsta_i from W_i*/
-      Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
-      Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
+    /* the W's are independent given mu and Sigma, and are drawn on
+       several threads; W_i uses its own stream for this sweep (the
+       Metropolis sampler one per block of W's, see rMHSweep), so the
+       draws do not depend on the number of threads */
+    if (*Grid!=W_METROPOLIS) {
+#pragma omp parallel for private(j) schedule(static) num_threads(n_threads) if(n_threads>1)
+      for (i=0; i<n_samp; i++){
+	rngStream rng;
+	double mu_w[2];   /* conditional mean of (W1, W2) given X */
+	if ( X[i][1]!=0 && X[i][1]!=1 ) {
+	  for (j=0; j<n_dim; j++) 
+	    mu_w[j]=mu[j]+Sigma[n_dim][j]/Sigma[n_dim][n_dim]*(Wstar[i][2]-mu[n_dim]);
+	  rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+i);
+	  if (*Grid==W_GRID)
+	    rGrid(W[i], grid, i, mu_w, InvSigma_w, &rng, tws[threadNum()]);
+	  else
+	    rSlice(W[i], X[i], minW1[i], maxW1[i], mu_w, InvSigma_w, &rng);
+	  /*3 compute Wsta_i from W_i*/
+	  Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
+	  Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
+	}
+      }
+    }
+    else {
+      /* conditional means of (W1, W2) given X */
+      for (k=0; k<mh->n; k++) {
+	i=mh->idx[k];
+	mh->m1[k]=mu[0]+Sigma[n_dim][0]/Sigma[n_dim][n_dim]*(Wstar[i][2]-mu[n_dim]);
+	mh->m2[k]=mu[1]+Sigma[n_dim][1]/Sigma[n_dim][n_dim]*(Wstar[i][2]-mu[n_dim]);
+      }
+      rMHSweep(mh, mh->m1, mh->m2, 1, InvSigma_w, seed,
+	       (uint64_t)main_loop*t_samp, n_threads, W, Wstar);
     }
   
     /*update W2 given W1, mu and Sigma in x1 homeogeneous areas */
-    if (*x1==1)
+    if (*x1==1) {
+      dtemp1=Sigma_w[1][1]*(1-Sigma_w[0][1]*Sigma_w[0][1]/(Sigma_w[0][0]*Sigma_w[1][1]));
+      dtemp1=sqrt(dtemp1);
+#pragma omp parallel for private(j,dtemp) schedule(static) num_threads(n_threads) if(n_threads>1)
       for (i=0; i<x1_samp; i++) {
+	rngStream rng;
+	double mu_w[2];
+	for (j=0; j<n_dim; j++) 
+	  mu_w[j]=mu[j]+Sigma[n_dim][j]/Sigma[n_dim][n_dim]*(Wstar[n_samp+i][2]-mu[n_dim]);
+	rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+n_samp+i);
 	dtemp=mu_w[1]+Sigma_w[0][1]/Sigma_w[0][0]*(Wstar[n_samp+i][0]-mu_w[0]);
-	dtemp1=Sigma_w[1][1]*(1-Sigma_w[0][1]*Sigma_w[0][1]/(Sigma_w[0][0]*Sigma_w[1][1]));
-	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+i][1]=rnorm(dtemp, dtemp1);
+	Wstar[n_samp+i][1]=dtemp+dtemp1*rngNorm(&rng);
 	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
       }
+    }
     
     /*update W1 given W2, mu and Sigma in x0 homeogeneous areas */
-    if (*x0==1)
+    if (*x0==1) {
+      dtemp1=Sigma_w[0][0]*(1-Sigma_w[0][1]*Sigma_w[0][1]/(Sigma_w[0][0]*Sigma_w[1][1]));
+      dtemp1=sqrt(dtemp1);
+#pragma omp parallel for private(j,dtemp) schedule(static) num_threads(n_threads) if(n_threads>1)
       for (i=0; i<x0_samp; i++) {
+	rngStream rng;
+	double mu_w[2];
+	for (j=0; j<n_dim; j++) 
+	  mu_w[j]=mu[j]+Sigma[n_dim][j]/Sigma[n_dim][n_dim]*(Wstar[n_samp+x1_samp+i][2]-mu[n_dim]);
+	rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+n_samp+x1_samp+i);
 	dtemp=mu_w[0]+Sigma_w[0][1]/Sigma_w[1][1]*(Wstar[n_samp+x1_samp+i][1]-mu_w[1]);
-	dtemp1=Sigma_w[0][0]*(1-Sigma_w[0][1]*Sigma_w[0][1]/(Sigma_w[0][0]*Sigma_w[1][1]));
-	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+x1_samp+i][0]=rnorm(dtemp, dtemp1);
+	Wstar[n_samp+x1_samp+i][0]=dtemp+dtemp1*rngNorm(&rng);
 	W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
       }
+    }
     
     /* update mu, Sigma given wstar using effective sample of Wstar */
-    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim+1);
+    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim+1, NULL, ws);
     
     /*store Gibbs draw after burn-in and every nth draws */      
-    R_CheckUserInterrupt();
+    if (checkInterrupt()) {
+      stop = 1;
+      break;
+    }
     if (main_loop>=*burn_in){
       itempC++;
       if (itempC==nth){
@@ -255,12 +329,18 @@ void cBaseecoX(
 	pdSSig11[itempA]=Sigma[1][1];
 	pdSSig12[itempA]=Sigma[1][2];
 	pdSSig22[itempA]=Sigma[2][2];
+	if (sum)
+	  summaryDrawW(sum, W, n_unit, pdAggW, *pin_agg,
+		       pdSAgg+itempA*2*(*pin_agg), n_threads);
+	else if (wout)
+	  drawPutW(wout, W);
+	else
+	  for(i=0; i<n_unit; i++){
+	    pdSW1[itempS]=W[i][0];
+	    pdSW2[itempS]=W[i][1];
+	    itempS++;
+	  }
 	itempA++;
-	for(i=0; i<(n_samp+x1_samp+x0_samp); i++){
-	  pdSW1[itempS]=W[i][0];
-	  pdSW2[itempS]=W[i][1];
-	  itempS++;
-	}
 	itempC=0;
       }
     } /*end of stroage *burn_in*/
@@ -272,10 +352,24 @@ void cBaseecoX(
       }
   } /*end of MCMC for normal */ 
   
-  if(*verbose)
+  if(*verbose && !stop)
     Rprintf("100 percent done.\n");
 
 
+  /** acceptance rates of the Metropolis sampler **/
+  for (i=0; i<n_samp+x1_samp+x0_samp; i++)
+    pdAccept[i] = NA_REAL;
+  if (mh) {
+    for (k=0; k<mh->n; k++)
+      pdAccept[mh->idx[k]]=0;
+    MHAcceptRate(mh, *n_gen, pdAccept);
+  }
+
+  if (sum) {
+    summaryWrite(&sum, 1, pdWSum);
+    FreeSummary(sum);
+  }
+
   /** write out the random seed **/
   PutRNGstate();
 
@@ -283,17 +377,25 @@ void cBaseecoX(
   FreeMatrix(X, n_samp);
   FreeMatrix(W, t_samp);
   FreeMatrix(Wstar, t_samp);
-  free(n_grid);
   FreeMatrix(S0, n_dim+1);
-  FreeMatrix(W1g, n_samp);
-  FreeMatrix(W2g, n_samp);
+  if (grid) FreeGrid(grid);
+  if (mh) FreeMH(mh);
   FreeMatrix(S_W, s_samp);
   FreeMatrix(S_Wstar, s_samp);
   free(mu);
   FreeMatrix(Sigma, n_dim+1);
   FreeMatrix(InvSigma, n_dim+1);
-  free(mu_w);
   FreeMatrix(Sigma_w, n_dim);
   FreeMatrix(InvSigma_w, n_dim);
+  FreeWorkspace(ws);
+  FreeWorkspaces(tws, n_threads);
+  if (wfile) {
+    closeDrawWriter(wout);
+    closeDrawFile(wfile);
+  }
+
+  if (stop)
+    error("interrupted by the user\n");
+
 } /* main */
 
@@ -4,11 +4,14 @@
 #include <math.h>
 #include <Rmath.h>
 #include <R.h>
+#include <Rinternals.h>
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
 #include "bayes.h"
 #include "sample.h"
+#include "drawfile.h"
+#include "dpcluster.h"
 
 void cDPecoX(
 	    /*data input */
@@ -49,20 +52,30 @@ void cDPecoX(
 	    double *minW1, double *maxW1,
 
 	    /* flags */
-	    int *parameter,   /* 1 if save population parameter */
-	    int *Grid,        /* 1 if Grid algorithm is used; 0 for
-				 Metropolis */
+	    int *parameter,   /* 1 if save population parameter: the
+				 clusters kept, see kept */
+	    int *Grid,        /* how W is drawn: 0 for Metropolis, 1 for
+				 the grid, 2 for slice sampling */
+	    int *pin_step,    /* Grid: grid points per unit length of W1 */
+	    int *pin_trunc,   /* 0 for the Polya urn, or the number of
+				 sticks of the blocked Gibbs sampler */
+	    int *pin_sm,      /* Polya urn: split-merge moves per iteration */
+	    int *pin_threads, /* most threads to use */
+	    char **Wfile,     /* if not "", the draws of W go to this file
+				 (see drawfile.c) instead of pdSW1, pdSW2 */
            
-	    /* storage for Gibbs draws of mu/sigmat*/
-	    double *pdSMu0, double *pdSMu1, double *pdSMu2, 
-	    double *pdSSig00, double *pdSSig01, double *pdSSig02, 
-	    double *pdSSig11, double *pdSSig12, double *pdSSig22,          
 	    /* storage for Gibbs draws of W*/
 	    double *pdSW1, double *pdSW2,
 	    /* storage for Gibbs draws of alpha */
 	    double *pdSa,
 	    /* storage for nstar at each Gibbs draw*/
-	    int *pdSn
+	    int *pdSn,
+	    /* split-merge moves: splits proposed and accepted, merges
+	       proposed and accepted */
+	    double *pdSM,
+	    /* with parameter, the clusters kept (see dpKeptValue);
+	       otherwise R_NilValue */
+	    SEXP *kept
  	    ){	   
    /*some integers */
   int n_samp = *pin_samp;    /* sample size */
@@ -72,7 +85,8 @@ void cDPecoX(
   int t_samp = n_samp+x1_samp+x0_samp+s_samp; /* total sample size */
   int nth = *pinth;          /* keep every nth draw */ 
   int n_dim = 2;             /* dimension */
-  int n_step=1000;           /* The default size of grid step */  
+  int n_step=*pin_step;      /* 1/The size of grid step */  
+  int L = *pin_trunc;        /* sticks of the blocked sampler */
  
  /*prior parameters */
   double tau0 = *pdtau0;     /* prior scale */ 
@@ -91,15 +105,19 @@ void cDPecoX(
 						     transformed S_W*/
 
   /* grids */
-  double **W1g = doubleMatrix(n_samp, n_step); /* grids for W1 */
-  double **W2g = doubleMatrix(n_samp, n_step); /* grids for W2 */
-  int *n_grid = intArray(n_samp);              /* grids size */
-  
+  gridTable *grid = NULL;                      /* grids */
+
+  /* Wfile: the W's written */
+  drawFile *wfile = NULL;
+  drawWriter *wout = NULL;
+
+  /* the clusters kept */
+  dpKept *keep = NULL;
+
   /* Model parameters */
-  /* Dirichlet variables */
-  double **mu = doubleMatrix(t_samp,(n_dim+1));                /* mean matrix  */
-  double ***Sigma = doubleMatrix3D(t_samp,(n_dim+1),(n_dim+1));    /*covarince matrix*/
-  double ***InvSigma = doubleMatrix3D(t_samp,(n_dim+1),(n_dim+1)); /* inv of Sigma*/
+  /* Dirichlet variables: the distinct values, and who has which */
+  dpTable *tab = newDPTable(L ? L : t_samp, n_dim+1, mu0, tau0, nu0, S0);
+  double **mu = tab->mu, ***Sigma = tab->Sigma, ***InvSigma = tab->InvSigma;
 
   /*conditional distribution parameter */
   double **Sigma_w=doubleMatrix(n_dim,n_dim);
@@ -108,19 +126,10 @@ void cDPecoX(
   
   int nstar;		           /* # clusters with distict theta values */
   int *C = intArray(t_samp);       /* vector of cluster membership */
-  double *q = doubleArray(t_samp); /* Weights of posterior of Dirichlet */
-  double *qq = doubleArray(t_samp); /* cumulative weight vector of q */
   double **S_tvt = doubleMatrix((n_dim+1),(n_dim+1)); /* S paramter for BVT in q0 */
 
-  /* variables defined in remixing step: cycle through all clusters */
-  double **Wstarmix = doubleMatrix(t_samp,(n_dim+1));  /*data matrix used */ 
-  double *mu_mix = doubleArray((n_dim+1));             /*updated MEAN parameter */
-  double **Sigma_mix = doubleMatrix((n_dim+1),(n_dim+1));  /*updated VAR parameter */
-  double **InvSigma_mix = doubleMatrix((n_dim+1),(n_dim+1)); /* Inv of Sigma_mix */
-  int nj;                            /* record # of obs in each cluster */
-  int *sortC = intArray(t_samp);     /* record (sorted)original obs id */
-  int *indexC = intArray(t_samp);   /* record  original obs id */
-  int *label = intArray(t_samp);    /* store index values */
+ /* scratch memory for the samplers */
+ Workspace *ws = newWorkspace(WS_SIZE);
 
  /* misc variables */
   int i, j, k, l, main_loop;   /* used for various loops */
@@ -128,15 +137,18 @@ void cDPecoX(
   int itempA=0; /* counter for alpha */
   int itempS=0; /* counter for storage */
   int itempC=0; /* counter to control nth draw */
-  int progress = 1, itempP = ftrunc((double) *n_gen/10);
+  int progress = 1, itempP = ftrunc((double) *n_gen/10), stop = 0;
+  int nomem = 0;                   /* set when out of memory */
   double dtemp, dtemp1, dtemp2;
   double *vtemp = doubleArray((n_dim+1));
   double **mtemp = doubleMatrix((n_dim+1),(n_dim+1)); 
   double **mtemp1 = doubleMatrix((n_dim+1),(n_dim+1)); 
-  double **onedata = doubleMatrix(1, (n_dim+1));
+  double old[3];               /* Wstar of a unit before its update */
 
   /* get random seed */
   GetRNGstate();
+  for (i=0; i<4; i++)
+    pdSM[i]=0;
 
   /* read priors under G0*/
   itemp=0;
@@ -176,6 +188,8 @@ void cDPecoX(
       if (W[(n_samp+i)][0]==0) W[(n_samp+i)][0]=0.0001;
       if (W[(n_samp+i)][0]==1) W[(n_samp+i)][0]=0.9999;
       Wstar[(n_samp+i)][0]=log(W[(n_samp+i)][0])-log(1-W[(n_samp+i)][0]);
+      Wstar[(n_samp+i)][1]=0;   /* drawn in the first iteration */
+      Wstar[(n_samp+i)][2]=log(0.9999/0.0001);
     }
 
   if (*x0==1)
@@ -184,6 +198,8 @@ void cDPecoX(
       if (W[(n_samp+x1_samp+i)][1]==0) W[(n_samp+x1_samp+i)][1]=0.0001;
       if (W[(n_samp+x1_samp+i)][1]==1) W[(n_samp+x1_samp+i)][1]=0.9999;
       Wstar[(n_samp+x1_samp+i)][1]=log(W[(n_samp+x1_samp+i)][1])-log(1-W[(n_samp+x1_samp+i)][1]);
+      Wstar[(n_samp+x1_samp+i)][0]=0;
+      Wstar[(n_samp+x1_samp+i)][2]=log(0.0001/0.9999);
     }
 
   /*read the survey data */
@@ -206,8 +222,16 @@ void cDPecoX(
 
 
   /* Calcualte grids */
-  if (*Grid)
-    GridPrep(W1g,W2g, X, maxW1, minW1, n_grid, n_samp, n_step);
+  if (*Grid==W_GRID)
+    grid = GridPrep(X, maxW1, minW1, n_samp, n_step);
+
+  if (Wfile[0][0]) {
+    wfile = openDrawFile(Wfile[0], 2, n_samp+x1_samp+x0_samp, 1, (*n_gen-*burn_in)/nth);
+    wout = newDrawWriter(wfile, 0);
+  }
+  if (*parameter &&
+      !(keep = newDPKept(n_dim+1, n_samp+x1_samp+x0_samp, (*n_gen-*burn_in)/nth)))
+    stop = nomem = 1;
  
   /* parmeters for Trivaraite t-distribution-unchanged in MCMC */
   for (j=0;j<=n_dim;j++)
@@ -219,36 +243,44 @@ void cDPecoX(
   /*1. Sigma_i under InvWish(nu0, S0^-1) with E(Sigma)=S0/(nu0-3)*/
   /*   InvSigma_i under Wish(nu0, S0^-1 */
   /*2. mu_i|Sigma_i under N(mu0, Sigma_i/tau0) */
-  dinv(S0, (n_dim+1), mtemp);
-
-  for(i=0;i<t_samp;i++){
-    /*draw from wish(nu0, S0^-1) */
-    rWish(InvSigma[i], mtemp, nu0, (n_dim+1));
-    dinv(InvSigma[i], (n_dim+1), Sigma[i]);
-    for (j=0;j<=n_dim;j++)
-      for(k=0;k<=n_dim;k++) mtemp1[j][k]=Sigma[i][j][k]/tau0;
-    rMVN(mu[i], mu0, mtemp1, (n_dim+1));
+  /*   blocked: L sticks of equal weight, and the labels drawn from
+       them */
+  if (L) {
+    dpBlocked(tab, t_samp, nThreads(*pin_threads), NULL, ws);
+    dpRelabel(tab, Wstar, C, t_samp, NULL);
+  }
+  else {
+    /*   or each in a cluster of its own */
+    dinv(S0, (n_dim+1), mtemp);
+
+    for(i=0;i<t_samp;i++){
+      C[i]=k=dpNew(tab);
+      dpJoin(tab, k, Wstar[i]);
+      /*draw from wish(nu0, S0^-1) */
+      rWish(InvSigma[k], mtemp, nu0, (n_dim+1), NULL, ws);
+      dinv(InvSigma[k], (n_dim+1), Sigma[k]);
+      for (j=0;j<=n_dim;j++)
+	for(l=0;l<=n_dim;l++) mtemp1[j][l]=Sigma[k][j][l]/tau0;
+      rMVN(mu[k], mu0, mtemp1, (n_dim+1), NULL, ws);
+      dpSetDens(tab, k);
+    }
   }
- 
-
-  /* initialize the cluster membership */
-  nstar=t_samp;  /* the # of disticnt values */
-  for(i=0;i<t_samp;i++)
-    C[i]=i; /*cluster is from 0...n_samp-1 */
   
   if (*verbose)
     Rprintf("Starting Gibbs Sampler...\n");
 
 
-  for(main_loop=0; main_loop<*n_gen; main_loop++){
+  for(main_loop=0; main_loop<*n_gen && !stop; main_loop++){
     /**update W, Wstar given mu, Sigma only for the unknown W/Wstar**/
     for (i=0; i<t_samp; i++){
+      l=C[i];
+      old[0]=Wstar[i][0]; old[1]=Wstar[i][1]; old[2]=Wstar[i][2];
       for (j=0; j<n_dim; j++) {
-        mu_w[j]=mu[i][j]+Sigma[i][n_dim][j]/Sigma[i][n_dim][n_dim]*(Wstar[i][n_dim]-mu[i][n_dim]);
+        mu_w[j]=mu[l][j]+Sigma[l][n_dim][j]/Sigma[l][n_dim][n_dim]*(Wstar[i][n_dim]-mu[l][n_dim]);
      }
       for (j=0; j<n_dim; j++)
         for (k=0; k<n_dim; k++) {
-          Sigma_w[j][k]=Sigma[i][j][k]-Sigma[i][n_dim][j]/Sigma[i][n_dim][n_dim]*Sigma[i][n_dim][k];
+          Sigma_w[j][k]=Sigma[l][j][k]-Sigma[l][n_dim][j]/Sigma[l][n_dim][n_dim]*Sigma[l][n_dim][k];
 	}
 
       dinv(Sigma_w, n_dim, InvSigma_w);
@@ -260,11 +292,13 @@ void cDPecoX(
         /*1 project BVN(mu_i, Sigma_i) on the inth tomo line */
 	/*2 sample W_i on the ith tomo line */
 
-	if (*Grid)
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu_w, InvSigma_w, n_dim);
+	if (*Grid==W_GRID)
+	  rGrid(W[i], grid, i, mu_w, InvSigma_w, NULL, ws);
+	else if (*Grid==W_SLICE)
+	  rSlice(W[i], X[i], minW1[i], maxW1[i], mu_w, InvSigma_w, NULL);
 	else {
 
-	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu_w, InvSigma_w, n_dim);
+	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu_w, InvSigma_w, n_dim, NULL);
 
 	}
       }	  
@@ -288,95 +322,56 @@ void cDPecoX(
         Wstar[i][0]=norm_rand()*sqrt(dtemp1)+dtemp;
         W[i][0]=exp(Wstar[i][0])/(1+exp(Wstar[i][0]));
       }
+      dpMove(tab, l, old, Wstar[i]);
     }
 
-  /**updating mu, Sigma given Wstar uisng effective sample size t_samp**/
-  for (i=0; i<t_samp; i++){
-    /* generate weight vector q */
-    dtemp=0;
-    for (j=0; j<t_samp; j++){
-      if (j!=i)
-	q[j]=dMVN(Wstar[i], mu[j], InvSigma[j], (n_dim+1), 0);
-      else
-	q[j]=alpha*dMVT(Wstar[i], mu0, S_tvt, (nu0-(n_dim+1)+1), (n_dim+1), 0);
-      dtemp+=q[j];
-      qq[j]=dtemp;    /*compute qq, the cumlative of q*/
-    }
-    /*standardize q and qq */
-    for (j=0; j<t_samp; j++) {
-      qq[j]/=dtemp;
-    }
-    
-    /** draw the configuration parameter **/
-    
-    /* j=i means to draw from posterior baseline */
-    /* j=i' means to replace with i' obs */
-    j=0; dtemp=unif_rand();
-    while (dtemp > qq[j]) j++;
-    /** Dirichlet update Sigma_i, mu_i|Sigma_i **/
-    if (j==i){
-      onedata[0][0] = Wstar[i][0];
-      onedata[0][1] = Wstar[i][1];
-      onedata[0][2] = Wstar[i][2];
-      NIWupdate(onedata, mu[i], Sigma[i], InvSigma[i], mu0, tau0,nu0, S0, 1, n_dim+1);
-      C[i]=nstar;
-      nstar++;
-       }
-       else {
-	 /*1. mu_i=mu_j, Sigma_i=Sigma_j*/
-	 /*2. update C[i]=C[j] */
-	 for(k=0;k<=n_dim;k++) {
-	   mu[i][k]=mu[j][k];
-	   for(l=0;l<=n_dim;l++) {
-	     Sigma[i][k][l]=Sigma[j][k][l];
-	     InvSigma[i][k][l]=InvSigma[j][k][l];
-	   }
-	 }
-	 C[i]=C[j];
-       }
-       sortC[i]=C[i];
-  } /* end of i loop*/
-  /** remixing step using effective sample**/
-  for(i=0;i<t_samp;i++)
-    indexC[i]=i;
-  R_qsort_int_I(sortC, indexC, 1, t_samp);
-
-  nstar=0;
-  i=0;
-  while (i<t_samp){
-    j=sortC[i]; /*saves the first element in a block of same values */
-    nj=0; /* counter for a block of same values */
-
-    /* get data for remixing */
-    while ((sortC[i]==j) && (i<t_samp)) {
-      label[nj]=indexC[i];
-      for (k=0; k<=n_dim; k++) {
-	Wstarmix[nj][k]=Wstar[label[nj]][k];
-      }
-      nj++;
-      i++;
-    } /* i records the current position in IndexC */
-    /* nj records the # of obs in Psimix */
-
-    /** posterior update for mu_mix, Sigma_mix based on Psimix **/
-    NIWupdate(Wstarmix, mu_mix,Sigma_mix, InvSigma_mix, mu0, tau0, nu0, S0, nj, (n_dim+1)); 
-
-    /**update mu, Simgat with mu_mix, Sigmat_mix via label**/
-    for (j=0;j<nj;j++){
-      C[label[j]]=nstar;  /*updating C vector with no gap */
-      for (k=0; k<=n_dim; k++){
-	mu[label[j]][k]=mu_mix[k];
-	for (l=0;l<=n_dim;l++){
-	  Sigma[label[j]][k][l]=Sigma_mix[k][l];
-	  InvSigma[label[j]][k][l]=InvSigma_mix[k][l];
-	}
+  if (!L && main_loop%DP_REFRESH==DP_REFRESH-1)
+    dpRefresh(tab, Wstar, C, t_samp);
+
+  /** blocked: all the labels at once given the sticks, then the
+      parameters of the sticks given their members, and their order **/
+  if (L) {
+    nstar=dpRelabel(tab, Wstar, C, t_samp, NULL);
+    dpRemix(tab, NULL, ws);
+    dpSwapSticks(tab, alpha, NULL);
+  }
+  else {
+    /**updating mu, Sigma given Wstar uisng effective sample size t_samp**/
+    /* each observation in turn leaves its cluster and is put back in one
+       drawn from the urn of the others, or in a new one */
+    for (i=0; i<t_samp; i++){
+      dpLeave(tab, C[i], Wstar[i]);
+      dtemp=log(alpha)+dMVT(Wstar[i], mu0, S_tvt, (nu0-(n_dim+1)+1), (n_dim+1), 1);
+      k=dpDraw(tab, Wstar[i], dtemp, unif_rand());
+
+      /** Dirichlet update Sigma_i, mu_i|Sigma_i **/
+      /* a new cluster: posterior update given Wstar[i] */
+      if (k<0){
+	k=dpNew(tab);
+	dpJoin(tab, k, Wstar[i]);
+	dpUpdate(tab, k, NULL, ws);
       }
-    }
-    nstar++; /*finish update one distinct value*/
-  } /* nstar is the number of distinct values */
+      else
+	dpJoin(tab, k, Wstar[i]);
+      C[i]=k;
+    } /* end of i loop*/
+    /** split-merge moves **/
+    for (j=0; j<*pin_sm; j++)
+      dpSplitMerge(tab, Wstar, C, t_samp, alpha, DP_SCANS, pdSM, NULL, ws);
+    /** remixing step: the parameters of each cluster given its members **/
+    dpRemix(tab, NULL, ws);
+    nstar=tab->nstar; /* nstar is the number of distinct values */
+  }
 
+  /** blocked: the weights of the sticks given their counts and alpha,
+      then alpha given the weights of all L sticks **/
+  if (L) {
+    dpSticks(tab, alpha, NULL);
+    if(*pinUpdate)
+      alpha=dpStickAlpha(tab, a0, b0, NULL);
+  }
   /** updating alpha **/
-  if(*pinUpdate) {
+  else if(*pinUpdate) {
     dtemp1=(double)(alpha+1);
     dtemp2=(double)t_samp;
     dtemp=b0-log(rbeta(dtemp1, dtemp2));
@@ -393,30 +388,32 @@ void cDPecoX(
   }
 
   /*store Gibbs draws after burn_in */
-  R_CheckUserInterrupt();
+  if (checkInterrupt()) {
+    stop = 1;
+    break;
+  }
   if (main_loop>=*burn_in) {
     itempC++;
     if (itempC==nth){
-      if(*pinUpdate) {
+      if(*pinUpdate)
 	pdSa[itempA]=alpha;
-	pdSn[itempA]=nstar;
-	itempA++;
+      /* nstar always: it locates the clusters of each draw */
+      pdSn[itempA]=nstar;
+      itempA++;
+      if (keep && !dpKeep(keep, tab, C)) {
+	stop = nomem = 1;
+	break;
       }
 
       for(i=0; i<(n_samp+x1_samp+x0_samp); i++) {
-	pdSMu0[itempS]=mu[i][0];
-	pdSMu1[itempS]=mu[i][1];
-	pdSMu2[itempS]=mu[i][2];
-	pdSSig00[itempS]=Sigma[i][0][0];
-	pdSSig01[itempS]=Sigma[i][0][1];
-	pdSSig02[itempS]=Sigma[i][0][2];
-	pdSSig11[itempS]=Sigma[i][1][1];
-	pdSSig12[itempS]=Sigma[i][1][2];
-	pdSSig22[itempS]=Sigma[i][2][2];
-	pdSW1[itempS]=W[i][0];
-	pdSW2[itempS]=W[i][1];
+	if (!wout) {
+	  pdSW1[itempS]=W[i][0];
+	  pdSW2[itempS]=W[i][1];
+	}
 	itempS++;
       }
+      if (wout)
+	drawPutW(wout, W);
       itempC=0;
     }
   }
@@ -428,7 +425,7 @@ void cDPecoX(
     }
   } /*end of MCMC for DP*/
 
-if (*verbose)
+if (*verbose && !stop)
      Rprintf("100 percent done.\n");
      
      /** write out the random seed **/
@@ -437,35 +434,57 @@ if (*verbose)
     /* Freeing the memory */
      FreeMatrix(S0, n_dim+1);  
      FreeMatrix(X, n_samp);
+     if (wfile) {
+       closeDrawWriter(wout);
+       closeDrawFile(wfile);
+     }
      FreeMatrix(W, t_samp);
      FreeMatrix(Wstar, t_samp);
      FreeMatrix(S_W, s_samp);
      FreeMatrix(S_Wstar, s_samp);
-  FreeMatrix(W1g, n_samp);
-  FreeMatrix(W2g, n_samp);
-  free(n_grid);
-  FreeMatrix(mu, t_samp);
-  Free3DMatrix(Sigma, t_samp,n_dim+1);
-  Free3DMatrix(InvSigma, t_samp, n_dim+1);
+  if (grid) FreeGrid(grid);
+  FreeDPTable(tab);
   free(mu_w);
   FreeMatrix(Sigma_w, n_dim);
   FreeMatrix(InvSigma_w, n_dim);
   free(C);
-  free(q);
-  free(qq);
   FreeMatrix(S_tvt, n_dim+1);
-  FreeMatrix(Wstarmix, t_samp);
-  free(mu_mix);
-  FreeMatrix(Sigma_mix, n_dim+1);
-  FreeMatrix(InvSigma_mix, n_dim+1);
-  free(sortC);
-  free(indexC);
-
-  free(label);
+
   free(vtemp);
   FreeMatrix(mtemp, n_dim+1);
   FreeMatrix(mtemp1, n_dim+1);
-   free(onedata);
-} /* main */
+  FreeWorkspace(ws);
 
+  *kept = R_NilValue;
+  if (keep) {
+    if (!stop)
+      *kept = dpKeptValue(&keep, 1);
+    FreeDPKept(keep);
+  }
+
+  if (nomem)
+    error("Out of memory error in keeping the clusters\n");
+  if (stop)
+    error("interrupted by the user\n");
+
+} /* main */
 
+/*
+ * The .Call entry of cDPecoX: args holds its arguments but kept, as
+ * they would be given to .C, and is returned updated as by .C, with
+ * pdSPar and pdSC, the clusters kept, appended
+ */
+SEXP cDPecoXCall(SEXP args) {
+  SEXP res = PROTECT(duplicate(args)), kept;
+  void **a = dotCArgs(res, 37);
+
+  cDPecoX(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8],
+	  a[9], a[10], a[11], a[12], a[13], a[14], a[15], a[16], a[17],
+	  a[18], a[19], a[20], a[21], a[22], a[23], a[24], a[25], a[26],
+	  a[27], a[28], a[29], a[30], a[31], a[32], a[33], a[34], a[35],
+	  a[36], &kept);
+  PROTECT(kept);
+  res = dotCValue(res, kept);
+  UNPROTECT(2);
+  return res;
+}
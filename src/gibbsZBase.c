@@ -7,6 +7,7 @@
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
+#include "density.h"
 #include "sample.h"
 
 void cBaseecoZ(
@@ -55,7 +56,10 @@ void cBaseecoZ(
 
 	      /* storage */
 	      int *parameter,/* 1 if save population parameter */
-	      int *Grid,
+	      int *Grid,       /* how W is drawn: 0 for Metropolis, 1 for
+				  the grid, 2 for slice sampling */
+	      int *pin_step,   /* Grid: grid points per unit length of W1 */
+	      int *pin_threads, /* most threads to use */
 
 	      /* storage for Gibbs draws of beta and Sigam, packed */
 	      double *pdSBeta, double *pdSSigma,
@@ -71,7 +75,7 @@ void cBaseecoZ(
   int t_samp = n_samp+s_samp+x1_samp+x0_samp;  /* total sample size */ 
   int n_dim = 2;          /* The dimension of the ecological table */
   int n_cov = *pinZp;     /* The dimension of the covariates */
-  int n_step = 1000;
+  int n_step = *pin_step;
   
   /* priors */
   double *beta0 = doubleArray(n_cov); /* prior mean of beta */
@@ -97,9 +101,9 @@ void cBaseecoZ(
   double **Zstar = doubleMatrix(t_samp*n_dim+n_cov, n_cov+1);
 
   /* grids */
-  double **W1g = doubleMatrix(n_samp, n_step); /* grids for W1 */
-  double **W2g = doubleMatrix(n_samp, n_step); /* grids for W2 */
-  int *n_grid = intArray(n_samp);              /* grid size */
+  gridTable *grid = NULL;                      /* grids */
+  mhLine *mh = NULL;                           /* or the W's of the Metropolis
+						  sampler as arrays */
 
   /* paramters for Wstar under Normal baseline model */
   double *beta = doubleArray(n_cov); /* vector of regression coefficients */
@@ -117,6 +121,12 @@ void cBaseecoZ(
   double *epsilon = doubleArray(t_samp*n_dim);  /* The error term */
   double **R = doubleMatrix(n_dim, n_dim);      /* ee' */
  
+  /* scratch memory for the samplers, and for each thread of the W updates */
+  Workspace *ws = newWorkspace(WS_SIZE);
+  int n_threads = nThreads(*pin_threads);
+  Workspace **tws = newWorkspaces(n_threads, WS_SIZE);
+  uint64_t seed;                                  /* of the streams of the W updates */
+
   /* misc variables */
   int i, j, k, t, l, main_loop;   /* used for various loops */
   int itemp;
@@ -134,6 +144,7 @@ void cBaseecoZ(
 
   /* get random seed */
   GetRNGstate();
+  seed = rngSeedFromR();
 
   /**read prior information*/
   itemp=0;
@@ -224,8 +235,10 @@ void cBaseecoZ(
   }
 
   /* calculate grids */
-  if (*Grid)
-    GridPrep(W1g, W2g, X, maxW1, minW1, n_grid, n_samp, n_step);
+  if (*Grid==W_GRID)
+    grid = GridPrep(X, maxW1, minW1, n_samp, n_step);
+  if (*Grid==W_METROPOLIS)
+    mh = MHPrep(X, minW1, maxW1, W, n_samp);
 
   /* starting vales of mu and Sigma */
   itemp = 0;
@@ -247,46 +260,72 @@ void cBaseecoZ(
 	for (k=0; k<n_cov; k++) 
 	  mu[i][j]+=Z[i*n_dim+j][k]*beta[k];
     
+    /* the W's are independent given beta and Sigma, and are drawn on
+       several threads; W_i uses its own stream for this sweep (the
+       Metropolis sampler one per block of W's, see rMHSweep), so the
+       draws do not depend on the number of threads */
+    if (*Grid!=W_METROPOLIS) {
+#pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1)
+      for (i=0; i<n_samp; i++) {
+	rngStream rng;
+	if ( X[i][1]!=0 && X[i][1]!=1 ) {
+	  /*1 project BVN(mu, Sigma) on the inth tomo line */
+	  /*2 sample W_i on the ith tomo line */
+	  rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+i);
+	  if (*Grid==W_GRID)
+	    rGrid(W[i], grid, i, mu[i], InvSigma, &rng, tws[threadNum()]);
+	  else
+	    rSlice(W[i], X[i], minW1[i], maxW1[i], mu[i], InvSigma, &rng);
+	  /*3 compute Wsta_i from W_i*/
+	  Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
+	  Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
+	}
+      }
+    }
+    else {
+      for (k=0; k<mh->n; k++) {
+	mh->m1[k]=mu[mh->idx[k]][0];
+	mh->m2[k]=mu[mh->idx[k]][1];
+      }
+      rMHSweep(mh, mh->m1, mh->m2, 1, InvSigma, seed,
+	       (uint64_t)main_loop*t_samp, n_threads, W, Wstar);
+    }
     for (i=0; i<n_samp; i++) {
-      if ( X[i][1]!=0 && X[i][1]!=1 ) {
-	/*1 project BVN(mu, Sigma) on the inth tomo line */
-	/*2 sample W_i on the ith tomo line */
-	if (*Grid)
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu[i], InvSigma, n_dim);
-	else
-	  rMH(W[i], X[i], minW1[i], maxW1[i], mu[i], InvSigma, n_dim);
-      } 
-      /*3 compute Wsta_i from W_i*/
-      Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
-      Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
       Z[i*n_dim][n_cov]=Wstar[i][0];
       Z[i*n_dim+1][n_cov]=Wstar[i][1];
     }
     
     /*update W2 given W1, mu and Sigma in x1 homeogeneous areas */
-    if (*x1==1)
+    if (*x1==1) {
+      dtemp1=Sigma[1][1]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
+      dtemp1=sqrt(dtemp1);
+#pragma omp parallel for private(dtemp) schedule(static) num_threads(n_threads) if(n_threads>1)
       for (i=0; i<x1_samp; i++) {
+	rngStream rng;
+	rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+n_samp+i);
 	dtemp=mu[n_samp+i][1]+Sigma[0][1]/Sigma[0][0]*(Wstar[n_samp+i][0]-mu[n_samp+i][0]);
-	dtemp1=Sigma[1][1]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
-	Rprintf("\n%14g%14g\n", dtemp, dtemp1);
-	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+i][1]=rnorm(dtemp, dtemp1);
+	Wstar[n_samp+i][1]=dtemp+dtemp1*rngNorm(&rng);
 	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
 	Z[(i+n_samp)*n_dim][n_cov]=Wstar[(i+n_samp)][0];
 	Z[(i+n_samp)*n_dim+1][n_cov]=Wstar[(i+n_samp)][1];
       }
+    }
 
     /*update W1 given W2, mu and Sigma in x0 homeogeneous areas */
-    if (*x0==1)
+    if (*x0==1) {
+      dtemp1=Sigma[0][0]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
+      dtemp1=sqrt(dtemp1);
+#pragma omp parallel for private(dtemp) schedule(static) num_threads(n_threads) if(n_threads>1)
       for (i=0; i<x0_samp; i++) {
+	rngStream rng;
+	rngSeed(&rng, seed, (uint64_t)main_loop*t_samp+n_samp+x1_samp+i);
 	dtemp=mu[n_samp+x1_samp+i][0]+Sigma[0][1]/Sigma[1][1]*(Wstar[n_samp+x1_samp+i][1]-mu[n_samp+x1_samp+i][1]);
-	dtemp1=Sigma[0][0]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
-	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+x1_samp+i][0]=rnorm(dtemp, dtemp1);
+	Wstar[n_samp+x1_samp+i][0]=dtemp+dtemp1*rngNorm(&rng);
 	W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
 	Z[(i+n_samp+x1_samp)*n_dim][n_cov]=Wstar[(i+n_samp+x1_samp)][0];
 	Z[(i+n_samp+x1_samp)*n_dim+1][n_cov]=Wstar[(i+n_samp+x1_samp)][1];
       }
+    }
 
     dcholdc(InvSigma, n_dim, mtemp);
     for (i=0; i<t_samp*n_dim; i++)
@@ -321,7 +360,7 @@ void cBaseecoZ(
       for (k=0; k<n_cov; k++)
 	Vbeta[j][k]=-SS[j][k];
     }
-    rMVN(beta, mbeta, Vbeta, n_cov);
+    rMVN(beta, mbeta, Vbeta, n_cov, NULL, ws);
 
     /*draw Sigmar give beta and Wstar */
     for(i=0; i<t_samp; i++)
@@ -341,7 +380,7 @@ void cBaseecoZ(
       for (k=0; k<n_dim; k++)
 	mtemp[j][k]=S0[j][k]+R[j][k];
     dinv(mtemp, n_dim, mtemp1);
-    rWish(InvSigma, mtemp1, nu0+t_samp, n_dim);
+    rWish(InvSigma, mtemp1, nu0+t_samp, n_dim, NULL, ws);
     dinv(InvSigma, n_dim, Sigma);
     
     /*store Gibbs draw after burn-in and every nth draws */      
@@ -381,10 +420,9 @@ void cBaseecoZ(
   FreeMatrix(S_Wstar, s_samp);
   free(minW1);
   free(maxW1);
-  free(n_grid);
   FreeMatrix(S0, n_dim);
-  FreeMatrix(W1g, n_samp);
-  FreeMatrix(W2g, n_samp);
+  if (grid) FreeGrid(grid);
+  if (mh) FreeMH(mh);
   FreeMatrix(mu,t_samp);
   FreeMatrix(Sigma,n_dim);
   FreeMatrix(InvSigma, n_dim);
@@ -403,6 +441,8 @@ void cBaseecoZ(
   FreeMatrix(Vbeta, n_cov);
   free(epsilon);
   FreeMatrix(R, n_dim);
-  
+  FreeWorkspace(ws);
+  FreeWorkspaces(tws, n_threads);
+
 } /* main */
 
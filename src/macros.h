@@ -14,6 +14,12 @@
  typedef enum e_sufficient_stats sufficient_stat;
  enum e_datapoint_types {DPT_General,DPT_Homog_X1, DPT_Homog_X0, DPT_Survey};
  typedef enum e_datapoint_types datapoint_type;
+/* quantities integrated together along the tomography line (see tomoIntegration):
+ * 0->normalizing constant, 1->W1*, 2->W2*, 3->(W1*)^2, 4->(W1*)(W2*), 5->(W2*)^2, 6->W1, 7->W2, 8->likelihood
+ * all but the normalizing constant are unnormalized, i.e. still to be divided by it
+ */
+ enum e_tomo_moments {TM_Normc, TM_W1star, TM_W2star, TM_W1star2, TM_W1W2star, TM_W2star2, TM_W1, TM_W2, TM_Lik, TM_Len};
+ typedef enum e_tomo_moments tomo_moment;
 
 /* parameters and observed data  -- no longer used*/
 struct Param_old{
@@ -52,17 +58,46 @@ struct caseParam {
   double Wbounds[2][2];  //[i][j] is {j:lower,upper}-bound of W{i+1}
   int suff; //the sufficient stat we're calculating: 0->W1, 1->W2,2->W1^2,3->W1W2,4->W2^2,7->Log Lik, 5/6,-1 ->test case
   datapoint_type dataType;
+  double weight; //number of precincts with this (X,Y), which are collapsed into one record (1 for survey data)
+  int intErr; //error code of the last failed paramIntegration on this record (0 if none)
+  double* nodes; //fixed-rule quadrature: theta-independent values at the nodes (see setQuadNodes), NULL if adaptive
   double** Z_i; //CCAR: k x 2
 };
 
 typedef struct caseParam caseParam;
 
+/**
+ * Cache of the lazy E-step (see ecoEStepLazy): what each record contributed
+ * at its last integration, and how fast its moments were moving then
+ */
+struct lazyEStep {
+  double** Wstar;    //t_samp x 5: conditional moments at the last integration
+  double** contrib;  //t_samp x (suffstat_len+1): contribution to suff and loglik
+  double** partial;  //per-block sums of contrib, as in ecoEStep
+  double* slope;     //change of the moments per unit of theta path length, HUGE_VAL until known
+  double* pathAt;    //path length of theta at the last integration
+  double path;       //path length of theta (transformed) so far
+  double tol;        //largest predicted change of a moment that is not re-integrated
+  int sinceFull;     //E-steps since the last full sweep
+  int forceFull;     //1: the next E-step is a full sweep
+  int exact;         //1: the last E-step was a full sweep
+  int nIntegrated;   //records integrated by the last E-step
+};
+
+typedef struct lazyEStep lazyEStep;
+
 /**
  * The structure that holds dataset infromation
  */
 struct setParam {
   int n_samp, t_samp, s_samp,x1_samp,x0_samp,param_len,suffstat_len; //types of data sizes
+  double t_weight; //sum of the record weights: the sample size before duplicates were collapsed
   int iter, ncar, ccar, ccar_nvar, fixedRho, sem, hypTest, verbose, calcLoglik; //options
+  int quadNodes; //0: adaptive quadrature on the tomography line, otherwise number of nodes of the fixed rule
+  int n_threads; //the most threads the E-steps may use
+  int accel; //1: SQUAREM-accelerated EM (see ecoSquarem), 0: plain EM
+  double estepSaved; //accelerated EM: E-steps saved so far relative to plain EM
+  lazyEStep* lazy; //lazy E-step cache, NULL if every record is integrated every time
   int semDone[7]; //whether that row of the R matrix is done
   int varParam[9]; //whether the parameter is included in the R matrix
   double convergence;
@@ -92,5 +127,7 @@ typedef struct Param Param;
 
 //typedef void integr_fn(double *x, int n, void *ex); //is already defined in Applic.h
 typedef double gsl_fn(double x, void *ex);
+//vector-valued integrand: fills fx[i*nvec+k], component k at point x[i]
+typedef void vec_integr_fn(double *x, int n, double *fx, int nvec, void *ex);
 
 # endif
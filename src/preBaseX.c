@@ -30,6 +30,9 @@ void preBaseX(
   double *Wstar = doubleArray(n_dim);
   double **Sigma = doubleMatrix(n_dim, n_dim);    /* The covariance matrix */
 
+  /* scratch memory for the samplers */
+  Workspace *ws = newWorkspace(WS_SIZE);
+
   /* misc variables */
   int i, j, k, main_loop;   /* used for various loops */
   int itemp=0;
@@ -48,7 +51,7 @@ void preBaseX(
     for(i=0; i<n_samp; i++) {
       mu[0] = pdmu[itempM]+pdSigma[itempS+2]/pdSigma[itempS+5]*(X[i]-pdmu[itempM+2]);
       mu[1] = pdmu[itempM+1]+pdSigma[itempS+4]/pdSigma[itempS+5]*(X[i]-pdmu[itempM+2]);
-      rMVN(Wstar, mu, Sigma, n_dim);
+      rMVN(Wstar, mu, Sigma, n_dim, NULL, ws);
       for (j=0; j<n_dim; j++)
 	pdStore[itemp++] = exp(Wstar[j])/(1+exp(Wstar[j]));
     }
@@ -73,6 +76,7 @@ void preBaseX(
   free(mu);
   free(Wstar);
   FreeMatrix(Sigma,n_dim);
-  
+  FreeWorkspace(ws);
+
 } /* main */
 
@@ -30,6 +30,9 @@ void preDP(
   double *Wstar = doubleArray(n_dim);
   double **Sigma = doubleMatrix(n_dim, n_dim);    /* The covariance matrix */
 
+  /* scratch memory for the samplers */
+  Workspace *ws = newWorkspace(WS_SIZE);
+
   /* misc variables */
   int i, j, k, main_loop;   /* used for various loops */
   int itemp = 0;
@@ -49,7 +52,7 @@ void preDP(
 	  Sigma[k][j] = Sigma[j][k];
 	}
       }
-      rMVN(Wstar, mu, Sigma, n_dim);
+      rMVN(Wstar, mu, Sigma, n_dim, NULL, ws);
       for (j=0; j<n_dim; j++)
 	pdStore[itemp++] = exp(Wstar[j])/(1+exp(Wstar[j]));
     }
@@ -72,6 +75,7 @@ void preDP(
   free(mu);
   free(Wstar);
   FreeMatrix(Sigma,n_dim);
-  
+  FreeWorkspace(ws);
+
 } /* main */
 
@@ -31,6 +31,9 @@ void preDPX(
   double *Wstar = doubleArray(n_dim);
   double **Sigma = doubleMatrix(n_dim, n_dim);    /* The covariance matrix */
 
+  /* scratch memory for the samplers */
+  Workspace *ws = newWorkspace(WS_SIZE);
+
   /* misc variables */
   int i, j, k, main_loop;   /* used for various loops */
   int itemp = 0;
@@ -49,7 +52,7 @@ void preDPX(
       Sigma[1][1] = pdSigma[itempS+3]-pdSigma[itempS+4]*pdSigma[itempS+4]/pdSigma[itempS+5];
       Sigma[0][1] = pdSigma[itempS+1]-pdSigma[itempS+2]*pdSigma[itempS+4]/pdSigma[itempS+5];
       Sigma[1][0] = Sigma[0][1];
-      rMVN(Wstar, mu, Sigma, n_dim);
+      rMVN(Wstar, mu, Sigma, n_dim, NULL, ws);
       for (j=0; j<n_dim; j++)
 	pdStore[itemp++] = exp(Wstar[j])/(1+exp(Wstar[j]));
       itempS += 6;
@@ -74,6 +77,7 @@ void preDPX(
   free(mu);
   free(Wstar);
   FreeMatrix(Sigma,n_dim);
-  
+  FreeWorkspace(ws);
+
 } /* main */
 
@@ -18,6 +18,7 @@
 #include "sample.h"
 #include "macros.h"
 #include "fintegrate.h"
+#include "density.h"
 
 /* Multivariate Normal density */
 double dMVN(
@@ -81,10 +82,13 @@ void rMVN(
 	  double *Sample,         /* Vector for the sample */
 	  double *mean,           /* The vector of means */
 	  double **Var,           /* The matrix Variance */
-	  int size)               /* The dimension */
+	  int size,               /* The dimension */
+	  rngStream *rng,         /* random numbers, NULL for R's */
+	  Workspace *ws)          /* scratch memory */
 {
   int j,k;
-  double **Model = doubleMatrix(size+1, size+1);
+  wsMark mark = wsGetMark(ws);
+  double **Model = wsDoubleMatrix(ws, size+1, size+1);
   double cond_mean;
 
   /* draw from mult. normal using SWP */
@@ -95,15 +99,15 @@ void rMVN(
     Model[j][0]=mean[j-1];
   }
   Model[0][0]=-1;
-  Sample[0]=(double)norm_rand()*sqrt(Model[1][1])+Model[0][1];
+  Sample[0]=rngNorm(rng)*sqrt(Model[1][1])+Model[0][1];
   for(j=2;j<=size;j++){
     SWP(Model,j-1,size+1);
     cond_mean=Model[j][0];
     for(k=1;k<j;k++) cond_mean+=Sample[k-1]*Model[j][k];
-    Sample[j-1]=(double)norm_rand()*sqrt(Model[j][j])+cond_mean;
+    Sample[j-1]=rngNorm(rng)*sqrt(Model[j][j])+cond_mean;
   }
 
-  FreeMatrix(Model,size+1);
+  wsRelease(ws, mark);
 }
 
 
@@ -116,20 +120,23 @@ void rWish(
 	   double **Sample,        /* The matrix with to hold the sample */
 	   double **S,             /* The parameter */
 	   int df,                 /* the degrees of freedom */
-	   int size)               /* The dimension */
+	   int size,               /* The dimension */
+	   rngStream *rng,         /* random numbers, NULL for R's */
+	   Workspace *ws)          /* scratch memory */
 {
   int i,j,k;
-  double *V = doubleArray(size);
-  double **B = doubleMatrix(size, size);
-  double **C = doubleMatrix(size, size);
-  double **N = doubleMatrix(size, size);
-  double **mtemp = doubleMatrix(size, size);
+  wsMark mark = wsGetMark(ws);
+  double *V = wsDoubleArray(ws, size);
+  double **B = wsDoubleMatrix(ws, size, size);
+  double **C = wsDoubleMatrix(ws, size, size);
+  double **N = wsDoubleMatrix(ws, size, size);
+  double **mtemp = wsDoubleMatrix(ws, size, size);
 
   for(i=0;i<size;i++) {
-    V[i]=rchisq((double) df-i-1);
+    V[i]=rngChisq(rng, (double) df-i-1);
     B[i][i]=V[i];
     for(j=(i+1);j<size;j++)
-      N[i][j]=norm_rand();
+      N[i][j]=rngNorm(rng);
   }
 
   for(i=0;i<size;i++) {
@@ -163,24 +170,21 @@ void rWish(
       for(k=0;k<size;k++)
 	Sample[i][j]+=mtemp[i][k]*C[j][k];
 
-  free(V);
-  FreeMatrix(B, size);
-  FreeMatrix(C, size);
-  FreeMatrix(N, size);
-  FreeMatrix(mtemp, size);
+  wsRelease(ws, mark);
 }
 
 /* Sample from a Dirichlet distribution */
 void rDirich(
 	     double *Sample, /* Vector for the sample */
 	     double *theta,  /* parameters */
-	     int size)       /* The dimension */
+	     int size,       /* The dimension */
+	     rngStream *rng) /* random numbers, NULL for R's */
 {
   int j;
   double dtemp=0;
 
   for (j=0; j<size; j++) {
-    Sample[j] = rgamma(theta[j], 1.0);
+    Sample[j] = rngGamma(rng, theta[j]);
     dtemp += Sample[j];
   }
   for (j=0 ; j<size; j++)
@@ -197,42 +201,18 @@ double dBVNtomo(double *Wstar,  /* Wstar values */
 		double normc)  //Normalization factor
 
 {
-  int dim=2;
-  double *MEAN=doubleArray(dim);
-  double **SIGMA=doubleMatrix(dim,dim);
   double density;
-  double rho, dtemp;
+  bvnConst bvn;
 
   Param *param=(Param *)pp;
-  MEAN[0]=param->caseP.mu[0];
-  MEAN[1]=param->caseP.mu[1];
-  SIGMA[0][0]=param->setP->Sigma[0][0];
-  SIGMA[1][1]=param->setP->Sigma[1][1];
-  SIGMA[0][1]=param->setP->Sigma[0][1];
-  SIGMA[1][0]=param->setP->Sigma[1][0];
-
-
-  rho=SIGMA[0][1]/sqrt(SIGMA[0][0]*SIGMA[1][1]);
-  dtemp=1/(2*M_PI*sqrt(SIGMA[0][0]*SIGMA[1][1]*(1-rho*rho)));
-
-
-  density=-1/(2*(1-rho*rho))*
-   ((Wstar[0]-MEAN[0])*(Wstar[0]-MEAN[0])/SIGMA[0][0]+
-    +(Wstar[1]-MEAN[1])*(Wstar[1]-MEAN[1])/SIGMA[1][1]
-    -2*rho*(Wstar[0]-MEAN[0])*(Wstar[1]-MEAN[1])/sqrt(SIGMA[0][0]*SIGMA[1][1]))
-   +log(dtemp)-log(normc);
+  setBVNConst(&bvn,param->caseP.mu[0],param->caseP.mu[1],
+              param->setP->Sigma[0][0],param->setP->Sigma[0][1],param->setP->Sigma[1][1]);
+  dBVNbatch(&Wstar[0],&Wstar[1],1,&bvn,&density,1);
+  density-=log(normc);
 
   if (give_log==0) density=exp(density);
-    /*Rprintf("s11 %5g s22 %5g normc %5g dtemp %5g ldensity %5g\n", SIGMA[0][0],SIGMA[1][1],normc, dtemp, density);
-    char ch;
-    scanf(" %c", &ch );*/
-
-  Free(MEAN);
-  FreeMatrix(SIGMA,dim);
 
   return density;
-
-
 }
 
 double invLogit(double x) {
@@ -252,3 +232,172 @@ int bit(int t, int n) {
   t=t>>n;
   return (t % 2);
 }
+
+/*
+ * Private random number streams, for code that draws on worker threads
+ * where R's global generator cannot be used.  The generator is Philox4x32-10
+ * (Salmon et al., 2011), a counter-based one: the k-th block of 4 x 32 random
+ * bits of a stream is a keyed hash of (stream, k), so the streams of a
+ * (seed, stream) pair are independent for practical purposes, any number of
+ * them can be opened at no cost, and the draws of a stream do not depend on
+ * which thread makes them.
+ * A run takes its seed from R's generator at entry (rngSeedFromR), so
+ * set.seed() still fixes the result.  Within a run, streams are numbered by
+ * whatever the caller parallelizes over (precinct, thread); rngSubseed gives
+ * independent seeds for chains, each with its own numbering of streams.
+ * A NULL stream stands for R's generator, for the serial callers.
+ */
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+/* out: the block of 4 x 32 bits of ctr under key */
+static void philox4x32(const uint32_t *ctr, const uint32_t *key, uint32_t *out) {
+  int r;
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  uint64_t p0, p1;
+  for (r = 0; r < 10; r++) {
+    p0 = (uint64_t) PHILOX_M0 * c0;
+    p1 = (uint64_t) PHILOX_M1 * c2;
+    c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+    c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t) p1;
+    c3 = (uint32_t) p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+/* 53 random bits from a and b, as a double in (0,1) */
+static double u53(uint32_t a, uint32_t b) {
+  return ((double) (a >> 5) * 67108864.0 + (double) (b >> 6) + 0.5) *
+    (1.0 / 9007199254740992.0);
+}
+
+/* the next block of the stream, in rng->buf */
+static void rngNextBlock(rngStream *rng) {
+  uint32_t out[4];
+  philox4x32(rng->ctr, rng->key, out);
+  if (++rng->ctr[0] == 0) rng->ctr[1]++;
+  rng->buf[0] = u53(out[0], out[1]);
+  rng->buf[1] = u53(out[2], out[3]);
+  rng->left = 2;
+}
+
+/* 64 random bits from R's generator; main thread only */
+uint64_t rngSeedFromR(void) {
+  uint64_t hi = (uint64_t) floor(unif_rand() * 4294967296.0);
+  uint64_t lo = (uint64_t) floor(unif_rand() * 4294967296.0);
+  return (hi << 32) ^ lo;
+}
+
+/* the seed of the sub-th substream (e.g. chain) of the run seeded with seed */
+uint64_t rngSubseed(uint64_t seed, uint64_t sub) {
+  /* the last counter word is never reached by the streams of rngSeed */
+  uint32_t ctr[4] = {(uint32_t) sub, (uint32_t) (sub >> 32), 0, 0xFFFFFFFFU};
+  uint32_t key[2] = {(uint32_t) seed, (uint32_t) (seed >> 32)};
+  uint32_t out[4];
+  philox4x32(ctr, key, out);
+  return ((uint64_t) out[1] << 32) | out[0];
+}
+
+/* the stream-th stream (stream < 2^63) of the run seeded with seed */
+void rngSeed(rngStream *rng, uint64_t seed, uint64_t stream) {
+  rng->key[0] = (uint32_t) seed;
+  rng->key[1] = (uint32_t) (seed >> 32);
+  rng->ctr[0] = 0;
+  rng->ctr[1] = 0;
+  rng->ctr[2] = (uint32_t) stream;
+  rng->ctr[3] = (uint32_t) (stream >> 32) & 0x7FFFFFFFU;
+  rng->left = 0;
+}
+
+/* uniform on (0,1) */
+double rngUnif(rngStream *rng) {
+  if (!rng) return unif_rand();
+  if (!rng->left) rngNextBlock(rng);
+  return rng->buf[2 - rng->left--];
+}
+
+/* n uniforms on (0,1) */
+void rngUnifVec(rngStream *rng, double *x, int n) {
+  int i = 0;
+  uint32_t out[4];
+  if (!rng) {
+    for (; i < n; i++) x[i] = unif_rand();
+    return;
+  }
+  /* what is left of the current block, then whole blocks */
+  for (; i < n && rng->left; i++) x[i] = rngUnif(rng);
+  for (; i + 1 < n; i += 2) {
+    philox4x32(rng->ctr, rng->key, out);
+    if (++rng->ctr[0] == 0) rng->ctr[1]++;
+    x[i] = u53(out[0], out[1]);
+    x[i+1] = u53(out[2], out[3]);
+  }
+  if (i < n) x[i] = rngUnif(rng);
+}
+
+/* standard normal, by inversion */
+double rngNorm(rngStream *rng) {
+  if (!rng) return norm_rand();
+  return qnorm(rngUnif(rng), 0.0, 1.0, 1, 0);
+}
+
+/* n standard normals */
+void rngNormVec(rngStream *rng, double *x, int n) {
+  int i;
+  if (!rng) {
+    for (i = 0; i < n; i++) x[i] = norm_rand();
+    return;
+  }
+  rngUnifVec(rng, x, n);
+  for (i = 0; i < n; i++)
+    x[i] = qnorm(x[i], 0.0, 1.0, 1, 0);
+}
+
+/* gamma with the given shape and scale 1 (Marsaglia and Tsang, 2000) */
+double rngGamma(rngStream *rng, double shape) {
+  double d, c, x, v, u;
+  if (!rng) return rgamma(shape, 1.0);
+  if (shape < 1) {
+    u = rngUnif(rng);
+    return rngGamma(rng, shape + 1) * pow(u, 1 / shape);
+  }
+  d = shape - 1.0/3;
+  c = 1 / sqrt(9 * d);
+  for (;;) {
+    do {
+      x = rngNorm(rng);
+      v = 1 + c * x;
+    } while (v <= 0);
+    v = v * v * v;
+    u = rngUnif(rng);
+    if (u < 1 - 0.0331 * x * x * x * x || log(u) < 0.5 * x * x + d * (1 - v + log(v)))
+      return d * v;
+  }
+}
+
+/* n gammas with the given shape and scale 1 */
+void rngGammaVec(rngStream *rng, double *x, int n, double shape) {
+  int i;
+  for (i = 0; i < n; i++) x[i] = rngGamma(rng, shape);
+}
+
+/* beta(a, b) */
+double rngBeta(rngStream *rng, double a, double b) {
+  double x, y;
+  if (!rng) return rbeta(a, b);
+  x = rngGamma(rng, a);
+  y = rngGamma(rng, b);
+  return x / (x + y);
+}
+
+/* chi-square with df degrees of freedom */
+double rngChisq(rngStream *rng, double df) {
+  if (!rng) return rchisq(df);
+  return 2 * rngGamma(rng, df / 2);
+}
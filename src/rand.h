@@ -5,14 +5,40 @@
   Copyright: GPL version 2 or later.
 *******************************************************************/
 
+#include <stdint.h>
+
+/* a private random number stream (Philox4x32-10), see rngSeed */
+typedef struct rngStream {
+  uint32_t key[2];   /* the seed of the run */
+  uint32_t ctr[4];   /* the next block (0, 1) and the stream (2, 3) */
+  double buf[2];     /* the uniforms of the current block */
+  int left;          /* how many of them are not used yet */
+} rngStream;
+
+/* the stream of the draws a sampler makes outside its threaded loops */
+#define RNG_SERIAL 0x7FFFFFFFFFFFFFFFULL
+
 double dMVN(double *Y, double *MEAN, double **SIG_INV, int dim, int give_log);
 double dMVT(double *Y, double *MEAN, double **SIG_INV, int nu, int dim, int give_log);
-void rMVN(double *Sample, double *mean, double **inv_Var, int size);
-void rWish(double **Sample, double **S, int df, int size);
-void rDirich(double *Sample, double *theta, int size);
+void rMVN(double *Sample, double *mean, double **inv_Var, int size,
+	  rngStream *rng, Workspace *ws);
+void rWish(double **Sample, double **S, int df, int size, rngStream *rng,
+	   Workspace *ws);
+void rDirich(double *Sample, double *theta, int size, rngStream *rng);
 double dBVNtomo(double *Wstar, void* pp, int give_log, double normc);
 double invLogit(double x);
 double logit(double x,char* emsg);
 int bit(int t, int n);
+uint64_t rngSeedFromR(void);
+void rngSeed(rngStream *rng, uint64_t seed, uint64_t stream);
+uint64_t rngSubseed(uint64_t seed, uint64_t sub);
+double rngUnif(rngStream *rng);
+void rngUnifVec(rngStream *rng, double *x, int n);
+double rngNorm(rngStream *rng);
+void rngNormVec(rngStream *rng, double *x, int n);
+double rngGamma(rngStream *rng, double shape);
+void rngGammaVec(rngStream *rng, double *x, int n, double shape);
+double rngBeta(rngStream *rng, double a, double b);
+double rngChisq(rngStream *rng, double df);
 
 
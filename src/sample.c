@@ -7,109 +7,222 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
+#include <float.h>
 #include <Rmath.h>
 #include <R_ext/Utils.h>
 #include <R.h>
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
+#include "density.h"
+#include "sample.h"
 
 
 /* Grid method samping from tomography line*/
 void rGrid(
 	   double *Sample,         /* W_i sampled from each tomography line */                 
-	   double *W1gi,           /* The grid lines of W1[i] */
-	   double *W2gi,           /* The grid lines of W2[i] */
-	   int ni_grid,            /* number of grids for observation i*/
+	   gridTable *grid,        /* The grids, see GridPrep */
+	   int i,                  /* observation i */
 	   double *mu,             /* mean vector for normal */ 
 	   double **InvSigma,      /* Inverse covariance matrix for normal */
-	   int n_dim)              /* dimension of parameters */
+	   rngStream *rng,         /* random numbers, NULL for R's */
+	   Workspace *ws)          /* scratch memory */
 {
-  int j;
-  double dtemp;
-  double *vtemp=doubleArray(n_dim);
-  double *prob_grid=doubleArray(ni_grid);     /* density by grid */
-  double *prob_grid_cum=doubleArray(ni_grid); /* cumulative density by grid */
-    
+  wsMark mark=wsGetMark(ws);
+  double *prob_grid_cum=wsDoubleArray(ws, gridSize(grid, i)); /* cumulative density by grid */
+
+  GridProb(prob_grid_cum, grid, i, mu, InvSigma);
+  rGridDraw(Sample, grid, i, prob_grid_cum, rng);
+
+  wsRelease(ws, mark);
+}
+
+/* cumulative density of W_i on the grid of its tomography line, scaled
+   so that its largest term is 1; only the quadratic form depends on mu
+   and Sigma, the rest is in the tables built by GridPrep.  Precincts
+   with the same (X, Y) and the same mu, Sigma share it */
+void GridProb(
+	      double *prob_grid_cum,  /* cumulative density by grid */
+	      gridTable *grid,        /* The grids */
+	      int i,                  /* observation i */
+	      double *mu,             /* mean vector for normal */ 
+	      double **InvSigma)      /* Inverse covariance matrix for normal */
+{
+  int j, ni_grid=gridSize(grid, i);
+  double *Lgi=grid->Lg+3*grid->start[i];
+  double d0, d1, dmax, dtemp;
+  double a=-0.5*InvSigma[0][0], b=-0.5*(InvSigma[0][1]+InvSigma[1][0]), c=-0.5*InvSigma[1][1];
+
+  /* log density, up to a constant */
+  dmax=-DBL_MAX;
+  for (j=0;j<ni_grid;j++){
+    d0=Lgi[3*j]-mu[0];
+    d1=Lgi[3*j+1]-mu[1];
+    prob_grid_cum[j]=a*d0*d0+b*d0*d1+c*d1*d1+Lgi[3*j+2];
+    if (prob_grid_cum[j]>dmax) dmax=prob_grid_cum[j];
+  }
+  /* log-sum-exp */
   dtemp=0;
   for (j=0;j<ni_grid;j++){
-    vtemp[0]=log(W1gi[j])-log(1-W1gi[j]);
-    vtemp[1]=log(W2gi[j])-log(1-W2gi[j]);
-    prob_grid[j]=dMVN(vtemp, mu, InvSigma, n_dim, 1) -
-      log(W1gi[j])-log(W2gi[j])-log(1-W1gi[j])-log(1-W2gi[j]);
-    prob_grid[j]=exp(prob_grid[j]);
-    dtemp+=prob_grid[j];
+    dtemp+=exp(prob_grid_cum[j]-dmax);
     prob_grid_cum[j]=dtemp;
   }
-  for (j=0;j<ni_grid;j++)
-    prob_grid_cum[j]/=dtemp; /*standardize prob.grid */
-
-  /*2 sample W_i on the ith tomo line */
-  j=0;
-  dtemp=unif_rand();
-  while (dtemp > prob_grid_cum[j]) j++;
-  Sample[0]=W1gi[j];
-  Sample[1]=W2gi[j];
+}
 
-  free(vtemp);
-  free(prob_grid);
-  free(prob_grid_cum);
+/* sample W_i on the ith tomo line, given GridProb */
+void rGridDraw(
+	       double *Sample,         /* W_i sampled from each tomography line */
+	       gridTable *grid,        /* The grids */
+	       int i,                  /* observation i */
+	       double *prob_grid_cum,  /* cumulative density by grid */
+	       rngStream *rng)         /* random numbers, NULL for R's */
+{
+  int lo=0, hi=gridSize(grid, i)-1, mid;
+  double dtemp=rngUnif(rng)*prob_grid_cum[hi];
 
+  /* the first grid point whose cumulative density reaches dtemp */
+  while (lo<hi) {
+    mid=(lo+hi)/2;
+    if (dtemp > prob_grid_cum[mid]) lo=mid+1;
+    else hi=mid;
+  }
+  Sample[0]=grid->W1g[grid->start[i]+lo];
+  Sample[1]=grid->W2g[grid->start[i]+lo];
 }
 
-/* preparation for Grid */
-void GridPrep(
-	      double **W1g,  /* grids holder for W1 */
-	      double **W2g,  /* grids holder for W2 */
-	      double **X,    /* data: [X Y] */
-	      double *maxW1, /* upper bound for W1 */
-	      double *minW1, /* lower bound for W1 */
-	      int *n_grid,   /* number of grids */
-	      int  n_samp,   /* sample size */
-	      int  n_step    /* step size */
+/* Builds the grids on the tomography lines, with n_step points per unit
+   length of W1 (at least 2 per observation; none if Y is 0 or 1).  The
+   grids of all observations are stored back to back, see gridTable */
+gridTable *GridPrep(
+		    double **X,    /* data: [X Y] */
+		    double *maxW1, /* upper bound for W1 */
+		    double *minW1, /* lower bound for W1 */
+		    int  n_samp,   /* sample size */
+		    int  n_step    /* 1/the length of a grid step */
 )
 {
-  int i, j;
-  double dtemp;
-  double *resid = doubleArray(n_samp);
-
-  for(i=0; i<n_samp; i++)
-    for (j=0; j<n_step; j++){
-      W1g[i][j]=0;
-      W2g[i][j]=0;
-    }
+  int i, j, ni_grid;
+  size_t n_grid;
+  double dtemp=(double)1/n_step, resid;
+  double *W1gi, *W2gi, *Lgi;
+  gridTable *grid = (gridTable *) Calloc(1, gridTable);
+
+  /* sizes */
+  grid->n_samp=n_samp;
+  grid->start=(size_t *) Calloc(n_samp+1, size_t);
+  grid->start[0]=0;
   for(i=0;i<n_samp;i++) {
-    if (X[i][1]!=0 && X[i][1]!=1) {
-      /* 1/n_step is the length of the grid */
-      dtemp=(double)1/n_step;
-      if ((maxW1[i]-minW1[i]) > (2*dtemp)) { 
-	n_grid[i]=ftrunc((maxW1[i]-minW1[i])*n_step);
-	resid[i]=(maxW1[i]-minW1[i])-n_grid[i]*dtemp;
-	/*if (maxW1[i]-minW1[i]==1) resid[i]=dtemp/4; */
-	j=0; 
-	while (j<n_grid[i]) {
-	  W1g[i][j]=minW1[i]+(j+1)*dtemp-(dtemp+resid[i])/2;
-	  if ((W1g[i][j]-minW1[i])<resid[i]/2) W1g[i][j]+=resid[i]/2;
-	  if ((maxW1[i]-W1g[i][j])<resid[i]/2) W1g[i][j]-=resid[i]/2;
-	  W2g[i][j]=(X[i][1]-X[i][0]*W1g[i][j])/(1-X[i][0]);
-	  j++;
-	}
-      }
-      else {
-	W1g[i][0]=minW1[i]+(maxW1[i]-minW1[i])/3;
-	W2g[i][0]=(X[i][1]-X[i][0]*W1g[i][0])/(1-X[i][0]);
-	W1g[i][1]=minW1[i]+2*(maxW1[i]-minW1[i])/3;
-	W2g[i][1]=(X[i][1]-X[i][0]*W1g[i][1])/(1-X[i][0]);
-	n_grid[i]=2;
+    ni_grid=0;
+    if (X[i][1]!=0 && X[i][1]!=1)
+      ni_grid=((maxW1[i]-minW1[i]) > (2*dtemp)) ? ftrunc((maxW1[i]-minW1[i])*n_step) : 2;
+    grid->start[i+1]=grid->start[i]+ni_grid;
+  }
+  /* 5 doubles per grid point, and the samplers add one more */
+  n_grid=grid->start[n_samp];
+  if (n_grid > SIZE_MAX/(6*sizeof(double))) {
+    Free(grid->start);
+    Free(grid);
+    error("The grids need too many points; use a smaller grid.points\n");
+  }
+  grid->W1g=Calloc(n_grid, double);
+  grid->W2g=Calloc(n_grid, double);
+  grid->Lg=Calloc(3*n_grid, double);
+
+  for(i=0;i<n_samp;i++) {
+    ni_grid=gridSize(grid, i);
+    W1gi=grid->W1g+grid->start[i];
+    W2gi=grid->W2g+grid->start[i];
+    Lgi=grid->Lg+3*grid->start[i];
+    if (ni_grid==0) continue;
+    if ((maxW1[i]-minW1[i]) > (2*dtemp)) { 
+      resid=(maxW1[i]-minW1[i])-ni_grid*dtemp;
+      for (j=0; j<ni_grid; j++) {
+	W1gi[j]=minW1[i]+(j+1)*dtemp-(dtemp+resid)/2;
+	if ((W1gi[j]-minW1[i])<resid/2) W1gi[j]+=resid/2;
+	if ((maxW1[i]-W1gi[j])<resid/2) W1gi[j]-=resid/2;
       }
     }
+    else {
+      W1gi[0]=minW1[i]+(maxW1[i]-minW1[i])/3;
+      W1gi[1]=minW1[i]+2*(maxW1[i]-minW1[i])/3;
+    }
+    for (j=0; j<ni_grid; j++) {
+      W2gi[j]=(X[i][1]-X[i][0]*W1gi[j])/(1-X[i][0]);
+      /* the parts of the density that do not depend on mu, Sigma */
+      Lgi[3*j]=log(W1gi[j])-log(1-W1gi[j]);
+      Lgi[3*j+1]=log(W2gi[j])-log(1-W2gi[j]);
+      Lgi[3*j+2]=-log(W1gi[j])-log(W2gi[j])-log(1-W1gi[j])-log(1-W2gi[j]);
+    }
   }
 
-  free(resid);
+  return grid;
+}
+
+void FreeGrid(gridTable *grid) {
+  Free(grid->start);
+  Free(grid->W1g);
+  Free(grid->W2g);
+  Free(grid->Lg);
+  Free(grid);
+}
+
+/* orders (X, Y, precinct) keys */
+static int cmpXY(const void *a, const void *b) {
+  const double *u=(const double *)a, *v=(const double *)b;
+  if (u[0]!=v[0]) return (u[0]<v[0]) ? -1 : 1;
+  if (u[1]!=v[1]) return (u[1]<v[1]) ? -1 : 1;
+  return (u[2]<v[2]) ? -1 : (u[2]>v[2]);
 }
 
-/* sample W via MH for 2x2 table */
+/* Finds the distinct (X, Y) among the precincts; X[i] and Y[i] are
+   compared exactly.  Cases are numbered in the order of their first
+   precinct, so without duplicates case i is precinct i.
+   returns the number of cases */
+int uniqueXY(
+	     double *X,        /* X of each precinct */
+	     double *Y,        /* Y of each precinct */
+	     int n_samp,       /* number of precincts */
+	     int *caseOf,      /* output: case of each precinct */
+	     int *first,       /* output: first precinct of each case */
+	     int *count)       /* output: number of precincts of each case */
+{
+  int i, k, n_case;
+  double *key = doubleArray(3*n_samp);  /* X, Y, precinct */
+  int *group = intArray(n_samp);        /* first precinct with the same (X, Y) */
+
+  for (i=0; i<n_samp; i++) {
+    key[3*i]=X[i]; key[3*i+1]=Y[i]; key[3*i+2]=i;
+  }
+  qsort(key, n_samp, 3*sizeof(double), cmpXY);
+  for (k=0; k<n_samp; k++) {
+    i=(int)key[3*k+2];
+    if (k>0 && key[3*k]==key[3*k-3] && key[3*k+1]==key[3*k-2])
+      group[i]=group[(int)key[3*k-1]];
+    else
+      group[i]=i; /* precincts with the same key are sorted by index */
+  }
+
+  n_case=0;
+  for (i=0; i<n_samp; i++) {
+    if (group[i]==i) {
+      first[n_case]=i;
+      count[n_case]=0;
+      caseOf[i]=n_case++;
+    }
+    else
+      caseOf[i]=caseOf[group[i]];
+    count[caseOf[i]]++;
+  }
+
+  free(key);
+  free(group);
+  return n_case;
+}
+
+/* sample W via MH for 2x2 table; the normalizing constant of the
+   target cancels, so only the quadratic forms are computed */
 void rMH(
 	 double *W,              /* previous draws */
 	 double *XY,             /* X_i and Y_i */
@@ -117,36 +230,214 @@ void rMH(
 	 double W1max,           /* upper bound for W1 */
 	 double *mu,            /* mean vector for normal */ 
 	 double **InvSigma,     /* Inverse covariance matrix for normal */
-	 int n_dim)              /* dimension of parameters */
+	 int n_dim,              /* dimension of parameters */
+	 rngStream *rng)         /* random numbers, NULL for R's */
 {
   int j;
-  double dens1, dens2, ratio;
-  double *Sample = doubleArray(n_dim);
-  double *vtemp = doubleArray(n_dim);
-  double *vtemp1 = doubleArray(n_dim);
+  double dens1, dens2, ratio, d0, d1;
+  double Sample[2];
+  double a=-0.5*InvSigma[0][0], b=-0.5*(InvSigma[0][1]+InvSigma[1][0]), c=-0.5*InvSigma[1][1];
   
   /* sample W_1 from unif(W1min, W1max) */
-  Sample[0] = runif(W1min, W1max);
+  Sample[0] = W1min+(W1max-W1min)*rngUnif(rng);
   Sample[1] = XY[1]/(1-XY[0])-Sample[0]*XY[0]/(1-XY[0]);
-  for (j = 0; j < n_dim; j++) {
-    vtemp[j] = log(Sample[j])-log(1-Sample[j]);
-    vtemp1[j] = log(W[j])-log(1-W[j]);
-  }
   /* acceptance ratio */
-  dens1 = dMVN(vtemp, mu, InvSigma, n_dim, 1) -
+  d0 = log(Sample[0])-log(1-Sample[0])-mu[0];
+  d1 = log(Sample[1])-log(1-Sample[1])-mu[1];
+  dens1 = a*d0*d0+b*d0*d1+c*d1*d1 -
     log(Sample[0])-log(Sample[1])-log(1-Sample[0])-log(1-Sample[1]);
-  dens2 = dMVN(vtemp1, mu, InvSigma, n_dim, 1) -
+  d0 = log(W[0])-log(1-W[0])-mu[0];
+  d1 = log(W[1])-log(1-W[1])-mu[1];
+  dens2 = a*d0*d0+b*d0*d1+c*d1*d1 -
     log(W[0])-log(W[1])-log(1-W[0])-log(1-W[1]);
   ratio = fmin2(1, exp(dens1-dens2));
   
   /* accept */
-  if (unif_rand() < ratio) 
+  if (rngUnif(rng) < ratio) 
     for (j=0; j<n_dim; j++) 
       W[j]=Sample[j];
-  
-  free(Sample);
-  free(vtemp);
-  free(vtemp1);
+}
+
+/* log density of W on the tomography line at W1 = W1min+(W1max-W1min) t,
+   up to a constant: the normal density of (logit(W1), logit(W2)) times
+   the Jacobian; -Inf off (0, 1) */
+static double lineLogDens(double t, double *XY, double W1min, double W1max,
+			  double *mu, double **InvSigma) {
+  double W1=W1min+(W1max-W1min)*t, W2=(XY[1]-XY[0]*W1)/(1-XY[0]);
+  double d0, d1;
+
+  if (!(W1>0 && W1<1 && W2>0 && W2<1))
+    return R_NegInf;
+  d0=log(W1)-log(1-W1)-mu[0];
+  d1=log(W2)-log(1-W2)-mu[1];
+  return -0.5*(InvSigma[0][0]*d0*d0+(InvSigma[0][1]+InvSigma[1][0])*d0*d1+
+	       InvSigma[1][1]*d1*d1) -
+    log(W1)-log(W2)-log(1-W1)-log(1-W2);
+}
+
+/* sample W via slice sampling for 2x2 table (Neal, 2003): a level under
+   the density at the current W, then W1 uniform on the line, shrinking
+   the interval towards the current W until the density is above the
+   level.  The line is bounded, so the interval starts as the whole of
+   it; every draw is kept, and none is discretized */
+void rSlice(
+	    double *W,              /* previous draws */
+	    double *XY,             /* X_i and Y_i */
+	    double W1min,           /* lower bound for W1 */
+	    double W1max,           /* upper bound for W1 */
+	    double *mu,            /* mean vector for normal */ 
+	    double **InvSigma,     /* Inverse covariance matrix for normal */
+	    rngStream *rng)         /* random numbers, NULL for R's */
+{
+  int it;
+  double t0, t, lo=0, hi=1, level;
+
+  if (!(W1max>W1min))
+    return;
+  t0=(W[0]-W1min)/(W1max-W1min);
+  level=lineLogDens(t0, XY, W1min, W1max, mu, InvSigma)+log(rngUnif(rng));
+  for (it=0; it<SLICE_MAXIT; it++) {
+    t=lo+(hi-lo)*rngUnif(rng);
+    if (lineLogDens(t, XY, W1min, W1max, mu, InvSigma) > level) {
+      W[0]=W1min+(W1max-W1min)*t;
+      W[1]=(XY[1]-XY[0]*W[0])/(1-XY[0]);
+      return;
+    }
+    if (t<t0) lo=t;
+    else hi=t;
+  }
+  /* the interval has shrunk to the current W */
+}
+
+/* Sets up the batched Metropolis sampler for the precincts whose Y is
+   not 0 or 1, starting from W; the proposal starts at the middle of the
+   bounds and is fitted in the first sweep */
+mhLine *MHPrep(
+	       double **X,    /* data: [X Y] */
+	       double *minW1, /* lower bound for W1 */
+	       double *maxW1, /* upper bound for W1 */
+	       double **W,    /* starting values */
+	       int n_samp     /* sample size */
+)
+{
+  int i, k, n=0;
+  double u;
+  mhLine *mh = (mhLine *) Calloc(1, mhLine);
+
+  for (i=0; i<n_samp; i++)
+    if (X[i][1]!=0 && X[i][1]!=1) n++;
+  mh->n=n;
+  mh->idx=intArray(n ? n : 1);  /* malloc(0) may be NULL */
+  mh->n_acc=intArray(n ? n : 1);
+  mh->X=doubleArray(n);
+  mh->Y=doubleArray(n);
+  mh->lo=doubleArray(n);
+  mh->hi=doubleArray(n);
+  mh->W1=doubleArray(n);
+  mh->W2=doubleArray(n);
+  mh->Z=doubleArray(n);
+  mh->L1=doubleArray(n);
+  mh->L2=doubleArray(n);
+  mh->LJ=doubleArray(n);
+  mh->Zm=doubleArray(n);
+  mh->Zs=doubleArray(n);
+  mh->m1=doubleArray(n);
+  mh->m2=doubleArray(n);
+  mh->u=doubleArray(2*n);
+
+  for (i=0, k=0; i<n_samp; i++)
+    if (X[i][1]!=0 && X[i][1]!=1) {
+      mh->idx[k]=i;
+      mh->n_acc[k]=0;
+      mh->X[k]=X[i][0];
+      mh->Y[k]=X[i][1];
+      mh->lo[k]=minW1[i];
+      mh->hi[k]=maxW1[i];
+      mh->W1[k]=W[i][0];
+      mh->W2[k]=W[i][1];
+      u=(W[i][0]-minW1[i])/(maxW1[i]-minW1[i]);
+      mh->Z[k]=log(u)-log(1-u);
+      mh->L1[k]=log(W[i][0])-log(1-W[i][0]);
+      mh->L2[k]=log(W[i][1])-log(1-W[i][1]);
+      mh->LJ[k]=-log(W[i][0])-log(W[i][1])-log(1-W[i][0])-log(1-W[i][1]) +
+	log(u)+log(1-u);
+      k++;
+    }
+  return mh;
+}
+
+/* One Metropolis step for all the precincts of mh, given mu and Sigma,
+   with the proposal fitted to them (see mhLineBatch) by at most MH_FIT
+   Newton steps.  The kth precinct has the mean (m1[k*ms], m2[k*ms]),
+   so that ms=0 gives them all the same one.  The precision constants
+   are set once, and the precincts are taken in blocks of MH_BLOCK on
+   n_threads threads: the block starting at the kth precinct draws all
+   of its uniforms at once from stream stream0+idx[k] of seed, so the
+   draws do not depend on the number of threads.  The new state is
+   copied to the rows of W and Wstar */
+void rMHSweep(
+	      mhLine *mh,         /* the precincts */
+	      double *m1,         /* means of logit(W1) */
+	      double *m2,         /* means of logit(W2) */
+	      int ms,             /* stride of m1, m2: 0 or 1 */
+	      double **InvSigma,  /* Inverse covariance matrix for normal */
+	      uint64_t seed,      /* random numbers */
+	      uint64_t stream0,   /* stream of the precinct in row 0 */
+	      int n_threads,      /* threads to use */
+	      double **W,         /* mutates: W and Wstar */
+	      double **Wstar)
+{
+  int b, n_block=(mh->n+MH_BLOCK-1)/MH_BLOCK;
+  double prec[3];
+
+  prec[0]=InvSigma[0][0];
+  prec[1]=0.5*(InvSigma[0][1]+InvSigma[1][0]);
+  prec[2]=InvSigma[1][1];
+
+#pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1 && n_block>1)
+  for (b=0; b<n_block; b++) {
+    int i, k, from=b*MH_BLOCK, to=(from+MH_BLOCK < mh->n) ? from+MH_BLOCK : mh->n;
+    rngStream rng;
+    rngSeed(&rng, seed, stream0+mh->idx[from]);
+    rngUnifVec(&rng, mh->u+2*from, 2*(to-from));
+    mhLineBatch(mh, from, to, m1, m2, ms, prec, MH_FIT);
+    for (k=from; k<to; k++) {
+      i=mh->idx[k];
+      W[i][0]=mh->W1[k];
+      W[i][1]=mh->W2[k];
+      Wstar[i][0]=mh->L1[k];
+      Wstar[i][1]=mh->L2[k];
+    }
+  }
+}
+
+/* adds the acceptance rates of the precincts of mh over n_iter sweeps
+   to the rows idx of rate */
+void MHAcceptRate(mhLine *mh, int n_iter, double *rate) {
+  int k;
+  for (k=0; k<mh->n; k++)
+    rate[mh->idx[k]]+=(double) mh->n_acc[k]/n_iter;
+}
+
+void FreeMH(mhLine *mh) {
+  free(mh->idx);
+  free(mh->n_acc);
+  Free(mh->X);
+  Free(mh->Y);
+  Free(mh->lo);
+  Free(mh->hi);
+  Free(mh->W1);
+  Free(mh->W2);
+  Free(mh->Z);
+  Free(mh->L1);
+  Free(mh->L2);
+  Free(mh->LJ);
+  Free(mh->Zm);
+  Free(mh->Zs);
+  Free(mh->m1);
+  Free(mh->m2);
+  Free(mh->u);
+  Free(mh);
 }
 
 
@@ -162,18 +453,20 @@ void rMH2c(
 	   int n_dim,              /* dimension of parameters */
 	   int maxit,              /* max number of iterations for
 				      rejection sampling */
-	   int reject)             /* if 1, use rejection sampling to
+	   int reject,             /* if 1, use rejection sampling to
 				      draw from the truncated Dirichlet
 				      if 0, use Gibbs sampling
 				   */  
+	   Workspace *ws)          /* scratch memory */
 {
   int iter = 100;   /* number of Gibbs iterations */
   int i, j, exceed;
   double dens1, dens2, ratio, dtemp;
-  double *Sample = doubleArray(n_dim);
-  double *param = doubleArray(n_dim);
-  double *vtemp = doubleArray(n_dim);
-  double *vtemp1 = doubleArray(n_dim);
+  wsMark mark = wsGetMark(ws);
+  double *Sample = wsDoubleArray(ws, n_dim);
+  double *param = wsDoubleArray(ws, n_dim);
+  double *vtemp = wsDoubleArray(ws, n_dim);
+  double *vtemp1 = wsDoubleArray(ws, n_dim);
   
   /* set parent Dirichlet parameter to 1 */
   for (j = 0; j < n_dim; j++)
@@ -183,7 +476,7 @@ void rMH2c(
   if (reject) { /* rejection sampling */
     i = 0; exceed = 1;
     while (exceed > 0) {
-      rDirich(vtemp, param, n_dim);
+      rDirich(vtemp, param, n_dim, NULL);
       exceed = 0;
       for (j = 0; j < n_dim; j++) 
 	if (vtemp[j] > maxU[j] || vtemp[j] < minU[j])
@@ -228,10 +521,7 @@ void rMH2c(
     for (j = 0; j < n_dim; j++)
       W[j] = Sample[j];
   
-  free(Sample);
-  free(param);
-  free(vtemp);
-  free(vtemp1);
+  wsRelease(ws, mark);
 }
 
 
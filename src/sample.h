@@ -5,12 +5,54 @@
   Copyright: GPL version 2 or later.
 *******************************************************************/
 
-void rGrid(double *Sample, double *W1gi, double *W2gi, int ni_grid, 
-	   double *mu, double **InvSigma, int n_dim); 
-void GridPrep(double **W1g, double **W2g, double **X, double *maxW1,
-	      double *minW1, int *n_grid, int n_samp, int n_step);
+/* grids on the tomography lines, built by GridPrep; the grid points of
+   observation i are start[i], ..., start[i+1]-1.  The offsets are
+   size_t: with about 1M precincts and a large grid.points, the total
+   is well past what an int holds */
+typedef struct gridTable {
+  int n_samp;      /* number of observations */
+  size_t *start;   /* offsets of the observations, n_samp+1 */
+  double *W1g;     /* W1 at the grid points */
+  double *W2g;     /* W2 at the grid points */
+  double *Lg;      /* logit(W1), logit(W2) and the log-Jacobian of the
+		      logit transformation, 3 per grid point */
+} gridTable;
+
+/* how the samplers draw W on the tomography lines: the values of their
+   Grid argument */
+enum wMethod { W_METROPOLIS = 0, W_GRID = 1, W_SLICE = 2 };
+
+#define SLICE_MAXIT 200  /* shrinkage steps of rSlice, at most */
+
+/* the batched Metropolis sampler; its state, mhLine, is in density.h */
+struct mhLine;
+
+#define MH_BLOCK 1024  /* precincts per random number stream and per task */
+#define MH_FIT 8       /* Newton steps for the proposal in a sweep, at most */
+
+#define gridSize(grid, i) ((int) ((grid)->start[(i)+1]-(grid)->start[(i)]))
+
+void rGrid(double *Sample, gridTable *grid, int i, double *mu,
+	   double **InvSigma, rngStream *rng, Workspace *ws); 
+void GridProb(double *prob_grid_cum, gridTable *grid, int i, double *mu,
+	      double **InvSigma);
+void rGridDraw(double *Sample, gridTable *grid, int i, double *prob_grid_cum,
+	       rngStream *rng);
+gridTable *GridPrep(double **X, double *maxW1, double *minW1, int n_samp,
+		    int n_step);
+void FreeGrid(gridTable *grid);
+int uniqueXY(double *X, double *Y, int n_samp, int *caseOf, int *first, int *count);
 void rMH(double *W, double *XY, double W1min, double W1max, 
-	 double *mu, double **InvSigma, int n_dim);
+	 double *mu, double **InvSigma, int n_dim, rngStream *rng);
+void rSlice(double *W, double *XY, double W1min, double W1max,
+	    double *mu, double **InvSigma, rngStream *rng);
+struct mhLine *MHPrep(double **X, double *minW1, double *maxW1, double **W,
+		      int n_samp);
+void rMHSweep(struct mhLine *mh, double *m1, double *m2, int ms, double **InvSigma,
+	      uint64_t seed, uint64_t stream0, int n_threads, double **W,
+	      double **Wstar);
+void MHAcceptRate(struct mhLine *mh, int n_iter, double *rate);
+void FreeMH(struct mhLine *mh);
 void rMH2c(double *W, double *X, double Y, double *minU, 
 	   double *maxU, double *mu, double **InvSigma, int n_dim, 
-	   int maxit, int reject);
+	   int maxit, int reject, Workspace *ws);
@@ -16,6 +16,10 @@
 #include "rand.h"
 #include "subroutines.h"
 
+/* matrices up to this size are factorized in stack buffers rather than
+   on the heap (dMVN calls ddet on every density evaluation) */
+#define SMALL_DIM 10
+
 
 /*
  * Computes the dot product of two vectors
@@ -81,7 +85,8 @@ void dinv(double **X,
 	  double **X_inv)
 {
   int i,j, k, errorM;
-  double *pdInv = doubleArray(size*size);
+  double pdBuf[SMALL_DIM*SMALL_DIM];
+  double *pdInv = (size <= SMALL_DIM) ? pdBuf : doubleArray(size*size);
 
   for (i = 0, j = 0; j < size; j++)
     for (k = 0; k <= j; k++)
@@ -113,7 +118,7 @@ void dinv(double **X,
     }
   }
 
-  Free(pdInv);
+  if (pdInv != pdBuf) Free(pdInv);
 }
 
 /* inverting a matrix, first tyring positive definite trick, and then symmetric
@@ -251,7 +256,8 @@ void dinv2D_sym(double* X,
 void dcholdc(double **X, int size, double **L)
 {
   int i, j, k, errorM;
-  double *pdTemp = doubleArray(size*size);
+  double pdBuf[SMALL_DIM*SMALL_DIM];
+  double *pdTemp = (size <= SMALL_DIM) ? pdBuf : doubleArray(size*size);
 
   for (j = 0, i = 0; j < size; j++)
     for (k = 0; k <= j; k++)
@@ -274,7 +280,7 @@ void dcholdc(double **X, int size, double **L)
     }
   }
 
-  Free(pdTemp);
+  if (pdTemp != pdBuf) Free(pdTemp);
 }
 
 /* calculate the determinant of the positive definite symmetric matrix
@@ -283,13 +289,21 @@ double ddet(double **X, int size, int give_log)
 {
   int i;
   double logdet=0.0;
-  double **pdTemp = doubleMatrix(size, size);
+  double pdBuf[SMALL_DIM*SMALL_DIM], *pdRow[SMALL_DIM];
+  double **pdTemp;
 
+  if (size <= SMALL_DIM) {
+    for (i = 0; i < size; i++)
+      pdRow[i] = pdBuf + i*size;
+    pdTemp = pdRow;
+  }
+  else
+    pdTemp = doubleMatrix(size, size);
   dcholdc(X, size, pdTemp);
   for(i = 0; i < size; i++)
     logdet += log(pdTemp[i][i]);
 
-  FreeMatrix(pdTemp, size);
+  if (size > SMALL_DIM) FreeMatrix(pdTemp, size);
   if(give_log)
     return(2.0*logdet);
   else
@@ -6,14 +6,36 @@
 *******************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include <R_ext/Utils.h>
 #include <R_ext/PrtUtil.h>
 #include <R.h>
+#include <Rinternals.h>
+#include "vector.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Heap allocation counter, compiled in with -DECO_DEBUG_ALLOC (see
+ * Makevars).  Every malloc done by the functions below is counted, so
+ * that a run can be checked to do no allocation inside its main loop.
+ */
+#ifdef ECO_DEBUG_ALLOC
+static double nHeapAlloc=0;
+#define COUNT_ALLOC(n) {   \
+  _Pragma("omp atomic")    \
+  nHeapAlloc+=(n);         \
+}
+#else
+#define COUNT_ALLOC(n)
+#endif
 
 int* intArray(int num) {
   int *iArray = (int *)malloc(num * sizeof(int));
+  COUNT_ALLOC(1);
   if (iArray)
     return iArray;
   else {
@@ -25,6 +47,7 @@ int* intArray(int num) {
 int** intMatrix(int row, int col) {
   int i;
   int **iMatrix = (int **)malloc(row * sizeof(int *));
+  COUNT_ALLOC(row+1);
   if (iMatrix) {
     for (i = 0; i < row; i++) {
       iMatrix[i] = (int *)malloc(col *  sizeof(int));
@@ -42,6 +65,7 @@ int** intMatrix(int row, int col) {
 double* doubleArray(int num) {
   //double *dArray = (double *)malloc(num * sizeof(double));
   double *dArray = Calloc(num,double);
+  COUNT_ALLOC(1);
   if (dArray)
     return dArray;
   else {
@@ -54,6 +78,7 @@ double** doubleMatrix(int row, int col) {
   int i;
   //double **dMatrix = (double **)malloc((size_t)(row * sizeof(double *)));
   double **dMatrix = Calloc(row,double*);
+  COUNT_ALLOC(row+1);
   if (dMatrix) {
     for (i = 0; i < row; i++) {
       dMatrix[i] = Calloc(col,double);
@@ -73,6 +98,7 @@ double** doubleMatrix(int row, int col) {
 double*** doubleMatrix3D(int x, int y, int z) {
   int i;
   double ***dM3 = (double ***)malloc(x * sizeof(double **));
+  COUNT_ALLOC(1);
   if (dM3) {
     for (i = 0; i < x; i++)
       dM3[i] = doubleMatrix(y, z);
@@ -86,6 +112,7 @@ double*** doubleMatrix3D(int x, int y, int z) {
 
 long* longArray(int num) {
   long *lArray = (long *)malloc(num * sizeof(long));
+  COUNT_ALLOC(1);
   if (lArray)
     return lArray;
   else {
@@ -116,5 +143,165 @@ void Free3DMatrix(double ***Matrix, int index, int row) {
 }
 
 
+/*
+ * Workspace: stack-like arena for the temporaries of the samplers.
+ * An entry point creates one with newWorkspace() and passes it down;
+ * a function that needs scratch memory saves wsGetMark(), takes its
+ * arrays with wsDoubleArray()/wsDoubleMatrix() and hands them back
+ * with wsRelease() before returning.  New blocks are only malloc'ed
+ * when the arena runs out of room and are kept afterwards, so once
+ * the first iteration has run no further heap allocation is done.
+ * A workspace must not be shared between threads.
+ */
+
+#define WS_ALIGN(n) (((n)*sizeof(double*)+sizeof(double)-1)/sizeof(double))
+
+static wsBlock* wsNewBlock(size_t size) {
+  wsBlock *b = (wsBlock *)malloc(sizeof(wsBlock));
+  if (!b)
+    error("Out of memory error in newWorkspace\n");
+  b->data = (double *)malloc(size * sizeof(double));
+  if (!b->data)
+    error("Out of memory error in newWorkspace\n");
+  b->size = size;
+  b->next = NULL;
+  COUNT_ALLOC(2);
+  return b;
+}
+
+/* size: initial capacity, in doubles */
+Workspace* newWorkspace(size_t size) {
+  Workspace *ws = (Workspace *)malloc(sizeof(Workspace));
+  if (!ws)
+    error("Out of memory error in newWorkspace\n");
+  COUNT_ALLOC(1);
+  ws->first = wsNewBlock(size > 0 ? size : 1);
+  ws->cur = ws->first;
+  ws->used = 0;
+  return ws;
+}
+
+void FreeWorkspace(Workspace *ws) {
+  wsBlock *b, *next;
+  for (b = ws->first; b; b = next) {
+    next = b->next;
+    free(b->data);
+    free(b);
+  }
+  free(ws);
+}
+
+/* n doubles of zeroed scratch memory */
+static double* wsTake(Workspace *ws, size_t n) {
+  wsBlock *b = ws->cur;
+  double *p;
+
+  if (ws->used + n > b->size) {
+    /* move on to the next block, putting in a larger one if needed */
+    if (!b->next || b->next->size < n) {
+      wsBlock *nb = wsNewBlock(n > 2*b->size ? n : 2*b->size);
+      nb->next = b->next;
+      b->next = nb;
+    }
+    ws->cur = b = b->next;
+    ws->used = 0;
+  }
+  p = b->data + ws->used;
+  ws->used += n;
+  memset(p, 0, n * sizeof(double));
+  return p;
+}
+
+wsMark wsGetMark(Workspace *ws) {
+  wsMark m;
+  m.blk = ws->cur;
+  m.used = ws->used;
+  return m;
+}
+
+void wsRelease(Workspace *ws, wsMark m) {
+  ws->cur = m.blk;
+  ws->used = m.used;
+}
 
+double* wsDoubleArray(Workspace *ws, int num) {
+  return wsTake(ws, (size_t)num);
+}
 
+double** wsDoubleMatrix(Workspace *ws, int row, int col) {
+  int i;
+  double **dMatrix = (double **)wsTake(ws, WS_ALIGN((size_t)row));
+  double *data = wsTake(ws, (size_t)row * col);
+  for (i = 0; i < row; i++)
+    dMatrix[i] = data + (size_t)i * col;
+  return dMatrix;
+}
+
+int* wsIntArray(Workspace *ws, int num) {
+  return (int *)wsTake(ws, (num*sizeof(int)+sizeof(double)-1)/sizeof(double));
+}
+
+/* one workspace per thread, for the threaded loops of the samplers */
+Workspace** newWorkspaces(int n, size_t size) {
+  int t;
+  Workspace **ws = (Workspace **)malloc(n * sizeof(Workspace *));
+  if (!ws)
+    error("Out of memory error in newWorkspaces\n");
+  COUNT_ALLOC(1);
+  for (t = 0; t < n; t++)
+    ws[t] = newWorkspace(size);
+  return ws;
+}
+
+void FreeWorkspaces(Workspace **ws, int n) {
+  int t;
+  for (t = 0; t < n; t++)
+    FreeWorkspace(ws[t]);
+  free(ws);
+}
+
+/* the number of threads a loop may use, at most n (the n.threads of
+   the caller): 1 if we already are on a worker */
+int nThreads(int n) {
+#ifdef _OPENMP
+  int m = omp_get_max_threads();
+  if (omp_in_parallel() || n < 1)
+    return 1;
+  return n < m ? n : m;
+#else
+  return 1;
+#endif
+}
+
+/* the thread we are on, to pick its workspace */
+int threadNum(void) {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+static void chkInterrupt(void *dummy) {
+  (void) dummy;
+  R_CheckUserInterrupt();
+}
+
+/* 1 if the user has interrupted; unlike R_CheckUserInterrupt() this
+   returns, so that the caller can stop its threads and free its memory
+   first.  Main thread only */
+int checkInterrupt(void) {
+  return !R_ToplevelExec(chkInterrupt, NULL);
+}
+
+/* .C entry point: count (in *count) of heap allocations since the last
+   reset, 0 if the package was built without ECO_DEBUG_ALLOC */
+void cAllocCount(int *reset, double *count) {
+#ifdef ECO_DEBUG_ALLOC
+  *count = nHeapAlloc;
+  if (*reset) nHeapAlloc = 0;
+#else
+  (void) reset;
+  *count = 0;
+#endif
+}
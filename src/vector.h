@@ -20,3 +20,37 @@ long *longArray(int num);
 void FreeMatrix(double **Matrix, int row);
 void FreeintMatrix(int **Matrix, int row);
 void Free3DMatrix(double ***Matrix, int index, int row);
+
+/* scratch arena passed down from the entry points, see vector.c */
+#define WS_SIZE 4096        /* initial size of an entry point's workspace, in doubles */
+
+typedef struct wsBlock {
+  struct wsBlock *next;
+  size_t size;              /* capacity, in doubles */
+  double *data;
+} wsBlock;
+
+typedef struct Workspace {
+  wsBlock *first;
+  wsBlock *cur;             /* block currently being filled */
+  size_t used;              /* doubles used in cur */
+} Workspace;
+
+typedef struct wsMark {
+  wsBlock *blk;
+  size_t used;
+} wsMark;
+
+Workspace *newWorkspace(size_t size);
+void FreeWorkspace(Workspace *ws);
+wsMark wsGetMark(Workspace *ws);
+void wsRelease(Workspace *ws, wsMark m);
+double *wsDoubleArray(Workspace *ws, int num);
+double **wsDoubleMatrix(Workspace *ws, int row, int col);
+int *wsIntArray(Workspace *ws, int num);
+Workspace **newWorkspaces(int n, size_t size);
+void FreeWorkspaces(Workspace **ws, int n);
+int nThreads(int n);
+int threadNum(void);
+int checkInterrupt(void);
+void cAllocCount(int *reset, double *count);